@@ -0,0 +1,441 @@
+/**
+* @file tsp_client_benchmark.cpp
+* @brief Microbenchmarks of the packet, crypto and shm_map hot paths.
+* @date     2026/10/19
+* @par Copyright(c):    2026 megatronix. All rights reserved.
+*/
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include "packages/messages.h"
+#include "packages/packet.h"
+#include "packages/packet_helper.h"
+#include "openssl_wrapper/base64.h"
+#include "openssl_wrapper/evp_cipher.h"
+#include "shm_map/base32.h"
+#include "shm_map/shm_map.h"
+
+using namespace tsp_client;
+
+// 统计operator new的次数，库中的C++分配也经过这里
+static std::atomic<uint64_t> g_allocs{0};
+
+void* operator new(std::size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+// 在benchmark循环前创建，循环后report，得到每次操作的平均分配次数
+class AllocCounter {
+public:
+    AllocCounter() : start_{g_allocs.load(std::memory_order_relaxed)} {}
+
+    void report(benchmark::State &state) const {
+        double allocs = static_cast<double>(g_allocs.load(std::memory_order_relaxed) - start_);
+        state.counters["allocs/op"] = benchmark::Counter(allocs, benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    uint64_t start_;
+};
+
+std::vector<uint8_t> random_bytes(size_t len) {
+    std::vector<uint8_t> data(len);
+    uint32_t x = 2463534242U;
+    for (auto &c : data) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        c = static_cast<uint8_t>(x);
+    }
+    return data;
+}
+
+MessageHeader make_header(uint16_t body_length) {
+    MessageHeader header{};
+    header.link_header = 202;
+    header.port_version = 200;
+    header.ack_flag = 1;
+    for (uint8_t i = 0; i < 6; ++i) {
+        header.request_id[i] = i;
+    }
+    for (uint8_t i = 0; i < 16; ++i) {
+        header.tuid[i] = static_cast<uint8_t>('A' + i);
+    }
+    header.encrypt_flag = 1;
+    header.body_length = body_length;
+    return header;
+}
+
+// 编码后约len字节的message body，random、sid、mid之后跟短TLV
+MessageBody make_body(size_t len) {
+    MessageBody body{};
+    body.random = 0x1234;
+    body.sid = 5;
+    body.mid = 200;
+    size_t remain = len;
+    uint16_t type = 4001;
+    while (remain > 3) {
+        TLV tlv{true};
+        tlv.type = type++;
+        tlv.value = random_bytes(std::min<size_t>(remain - 3, 255));
+        tlv.short_length = static_cast<uint8_t>(tlv.value.size());
+        remain -= 3 + tlv.value.size();
+        body.content.push_back(tlv);
+    }
+    return body;
+}
+
+void BM_PacketEncode(benchmark::State &state) {
+    auto payload = random_bytes(static_cast<size_t>(state.range(0)));
+    std::vector<uint8_t> buf;
+    AllocCounter allocs;
+    for (auto _ : state) {
+        buf.clear();
+        Packet pack(buf);
+        pack << uint8_t{202} << uint16_t{200} << uint32_t{0x01020304} << uint64_t{0x0102030405060708};
+        pack.serialize(payload.data(), static_cast<uint16_t>(payload.size()));
+        benchmark::DoNotOptimize(buf.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(payload.size() + 15));
+}
+BENCHMARK(BM_PacketEncode)->Arg(64)->Arg(1024)->Arg(8192);
+
+void BM_PacketDecode(benchmark::State &state) {
+    std::vector<uint8_t> buf;
+    {
+        auto payload = random_bytes(static_cast<size_t>(state.range(0)));
+        Packet pack(buf);
+        pack << uint8_t{202} << uint16_t{200} << uint32_t{0x01020304} << uint64_t{0x0102030405060708};
+        pack.serialize(payload.data(), static_cast<uint16_t>(payload.size()));
+    }
+    std::vector<uint8_t> payload(static_cast<size_t>(state.range(0)));
+    AllocCounter allocs;
+    for (auto _ : state) {
+        uint8_t u8;
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+        Packet pack(buf.data(), static_cast<uint32_t>(buf.size()));
+        pack >> u8 >> u16 >> u32 >> u64;
+        pack.parse(payload.data(), static_cast<uint16_t>(payload.size()));
+        benchmark::DoNotOptimize(pack.noerr());
+        benchmark::DoNotOptimize(payload.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(buf.size()));
+}
+BENCHMARK(BM_PacketDecode)->Arg(64)->Arg(1024)->Arg(8192);
+
+void BM_MessageHeaderSerialize(benchmark::State &state) {
+    MessageHeader header = make_header(1024);
+    std::vector<uint8_t> data;
+    AllocCounter allocs;
+    for (auto _ : state) {
+        data.clear();
+        header.serialize(data);
+        benchmark::DoNotOptimize(data.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(sizeof(MessageHeader)));
+}
+BENCHMARK(BM_MessageHeaderSerialize);
+
+void BM_MessageHeaderParse(benchmark::State &state) {
+    std::vector<uint8_t> data;
+    make_header(1024).serialize(data);
+    MessageHeader header{};
+    AllocCounter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(header.parse(data));
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(data.size()));
+}
+BENCHMARK(BM_MessageHeaderParse);
+
+void BM_MessageBodySerialize(benchmark::State &state) {
+    MessageBody body = make_body(static_cast<size_t>(state.range(0)));
+    std::vector<uint8_t> data;
+    AllocCounter allocs;
+    for (auto _ : state) {
+        data.clear();
+        body.serialize(data);
+        benchmark::DoNotOptimize(data.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(data.size()));
+}
+BENCHMARK(BM_MessageBodySerialize)->Arg(64)->Arg(1024)->Arg(8192);
+
+// MessageBody::parse读取的格式: random、sid、mid之后每个TLV为大端的type、长度和value。
+// MessageBody::serialize把每个TLV整体按字节反转后写入，不能作为parse的输入
+std::vector<uint8_t> make_body_data(const MessageBody &body) {
+    std::vector<uint8_t> data{static_cast<uint8_t>(body.random >> 8), static_cast<uint8_t>(body.random),
+                              body.sid, body.mid};
+    for (const auto &tlv : body.content) {
+        data.push_back(static_cast<uint8_t>(tlv.type >> 8));
+        data.push_back(static_cast<uint8_t>(tlv.type));
+        data.push_back(tlv.short_length);
+        data.insert(data.end(), tlv.value.begin(), tlv.value.end());
+    }
+    return data;
+}
+
+void BM_MessageBodyParse(benchmark::State &state) {
+    MessageBody expected = make_body(static_cast<size_t>(state.range(0)));
+    std::vector<uint8_t> data = make_body_data(expected);
+    {
+        MessageBody body{};
+        if (!body.parse(data) || body.content.size() != expected.content.size()) {
+            state.SkipWithError("MessageBody::parse didn't read all TLVs");
+            return;
+        }
+    }
+    AllocCounter allocs;
+    for (auto _ : state) {
+        MessageBody body{};
+        bool noerr = body.parse(data);
+        benchmark::DoNotOptimize(noerr);
+        benchmark::DoNotOptimize(body.content.data());
+        benchmark::ClobberMemory();
+    }
+    allocs.report(state);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(expected.content.size()));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(data.size()));
+}
+BENCHMARK(BM_MessageBodyParse)->Arg(64)->Arg(1024)->Arg(8192);
+
+void BM_Escape(benchmark::State &state) {
+    auto message = random_bytes(static_cast<size_t>(state.range(0)));
+    std::vector<uint8_t> escaped;
+    AllocCounter allocs;
+    for (auto _ : state) {
+        escaped.clear();
+        PackHelper::escape_message(message, escaped);
+        benchmark::DoNotOptimize(escaped.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(message.size()));
+}
+BENCHMARK(BM_Escape)->Arg(64)->Arg(1024)->Arg(8192);
+
+void BM_Unescape(benchmark::State &state) {
+    std::vector<uint8_t> escaped;
+    PackHelper::escape_message(random_bytes(static_cast<size_t>(state.range(0))), escaped);
+    escaped.push_back(87); // LinkTail
+    std::vector<uint8_t> message;
+    AllocCounter allocs;
+    for (auto _ : state) {
+        message.clear();
+        PackHelper::unescape_message(escaped, message);
+        benchmark::DoNotOptimize(message.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(escaped.size()));
+}
+BENCHMARK(BM_Unescape)->Arg(64)->Arg(1024)->Arg(8192);
+
+// 与TspProxy::encrypt/decrypt相同，每条消息创建一个AES-128-ECB的EVPCipher
+void BM_EVPCipher(benchmark::State &state, bool encrypt) {
+    EVPKey key{};
+    EVPIv iv{};
+    auto token = random_bytes(16);
+    std::copy(token.begin(), token.end(), key.begin());
+    auto input = random_bytes(static_cast<size_t>(state.range(0)));
+    if (!encrypt) {
+        EVPCipher cipher(EVP_aes_128_ecb(), key, iv, true);
+        cipher.update(input);
+        input = std::vector<uint8_t>(cipher.cbegin(), cipher.cend());
+    }
+    std::vector<uint8_t> output;
+    AllocCounter allocs;
+    for (auto _ : state) {
+        EVPCipher cipher(EVP_aes_128_ecb(), key, iv, encrypt);
+        cipher.update(input);
+        output.assign(cipher.cbegin(), cipher.cend());
+        benchmark::DoNotOptimize(output.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(input.size()));
+}
+BENCHMARK_CAPTURE(BM_EVPCipher, encrypt, true)->Arg(64)->Arg(1024)->Arg(8192);
+BENCHMARK_CAPTURE(BM_EVPCipher, decrypt, false)->Arg(64)->Arg(1024)->Arg(8192);
+
+void BM_Base64Encode(benchmark::State &state) {
+    auto data = random_bytes(static_cast<size_t>(state.range(0)));
+    std::string out(base64_encoded_len(data.size()), '\0');
+    AllocCounter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(base64_encode_to(data.data(), data.size(), &out[0]));
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(data.size()));
+}
+BENCHMARK(BM_Base64Encode)->Arg(64)->Arg(1024)->Arg(65536);
+
+void BM_Base64Decode(benchmark::State &state) {
+    auto data = random_bytes(static_cast<size_t>(state.range(0)));
+    std::string coded = base64_encode(data.data(), data.size());
+    std::vector<unsigned char> out(base64_decoded_max_len(coded.size()));
+    AllocCounter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(base64_decode_to(coded.data(), coded.size(), out.data()));
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(coded.size()));
+}
+BENCHMARK(BM_Base64Decode)->Arg(64)->Arg(1024)->Arg(65536);
+
+void BM_Base32Encode(benchmark::State &state) {
+    auto data = random_bytes(static_cast<size_t>(state.range(0)));
+    std::vector<unsigned char> coded(BASE32_LEN(data.size()) + 1);
+    AllocCounter allocs;
+    for (auto _ : state) {
+        base32_encode(data.data(), data.size(), coded.data());
+        benchmark::DoNotOptimize(coded.data());
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(data.size()));
+}
+BENCHMARK(BM_Base32Encode)->Arg(64)->Arg(1024)->Arg(65536);
+
+void BM_Base32Decode(benchmark::State &state) {
+    auto data = random_bytes(static_cast<size_t>(state.range(0)));
+    std::vector<unsigned char> coded(BASE32_LEN(data.size()) + 1);
+    base32_encode(data.data(), data.size(), coded.data());
+    size_t coded_len = BASE32_LEN(data.size());
+    std::vector<unsigned char> plain(data.size());
+    AllocCounter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(base32_decode_n(coded.data(), coded_len, plain.data(), plain.size()));
+    }
+    allocs.report(state);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(coded_len));
+}
+BENCHMARK(BM_Base32Decode)->Arg(64)->Arg(1024)->Arg(65536);
+
+void quiet_log(shmmap_log_level level, const char *fmt, ...) {
+    if (level < SHMMAP_LOG_ERROR) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+constexpr int kShmMapKeys = 4096;
+
+// 数据文件在/tmp下，每个benchmark新建一个map，结束后删除
+class ShmMapFixture {
+public:
+    ShmMapFixture() : path_{"/tmp/tsp_client_benchmark_" + std::to_string(getpid()) + ".dat"} {
+        unlink(path_.c_str());
+        map_ = shm_map_open(kShmMapKeys * 2, 64ULL * 1024 * 1024, path_.c_str(), quiet_log);
+        for (int i = 0; i < kShmMapKeys; ++i) {
+            keys_.push_back("tsp/key/" + std::to_string(i));
+        }
+    }
+
+    ~ShmMapFixture() {
+        if (map_ != nullptr) {
+            shm_map_close(map_);
+        }
+        unlink(path_.c_str());
+    }
+
+    shm_map_t *map() const { return map_; }
+    const std::string &key(size_t i) const { return keys_[i % keys_.size()]; }
+
+private:
+    std::string path_;
+    shm_map_t *map_;
+    std::vector<std::string> keys_;
+};
+
+void BM_ShmMapPut(benchmark::State &state) {
+    ShmMapFixture fixture;
+    if (fixture.map() == nullptr) {
+        state.SkipWithError("shm_map_open failed");
+        return;
+    }
+    auto value = random_bytes(static_cast<size_t>(state.range(0)));
+    size_t i = 0;
+    AllocCounter allocs;
+    for (auto _ : state) {
+        const std::string &key = fixture.key(i++);
+        shm_map_put(fixture.map(), key.data(), static_cast<uint32_t>(key.size()),
+                    reinterpret_cast<const char *>(value.data()), static_cast<uint32_t>(value.size()));
+    }
+    allocs.report(state);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(value.size()));
+}
+BENCHMARK(BM_ShmMapPut)->Arg(16)->Arg(256)->Arg(4096);
+
+void BM_ShmMapGet(benchmark::State &state) {
+    ShmMapFixture fixture;
+    if (fixture.map() == nullptr) {
+        state.SkipWithError("shm_map_open failed");
+        return;
+    }
+    auto value = random_bytes(static_cast<size_t>(state.range(0)));
+    for (size_t i = 0; i < kShmMapKeys; ++i) {
+        const std::string &key = fixture.key(i);
+        shm_map_put(fixture.map(), key.data(), static_cast<uint32_t>(key.size()),
+                    reinterpret_cast<const char *>(value.data()), static_cast<uint32_t>(value.size()));
+    }
+    // value复制到调用者的buffer中，按实际复制的字节数统计
+    std::vector<char> out(value.size());
+    int64_t bytes = 0;
+    size_t i = 0;
+    AllocCounter allocs;
+    for (auto _ : state) {
+        const std::string &key = fixture.key(i++);
+        uint32_t v_len = 0;
+        const char *v = shm_map_get(fixture.map(), key.data(), static_cast<uint32_t>(key.size()), &v_len);
+        if (v != nullptr && v_len <= out.size()) {
+            memcpy(out.data(), v, v_len);
+            bytes += v_len;
+        }
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    allocs.report(state);
+    if (bytes != static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(value.size())) {
+        state.SkipWithError("shm_map_get missed keys");
+        return;
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_ShmMapGet)->Arg(16)->Arg(256)->Arg(4096);
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,153 @@
+//
+// Offline decoder of the binary frame trace written by common::FrameTrace.
+//
+// usage: frame_trace_dump <trace file> [conn id]
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "common/frame_trace.h"
+
+using common::FrameTraceFileHeader;
+using common::FrameTraceRecord;
+
+struct trace_entry_t {
+    FrameTraceRecord record;
+    uint64_t data_pos;
+};
+
+static bool is_valid_record(const FrameTraceRecord &rec, uint64_t pos, uint64_t capacity) {
+    if (rec.magic != common::kFrameTraceRecordMagic) {
+        return false;
+    }
+    if (rec.direction != static_cast<uint8_t>(common::FrameDirection::kRx)
+        && rec.direction != static_cast<uint8_t>(common::FrameDirection::kTx)
+        && rec.direction != static_cast<uint8_t>(common::FrameDirection::kPadding)) {
+        return false;
+    }
+    return pos + sizeof(FrameTraceRecord) + rec.length <= capacity;
+}
+
+static uint64_t record_span(const FrameTraceRecord &rec) {
+    uint64_t size = sizeof(FrameTraceRecord) + rec.length;
+    return (size + common::kFrameTraceAlign - 1U) & ~static_cast<uint64_t>(common::kFrameTraceAlign - 1U);
+}
+
+/**
+ * Walk the ring from the oldest byte. After a wrap the oldest bytes may be the
+ * tail of an overwritten record, so invalid positions are skipped word by word.
+ */
+static std::vector<trace_entry_t> collect_records(const std::vector<uint8_t> &ring, const FrameTraceFileHeader &hdr) {
+    std::vector<trace_entry_t> entries;
+    const uint64_t capacity = hdr.capacity;
+    const bool wrapped = hdr.write_pos > capacity;
+    const uint64_t start = wrapped ? hdr.write_pos % capacity : 0U;
+    const uint64_t length = wrapped ? capacity : hdr.write_pos;
+    uint64_t walked = 0U;
+    while (walked + sizeof(FrameTraceRecord) <= length) {
+        const uint64_t pos = (start + walked) % capacity;
+        if (pos + sizeof(FrameTraceRecord) > capacity) {
+            walked += capacity - pos;
+            continue;
+        }
+        FrameTraceRecord rec{};
+        memcpy(&rec, ring.data() + pos, sizeof(rec));
+        if (!is_valid_record(rec, pos, capacity)) {
+            walked += common::kFrameTraceAlign;
+            continue;
+        }
+        if (rec.direction != static_cast<uint8_t>(common::FrameDirection::kPadding)) {
+            entries.push_back({rec, pos + sizeof(FrameTraceRecord)});
+        }
+        walked += record_span(rec);
+    }
+    std::sort(entries.begin(), entries.end(), [](const trace_entry_t &a, const trace_entry_t &b) {
+        return a.record.sequence < b.record.sequence;
+    });
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const trace_entry_t &a, const trace_entry_t &b) {
+        return a.record.sequence == b.record.sequence;
+    }), entries.end());
+    return entries;
+}
+
+static void print_time(uint64_t timestamp_ns) {
+    std::time_t secs = static_cast<std::time_t>(timestamp_ns / 1000000000U);
+    struct tm tm_tmp{};
+    localtime_r(&secs, &tm_tmp);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm_tmp);
+    printf("%s.%06llu", buf, static_cast<unsigned long long>((timestamp_ns % 1000000000U) / 1000U));
+}
+
+static void print_hex(const uint8_t *data, uint32_t size) {
+    for (uint32_t line = 0; line < size; line += 16U) {
+        printf("    %04x: ", line);
+        for (uint32_t i = 0; i < 16U; ++i) {
+            if (line + i < size) {
+                printf("%02x ", data[line + i]);
+            } else {
+                printf("   ");
+            }
+        }
+        printf(" |");
+        for (uint32_t i = 0; i < 16U && line + i < size; ++i) {
+            uint8_t c = data[line + i];
+            putchar((c >= 0x20 && c < 0x7F) ? c : '.');
+        }
+        printf("|\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <trace file> [conn id]" << std::endl;
+        return 1;
+    }
+    bool filter_conn = argc > 2;
+    uint32_t conn_filter = filter_conn ? static_cast<uint32_t>(strtoul(argv[2], nullptr, 10)) : 0U;
+
+    std::ifstream file(argv[1], std::ifstream::binary);
+    if (!file) {
+        std::cerr << "open " << argv[1] << " failed" << std::endl;
+        return 1;
+    }
+    FrameTraceFileHeader hdr{};
+    file.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+    if (!file || hdr.magic != common::kFrameTraceFileMagic) {
+        std::cerr << argv[1] << " is not a frame trace file" << std::endl;
+        return 1;
+    }
+    if (hdr.version != common::kFrameTraceVersion) {
+        std::cerr << "unsupported frame trace version " << hdr.version << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> ring(hdr.capacity);
+    file.seekg(hdr.header_size, std::ios_base::beg);
+    file.read(reinterpret_cast<char *>(ring.data()), static_cast<std::streamsize>(ring.size()));
+    if (!file) {
+        std::cerr << "trace file is truncated" << std::endl;
+        return 1;
+    }
+
+    std::vector<trace_entry_t> entries = collect_records(ring, hdr);
+    printf("capacity:%llu records written:%llu records kept:%zu\n",
+           static_cast<unsigned long long>(hdr.capacity),
+           static_cast<unsigned long long>(hdr.record_count), entries.size());
+    for (const auto &entry : entries) {
+        const FrameTraceRecord &rec = entry.record;
+        if (filter_conn && rec.conn_id != conn_filter) {
+            continue;
+        }
+        print_time(rec.timestamp_ns);
+        printf(" #%llu conn:%u %s len:%u\n", static_cast<unsigned long long>(rec.sequence), rec.conn_id,
+               rec.direction == static_cast<uint8_t>(common::FrameDirection::kTx) ? "TX" : "RX", rec.length);
+        print_hex(ring.data() + entry.data_pos, rec.length);
+    }
+    return 0;
+}
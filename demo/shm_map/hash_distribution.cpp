@@ -0,0 +1,131 @@
+//
+// 比较shm_map_hash与之前的h*31+c hash在VIN/TUID前缀key上的分布和速度
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "shm_map/shm_map.h"
+
+namespace {
+
+// 之前shm_map.c中的hash_code和hash
+uint64_t legacy_hash(const void *key, uint32_t k_len)
+{
+    const char *k = static_cast<const char *>(key);
+    int h = 0;
+    for (uint32_t i = 0; i < k_len; ++i) {
+        h = 31 * h + static_cast<int>(k[i]);
+    }
+    h ^= (h >> 20) ^ (h >> 12);
+    return static_cast<uint32_t>(h ^ (h >> 7) ^ (h >> 4));
+}
+
+using HashFn = uint64_t (*)(const void *, uint32_t);
+
+// 同一批车辆的VIN只有末尾的序号不同，TUID和信号名在所有车辆间重复
+std::vector<std::string> make_keys(std::size_t vehicles, std::size_t signals)
+{
+    static const char *names[] = {"speed", "soc", "gear", "odometer", "tbox_id", "gps/lat", "gps/lon", "door/fl"};
+    std::vector<std::string> keys;
+    char buf[128];
+    keys.reserve(vehicles * signals);
+    for (std::size_t v = 0; v < vehicles; ++v) {
+        for (std::size_t s = 0; s < signals; ++s) {
+            snprintf(buf, sizeof(buf), "LSVAU2180N2%06zu/%08zX/%s/%zu", 100000 + v, 0x5A000000 + v * 16 + s % 4,
+                     names[s % 8], s);
+            keys.emplace_back(buf);
+        }
+    }
+    return keys;
+}
+
+struct Distribution {
+    double avg_probe;
+    uint32_t max_probe;
+    uint32_t min_segment;
+    uint32_t max_segment;
+    std::size_t slot_hash_collisions;
+};
+
+// 按map的方式使用hash：先选择64个段中的一个(legacy用乘法散列，新hash用高位)，
+// 每段是一张负载不超过3/4的线性探测表，用hash的低32位定位
+Distribution measure(const std::vector<std::string> &keys, HashFn fn, bool legacy)
+{
+    std::vector<std::vector<uint32_t>> segments(64);
+    std::unordered_set<uint32_t> slot_hashes;
+    Distribution d{0.0, 0U, 0U, 0U, 0U};
+    uint64_t probes = 0;
+
+    for (const auto &k : keys) {
+        uint64_t h = fn(k.data(), static_cast<uint32_t>(k.size()));
+        uint32_t seg = legacy ? (static_cast<uint32_t>(h) * 0x9E3779B1U) >> 26 : static_cast<uint32_t>(h >> 58);
+        segments[seg].push_back(static_cast<uint32_t>(h));
+        if (!slot_hashes.insert(static_cast<uint32_t>(h)).second) {
+            d.slot_hash_collisions++;
+        }
+    }
+    d.min_segment = static_cast<uint32_t>(segments[0].size());
+    for (const auto &hashes : segments) {
+        std::size_t slot_len = 16U;
+        while (slot_len * 3 < hashes.size() * 4) {
+            slot_len <<= 1;
+        }
+        std::vector<uint8_t> used(slot_len, 0U);
+        for (uint32_t h : hashes) {
+            std::size_t i = h & (slot_len - 1);
+            uint32_t n = 1U;
+            while (used[i] != 0U) {
+                i = (i + 1) & (slot_len - 1);
+                ++n;
+            }
+            used[i] = 1U;
+            probes += n;
+            d.max_probe = n > d.max_probe ? n : d.max_probe;
+        }
+        d.min_segment = hashes.size() < d.min_segment ? static_cast<uint32_t>(hashes.size()) : d.min_segment;
+        d.max_segment = hashes.size() > d.max_segment ? static_cast<uint32_t>(hashes.size()) : d.max_segment;
+    }
+    d.avg_probe = static_cast<double>(probes) / static_cast<double>(keys.size());
+    return d;
+}
+
+double ns_per_key(const std::vector<std::string> &keys, HashFn fn)
+{
+    uint64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < 10; ++r) {
+        for (const auto &k : keys) {
+            sink += fn(k.data(), static_cast<uint32_t>(k.size()));
+        }
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if (sink == 42U) {
+        printf(" ");
+    }
+    return static_cast<double>(ns) / static_cast<double>(keys.size() * 10);
+}
+
+void report(const char *name, const std::vector<std::string> &keys, HashFn fn, bool legacy)
+{
+    Distribution d = measure(keys, fn, legacy);
+    printf("%-8s avg probe %6.2f, max probe %6u, segment keys %u..%u, slot hash collisions %zu, %.1f ns/key\n", name,
+           d.avg_probe, d.max_probe, d.min_segment, d.max_segment, d.slot_hash_collisions, ns_per_key(keys, fn));
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+    std::size_t vehicles = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000U;
+    std::size_t signals = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 16U;
+    std::vector<std::string> keys = make_keys(vehicles, signals);
+
+    printf("%zu keys like %s\n", keys.size(), keys.front().c_str());
+    report("legacy", keys, legacy_hash, true);
+    report("wyhash", keys, shm_map_hash, false);
+    return 0;
+}
@@ -10,6 +10,8 @@
 #include <sstream>
 #include <map>
 #include "shm_map/shm_map.h"
+#include "shm_map/shm_map.hpp"
+#include "shm_map/m_pool.h"
 #include "shm_map/base32.h"
 
 void strings_to_bytes(const std::string &str, std::vector<uint8_t> &data){
@@ -67,33 +69,42 @@ void base32_encode_data_to_string(std::vector<uint8_t> &data, std::string &str_e
 }
 
 void base32_decode_string_array(const std::string &str_encode, std::vector<uint8_t>& plain_data){
-    std::string decode;
-    decode.resize(UNBASE32_LEN(strlen(str_encode.c_str())));
-    base32_decode((uint8_t*)str_encode.c_str(), (uint8_t*)&decode[0]);
-    for(auto c : decode) {
-        plain_data.push_back(c);
-    }
-    while(plain_data.back() != 255 && plain_data.size() > 0){
-        plain_data.pop_back();
-    }
-    if(plain_data.size() > 0) {
-        plain_data.pop_back();
+    // 解码结果的长度由输入长度和填充决定，不需要再去掉末尾的字节
+    plain_data.resize(UNBASE32_LEN(str_encode.size()));
+    size_t n = base32_decode_n((const uint8_t*)str_encode.data(), str_encode.size(), plain_data.data(), plain_data.size());
+    plain_data.resize(n == BASE32_ERROR ? 0 : n);
+}
+
+// 新建的内存池在第一次分配前被mp_recover(重启或崩溃后)，仍然可以分配
+bool test_recover_after_init(){
+    std::vector<uint64_t> buf(64 * 1024 / sizeof(uint64_t));
+    M_pool pool{};
+    if(!mp_init(&pool, (char*)buf.data(), buf.size() * sizeof(uint64_t), NULL, false)){
+        return false;
     }
+    uint64_t free_size = mp_free_size(&pool);
+    mp_recover(&pool);
+    bool ok = mp_free_size(&pool) == free_size && mp_alloc(&pool, 64) != NULL;
+    printf("recover after init: %s, free %llu bytes\n", ok ? "ok" : "failed", (unsigned long long)mp_free_size(&pool));
+    return ok;
 }
 
 int main() {
     std::cout << "Hello, World!" << std::endl;
+    if(!test_recover_after_init()){
+        return -1;
+    }
 
     std::vector<uint8_t> data{0, 255, 0, 1, 2, 3, 0, 0, 1, 2, 3};
 
     print_vector(data);
-    //std::string encode_str;
-    //base32_encode_data_to_string(data, encode_str);
-    //printf("encode str: %s\n", encode_str.c_str());
+    std::string encode_str;
+    base32_encode_data_to_string(data, encode_str);
+    printf("encode str: %s\n", encode_str.c_str());
 
-    //std::vector<uint8_t> vec_plain_data;
-    //base32_decode_string_array(encode_str, vec_plain_data);
-    //print_vector(vec_plain_data);
+    std::vector<uint8_t> vec_plain_data;
+    base32_decode_string_array(encode_str, vec_plain_data);
+    print_vector(vec_plain_data);
 
 
     map_init(100, 500*1024, "shmmap.dat", NULL);
@@ -120,6 +131,44 @@ int main() {
             print_vector(vec_data);
         }
     }
+
+    // 二进制key可以包含0，不需要先做base32编码
+    std::vector<uint8_t> bin_key{0, 255, 't', 'b', 'o', 'x', 0, 1};
+    shm_map::put(bin_key, data);
+    {
+        // view存在期间value保持有效，即使key被再次put
+        shm_map::ValueView view = shm_map::get(bin_key);
+        shm_map::put(bin_key, std::vector<uint8_t>{1, 2, 3});
+        if (view) {
+            print_vector(std::vector<uint8_t>(view.begin(), view.end()));
+        }
+    }
+    shm_map::ValueView current = shm_map::get(bin_key);
+    print_vector(std::vector<uint8_t>(current.begin(), current.end()));
+    current.reset();
+
+    // 一个周期内的多个信号批量写入，每个段只加一次锁
+    double signals[3]{12.5, 80.0, 1.0};
+    shm_map_kv batch[3]{
+        {"/vehicle/speed", 14, sizeof(double), (const char*)&signals[0]},
+        {"/vehicle/soc", 12, sizeof(double), (const char*)&signals[1]},
+        {"/vehicle/gear", 13, sizeof(double), (const char*)&signals[2]},
+    };
+    map_put_batch(batch, 3);
+    for (auto& kv : batch) {
+        kv.value = nullptr;
+    }
+    if (map_get_batch(batch, 3) == 3) {
+        printf("speed %.1f, soc %.1f, gear %.0f\n", *(const double*)batch[0].value,
+               *(const double*)batch[1].value, *(const double*)batch[2].value);
+    }
+
+    // 监控进程可以不加锁定期读取
+    shm_map_stats stats = shm_map::ShmMap::default_map().stats();
+    printf("entries %llu, load %.2f, probe avg %.2f max %u, used %llu/%llu bytes, lock waits %llu\n",
+           (unsigned long long)stats.entries, stats.load_factor, stats.avg_probe, stats.max_probe,
+           (unsigned long long)stats.memory.real_used_size, (unsigned long long)stats.memory.pool_size,
+           (unsigned long long)(stats.segment_lock_contended + stats.pool_lock_contended));
     exit(0);
     int cmd;
     uint32_t v_len{0};
@@ -149,7 +198,7 @@ int main() {
                 m_free_list_info();
                 break;
             case 5:
-                printf("free size: %d\n", m_free_size());
+                printf("free size: %llu\n", (unsigned long long)m_free_size());
                 break;
 
         }
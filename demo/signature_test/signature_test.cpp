@@ -7,6 +7,7 @@
 #include <sstream>
 #include "openssl_wrapper/signature.h"
 #include "openssl_wrapper/evp_cipher.h"
+#include "openssl_wrapper/credential_cache.h"
 
 void strings_to_bytes(const std::string &str, std::vector<uint8_t> &data){
     for(auto c : str) {
@@ -42,9 +43,48 @@ void test_aes_128(){
     std::cout << str_token << std::endl;
 }
 
+// 登录签名 sha256(md5(公钥文件)的大写hex + deviceTime) 不经过缓存计算
+bool sign_uncached(const std::string &file_name, uint64_t device_tm, std::vector<uint8_t> &sign){
+    std::ifstream file(file_name.c_str(), std::ifstream::binary);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    unsigned char buf[EVP_MAX_MD_SIZE];
+    uint32_t buf_size{0};
+    if(!file || openssl_md5(reinterpret_cast<const unsigned char*>(content.data()), content.size(), buf, &buf_size) != 1){
+        return false;
+    }
+    std::string str_input = digest_to_hex(std::vector<uint8_t>(buf, buf + buf_size), true) + std::to_string(device_tm);
+    if(openssl_sha256(reinterpret_cast<const unsigned char*>(str_input.data()), str_input.size(), buf, &buf_size) != 1){
+        return false;
+    }
+    sign.assign(buf, buf + buf_size);
+    return true;
+}
+
+// 缓存的登录签名与不缓存的计算结果一致，公钥文件更新后也一致
+bool test_login_signature(){
+    std::string file_name{"/tmp/signature_test_public_key.pem"};
+    for(const char* key : {"-----BEGIN PUBLIC KEY-----\nfirst\n", "-----BEGIN PUBLIC KEY-----\nrotated key\n"}){
+        std::ofstream(file_name.c_str(), std::ofstream::binary | std::ofstream::trunc) << key;
+        for(uint64_t device_tm : {0ULL, 1700000000123ULL, 1700000000124ULL}){
+            std::vector<uint8_t> expected;
+            std::vector<uint8_t> actual;
+            if(!sign_uncached(file_name, device_tm, expected) ||
+               !CredentialCache::instance().login_signature(file_name, device_tm, actual) || actual != expected){
+                std::cout << "login signature mismatch, device time:" << device_tm << std::endl;
+                return false;
+            }
+        }
+    }
+    std::cout << "login signature ok" << std::endl;
+    return true;
+}
+
 int main() {
     std::cout << "Hello, World!" << std::endl;
     test_aes_128();
+    if(!test_login_signature()){
+        return -1;
+    }
     std::vector<uint8_t> tm{1,2,3};
     std::string str_tm(tm.data(), tm.data() + tm.size());
     std::cout << str_tm << std::endl;
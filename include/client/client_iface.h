@@ -27,6 +27,9 @@ namespace tsp_client {
         uint8_t msg_tail_size{1};
         uint8_t terminal_mark{0};
         std::string ifc{};
+        std::string frame_trace_file{};         // 非空时以二进制格式记录收发的frame
+        std::string str_public_key_path{};      // 终端证书公钥文件, 用于登录签名, 为空时不签名
+        uint64_t frame_trace_size{4U << 20U};   // frame trace环形文件大小
     };
     /**
      * @brief high availability (re)connection states
@@ -35,6 +35,11 @@ namespace tsp_client {
 
         void update_config(const tsp_client::tls_tcp_config &config);
 
+        /**
+         * @brief current config, including the public key file used for the login signature
+         */
+        const tsp_client::tls_tcp_config& get_config() const;
+
     public:
 
         void publish(const std::string &topic, const std::vector<uint8_t> &message);
@@ -16,6 +16,8 @@ public:
     uint8_t body_length_index{29};    /**< 消息头中body length起始字节位 */
     uint8_t body_length_size{2};      /**< body length的字节个数 */
     std::string ifc{};
+    std::string frame_trace_file{};   /**< 二进制frame trace文件, 为空时不记录 */
+    std::string public_key_path{};    /**< 登录签名用的终端证书公钥文件, 为空时不签名 */
 
 public:
     bool load_config(const std::string &config_path);
@@ -0,0 +1,146 @@
+/**
+* @file clock_source.h
+* @brief Injectable time source for timers, reconnect back off and sender sleeps.
+* @details Code that waits for time to pass asks common::clock() instead of
+ * std::chrono::steady_clock and std::this_thread. The process uses the real
+ * monotonic clock unless a test installs a SimulatedClock with set_clock().
+ *
+ * Every clock source owns the TimerService that schedules timers in its time,
+ * TimerService::instance() returns the service of the installed clock. On a
+ * SimulatedClock the timers fire synchronously inside advance(), in expiry
+ * order, so hours of heartbeats and back off run in milliseconds.
+* @date     2026/10/19
+* @par Copyright(c):    2026 megatronix. All rights reserved.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+namespace common {
+
+class TimerService;
+
+class ClockSource
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    ClockSource();
+    virtual ~ClockSource();
+
+    ClockSource(const ClockSource&) = delete;
+    ClockSource& operator=(const ClockSource&) = delete;
+
+    virtual Clock::time_point now() const = 0;
+
+    /**
+     * \brief Block the calling thread until the clock reaches tp.
+     */
+    virtual void sleep_until(Clock::time_point tp) = 0;
+
+    void sleep_for(Clock::duration duration) { sleep_until(now() + duration); }
+
+    /**
+     * \brief Whether time only moves when advanced explicitly.
+     */
+    virtual bool is_simulated() const { return false; }
+
+    /**
+     * \brief The timer service running in the time of this clock, created on
+     * first use.
+     */
+    TimerService& timer_service();
+
+protected:
+    /**
+     * \brief The timer service if it was created already, else nullptr.
+     */
+    TimerService* created_timer_service() const;
+
+    /**
+     * \brief Stop and destroy the timer service. Derived clocks call this in
+     * their destructor, the service calls now() until it is gone.
+     */
+    void destroy_timer_service();
+
+private:
+    mutable std::mutex service_mutex_;
+    std::unique_ptr<TimerService> timer_service_;
+};
+
+/**
+ * \brief The monotonic clock of the system.
+ */
+class SystemClockSource : public ClockSource
+{
+public:
+    ~SystemClockSource() override;
+
+    Clock::time_point now() const override { return Clock::now(); }
+    void sleep_until(Clock::time_point tp) override;
+};
+
+/**
+ * \brief A clock that stands still until advanced. Threads sleeping on it are
+ * woken and timers of its service are fired as time passes.
+ */
+class SimulatedClock : public ClockSource
+{
+public:
+    explicit SimulatedClock(Clock::time_point start = Clock::time_point{} + std::chrono::hours(1));
+    ~SimulatedClock() override;
+
+    Clock::time_point now() const override;
+    void sleep_until(Clock::time_point tp) override;
+    bool is_simulated() const override { return true; }
+
+    /**
+     * \brief Move the time forward by duration, see advance_to().
+     */
+    void advance(Clock::duration duration);
+
+    /**
+     * \brief Move the time forward to tp. Time stops at every timer expiry on
+     * the way, so periodic timers fire once per period and in order.
+     */
+    void advance_to(Clock::time_point tp);
+
+    /**
+     * \brief Number of threads currently blocked in sleep_until().
+     */
+    std::size_t sleeper_count() const;
+
+    /**
+     * \brief Wait (in real time) until at least count threads sleep on this
+     * clock, so a test can advance once the code under test is idle.
+     *
+     * \return false if timeout passed first
+     */
+    bool wait_for_sleepers(std::size_t count, std::chrono::milliseconds timeout);
+
+private:
+    mutable std::mutex mutex_;
+    std::condition_variable time_cv_;
+    std::condition_variable sleepers_cv_;
+    Clock::time_point now_;
+    std::size_t sleepers_{0U};
+};
+
+/**
+ * \brief The clock source used by the process.
+ */
+ClockSource& clock();
+
+/**
+ * \brief Install a clock source, nullptr restores the system clock. Install it
+ * before creating the timers and clients that should run on it; they keep the
+ * service they were created with.
+ */
+void set_clock(ClockSource* source);
+
+} /* namespace common */
@@ -0,0 +1,122 @@
+/**
+* @file frame_trace.h
+* @brief Binary frame trace written into a memory mapped ring file.
+* @details Raw frames are appended together with a timestamp, the direction and
+ * the connection id, no text formatting happens on the hot path. The trace file
+ * is decoded offline by demo/frame_trace_dump.
+ *
+ * File layout:
+ * FrameTraceFileHeader  (sizeof(FrameTraceFileHeader) bytes)
+ * Ring data             (capacity bytes, records aligned to 8 bytes)
+ *
+ * Each record is a FrameTraceRecord header followed by length bytes of frame
+ * data. A record never wraps around the end of the ring, a kPadding record
+ * fills the rest of the ring instead.
+* @date     2026/10/19
+* @par Copyright(c):    2026 megatronix. All rights reserved.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace common {
+
+constexpr uint32_t kFrameTraceFileMagic = 0x54524654U;   // "TFRT"
+constexpr uint32_t kFrameTraceRecordMagic = 0x4D415246U; // "FRAM"
+constexpr uint16_t kFrameTraceVersion = 1U;
+constexpr uint32_t kFrameTraceAlign = 8U;
+
+enum class FrameDirection : uint8_t {
+    kRx = 0,
+    kTx = 1,
+    kPadding = 0xFF,
+};
+
+struct FrameTraceFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t capacity;      // 环形区的字节数
+    uint64_t write_pos;     // 逻辑写位置, 单调递增, 物理位置为 write_pos % capacity
+    uint64_t record_count;  // 已写入的记录数(含被覆盖的)
+};
+
+struct FrameTraceRecord {
+    uint32_t magic;
+    uint32_t length;        // frame数据长度, 不含记录头和对齐
+    uint64_t sequence;
+    uint64_t timestamp_ns;  // system_clock, 纳秒
+    uint32_t conn_id;
+    uint8_t direction;
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(FrameTraceFileHeader) % kFrameTraceAlign == 0, "header must keep ring aligned");
+static_assert(sizeof(FrameTraceRecord) % kFrameTraceAlign == 0, "record header must keep ring aligned");
+
+class FrameTrace {
+public:
+    /**
+     * \brief Process wide trace instance used by the socket layer.
+     */
+    static FrameTrace& instance();
+
+    FrameTrace() = default;
+    ~FrameTrace();
+
+    FrameTrace(const FrameTrace&) = delete;
+    FrameTrace& operator=(const FrameTrace&) = delete;
+
+    /**
+     * \brief Map the ring file, creating it when needed. An existing trace file
+     * with the same capacity is continued, otherwise it is reinitialized.
+     *
+     * \param path     trace file path
+     * \param capacity ring size in bytes
+     * \return whether tracing is enabled
+     */
+    bool open(const std::string& path, uint64_t capacity);
+
+    /**
+     * \brief Unmap the ring file and disable tracing.
+     */
+    void close();
+
+    /**
+     * \brief Whether frames are being traced. Call sites use this to skip their
+     * text dumps.
+     */
+    bool is_enabled() const { return enabled_; }
+
+    /**
+     * \brief Append a frame to the ring. Does nothing if tracing is disabled.
+     */
+    void record(FrameDirection direction, uint32_t conn_id, const uint8_t* data, uint32_t size);
+
+    void record(FrameDirection direction, uint32_t conn_id, const std::vector<uint8_t>& data) {
+        record(direction, conn_id, data.data(), static_cast<uint32_t>(data.size()));
+    }
+
+    /**
+     * \brief Allocate a connection id for the trace records.
+     */
+    static uint32_t next_conn_id();
+
+private:
+    void write_bytes(const void* src, uint64_t size);
+
+    std::mutex mutex_;
+    std::atomic_bool enabled_{false};
+    std::string path_{};
+    uint8_t* map_{nullptr};
+    uint64_t map_size_{0};
+    FrameTraceFileHeader* header_{nullptr};
+    uint8_t* ring_{nullptr};
+};
+
+} /* namespace common */
@@ -41,26 +41,24 @@
  */
 /**
 * @file timer.h
-* @brief Implements a Timer that owns a separate thread.
-* @details The thread is running as long as the timer is running. However, it
- * consumes CPU time only when the timer
- * fires, is stopped, or its expiration point is updated.
+* @brief Implements a Timer scheduled on the process wide TimerService.
+* @details All timers of the process share the timing wheel and the single
+ * thread of common::TimerService, a Timer itself owns no thread.
  *
  * Note that it is guaranteed that no locks are held while the stored
- * TimerHandler is called.
+ * TimerHandler is called. Handlers run on the shared service thread and should
+ * return quickly.
 * @author		qiangwang
 * @date		    2022/7/18
 * @par Copyright(c): 	2022 megatronix. All rights reserved.
 */
 #pragma once
 
-#include <atomic>
 #include <chrono>
-#include <condition_variable>
 #include <functional>
 #include <mutex>
-#include <thread>
 #include <boost/any.hpp>
+#include "common/timer_service.h"
 
 namespace common{
 class Timer
@@ -69,7 +67,7 @@ public:
     /**
      * \brief Typedef for the chrono clock used by this Timer.
      */
-    typedef std::chrono::steady_clock Clock;
+    typedef TimerService::Clock Clock;
 
     /**
      * \brief Typedef for the callback called when the timer fires.
@@ -102,8 +100,14 @@ public:
     Timer(timer_handler a_timer_handler, Mode timer_mode);
 
     /**
-     * \brief Destructor that implicitly stops the timer and joins the timer
-     * handler thread.
+     * \brief Constructor to build a new Timer scheduled on the given service
+     * instead of the process wide one. The new timer is stopped.
+     */
+    Timer(timer_handler a_timer_handler, Mode timer_mode, TimerService& service);
+
+    /**
+     * \brief Destructor that implicitly stops the timer and waits for a running
+     * timer handler.
      */
     virtual ~Timer() noexcept;
 
@@ -140,6 +144,12 @@ public:
 
     void start_periodic_delayed(Timer::Clock::duration period, uint64_t u_period_count, const boost::any& user_data = boost::any());
 
+    /**
+     * \brief Allow the timer to fire up to slack after its expiry point, so its
+     * wakeups can be shared with other timers. Applies from the next expiry on.
+     */
+    void set_slack(Clock::duration slack);
+
     /**
      * \brief Determine whether the timer is currently running, i.e., will fire at
      * some point in the future.
@@ -158,7 +168,8 @@ public:
     void stop() noexcept;
 
     /**
-     * \brief Stop and join thread run thread of the timer.
+     * \brief Stop the timer and wait until a running timer handler returns.
+     * Does not wait when called from the timer handler itself.
      */
     void stop_and_join_run_thread();
 
@@ -176,14 +187,15 @@ public:
     Clock::duration get_time_remaining() const;
 protected:
     /**
-     * \brief The Method executed in the thread, firing the actual notification.
+     * \brief Called by the TimerService when the timer expires, fires the
+     * handler and re-arms periodic timers.
      */
-    void run();
+    void on_expired();
 
     /**
-     * \brief The Method executed in the thread, firing the actual notification.
+     * \brief Arm the service node for next_expiry_point_. Called with mutex_ held.
      */
-    void run_backoff();
+    void arm();
 
     /**
      * \brief The function to call when the timer expires.
@@ -195,25 +207,31 @@ protected:
      */
     Mode mode_;
 
+    /**
+     * \brief Whether periodic intervals follow the backoff algorithm.
+     */
+    bool backoff_{false};
+
     /**
      * \brief The max count of the timer
      */
     uint16_t max_count_{};
 
     /**
-     * \brief Flag to indicate to thread_ whether it should terminate.
+     * \brief Number of expiries of a count periodic timer.
      */
-    std::atomic_bool exit_requested_{false};
+    uint16_t fire_count_{};
 
     /**
      * \brief Flag to indicate whether the timer is currently active.
      */
-    std::atomic_bool running_{false};
+    bool running_{false};
 
     /**
-     * \brief Flag to indicate whether the work thread joined.
+     * \brief Incremented on every start and stop, so an expiry that raced with
+     * a restart does not re-arm the timer.
      */
-    std::atomic_bool joined_{false};
+    uint64_t generation_{0U};
 
     /**
      * \brief The period of a periodic timer. The value is only valid if mode ==
@@ -221,6 +239,11 @@ protected:
      */
     Clock::duration period_{};
 
+    /**
+     * \brief How late the timer may fire, see set_slack().
+     */
+    Clock::duration slack_{};
+
     uint64_t u_start_value_{}, u_period_count_{};
 
     /**
@@ -235,21 +258,22 @@ protected:
     boost::any user_data_;
 
     /**
-     * \brief Mutex used by thread_ to wait on.
+     * \brief Mutex protecting the timer state.
      *
      * Declared as mutable so access from const members is thread safe.
      */
     mutable std::mutex mutex_;
 
     /**
-     * \brief Condition Variable used by thread_ to wait on.
+     * \brief The service the timer is scheduled on. Taken at construction so
+     * the service outlives static timers.
      */
-    std::condition_variable condition_variable_;
+    TimerService& service_;
 
     /**
-     * \brief The Thread handling the timer notification.
+     * \brief The entry of this timer in the TimerService.
      */
-    std::thread thread_;
+    TimerService::Node node_;
 };
 
 } /* namespace common */
@@ -0,0 +1,187 @@
+/**
+* @file timer_service.h
+* @brief Process wide timer scheduler shared by all common::Timer instances.
+* @details Timers are kept in a hierarchical timing wheel with a resolution of
+ * one millisecond: 4 levels of 256 slots cover about 49 days, later expiries
+ * wait in an overflow list. Arming and cancelling a timer is O(1). A timerfd
+ * is armed for the next non empty slot; when it expires coarse slots are
+ * cascaded into finer ones and the expired timers are fired one after another.
+ *
+ * A timer may carry slack, the time it may fire late. Its expiry is rounded up
+ * to a power of two granularity not exceeding the slack, so timers with nearby
+ * expiries share a single wakeup.
+ *
+ * The process wide instance waits for its timerfd on an own thread. A service
+ * created without a thread exposes an epoll fd instead: add it to an event loop
+ * and call dispatch() whenever it is readable. A service on a simulated clock
+ * has neither, the clock dispatches it while advancing (see clock_source.h).
+ *
+ * Timer callbacks are called on the service thread without any lock held, so a
+ * long running callback delays all other timers of the process and should hand
+ * its work over to another thread.
+* @date     2026/10/19
+* @par Copyright(c):    2026 megatronix. All rights reserved.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace common {
+
+class ClockSource;
+
+class TimerService
+{
+public:
+    /**
+     * \brief Typedef for the chrono clock used by the service.
+     */
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * \brief A schedulable entry. The owner keeps the node alive as long as it
+     * may be scheduled and cancels it (waiting for a running callback) before
+     * destroying it.
+     */
+    class Node
+    {
+    public:
+        explicit Node(std::function<void()> callback) : callback_{std::move(callback)} {}
+        Node(const Node&) = delete;
+        Node& operator=(const Node&) = delete;
+
+    private:
+        friend class TimerService;
+        std::function<void()> callback_;
+        Node* prev_{nullptr};
+        Node* next_{nullptr};
+        uint64_t expiry_tick_{0U};
+        int32_t level_{-1};     // -1: not in the wheel
+        uint32_t slot_{0U};
+        bool ready_{false};     // expired, waiting to be fired
+    };
+
+    /**
+     * \brief The service of the process clock, see common::clock().
+     */
+    static TimerService& instance();
+
+    /**
+     * \brief Create a service on the system clock.
+     *
+     * \param own_thread dispatch expiries on a service thread. Without it the
+     * owner calls dispatch() when fd() becomes readable.
+     */
+    explicit TimerService(bool own_thread = true);
+
+    /**
+     * \brief Create a service on the given clock. own_thread is ignored for
+     * simulated clocks.
+     */
+    TimerService(ClockSource& clock, bool own_thread);
+    ~TimerService();
+
+    TimerService(const TimerService&) = delete;
+    TimerService& operator=(const TimerService&) = delete;
+
+    /**
+     * \brief Arm or re-arm a node to fire at expiry. Expiry points in the past
+     * fire as soon as possible.
+     *
+     * \param slack how much later than expiry the node may fire, used to
+     * coalesce wakeups with other nodes
+     */
+    void schedule(Node& node, Clock::time_point expiry, Clock::duration slack = Clock::duration::zero());
+
+    /**
+     * \brief Disarm a node.
+     *
+     * \param wait_if_firing block until the node's callback returns if it is
+     * running right now, unless called from the callback itself.
+     */
+    void cancel(Node& node, bool wait_if_firing);
+
+    /**
+     * \brief Whether the node is armed or expired but not yet fired.
+     */
+    bool is_scheduled(const Node& node) const;
+
+    /**
+     * \brief Number of armed nodes.
+     */
+    std::size_t size() const;
+
+    /**
+     * \brief The current time of the service's clock.
+     */
+    Clock::time_point now() const;
+
+    /**
+     * \brief The time of the next wheel event (an expiry or a cascade of a
+     * coarse slot).
+     *
+     * \return false if no node is armed
+     */
+    bool next_event(Clock::time_point& tp) const;
+
+    /**
+     * \brief The epoll fd that becomes readable when nodes expire, for services
+     * created without an own thread.
+     */
+    int fd() const { return epoll_fd_; }
+
+    /**
+     * \brief Fire all expired nodes and re-arm the timerfd. Called by the
+     * service thread, or by the owner's event loop when fd() is readable.
+     */
+    void dispatch();
+
+private:
+    static constexpr uint32_t kWheelBits = 8U;
+    static constexpr uint32_t kWheelSlots = 1U << kWheelBits;
+    static constexpr uint32_t kWheelLevels = 4U;
+    static constexpr int32_t kOverflowLevel = static_cast<int32_t>(kWheelLevels);
+    static constexpr uint64_t kNoTick = ~static_cast<uint64_t>(0U);
+
+    void run();
+    void arm_timerfd(uint64_t tick);
+    uint64_t to_tick_ceil(Clock::time_point tp) const;
+    uint64_t to_tick_floor(Clock::time_point tp) const;
+    Clock::time_point to_time_point(uint64_t tick) const;
+
+    void link(Node* node);
+    void unlink(Node* node);
+    void cascade(uint32_t level, uint32_t slot);
+    void process_tick(uint64_t tick);
+    void advance(uint64_t now_tick);
+    uint64_t next_event_tick() const;
+    int32_t find_slot(uint32_t level, uint32_t from) const;
+
+    mutable std::mutex mutex_;
+    std::condition_variable idle_cv_;
+    ClockSource& clock_;
+    int epoll_fd_{-1};
+    int timer_fd_{-1};
+    int event_fd_{-1};                   // wakes the service thread on exit
+    Clock::time_point epoch_;
+    uint64_t current_tick_{0U};          // next tick to process
+    uint64_t planned_wakeup_{kNoTick};   // tick the timerfd is armed for
+    Node* slots_[kWheelLevels][kWheelSlots]{};
+    uint64_t occupied_[kWheelLevels][kWheelSlots / 64U]{};
+    Node* overflow_{nullptr};
+    std::size_t size_{0U};
+    std::deque<Node*> ready_;
+    Node* firing_{nullptr};
+    std::thread::id dispatcher_{};       // thread running the callbacks
+    bool exit_requested_{false};
+    std::thread thread_;
+};
+
+} /* namespace common */
@@ -4,6 +4,9 @@
 //
 #ifndef BASE64_H_C0CE2A47_D10E_42C9_A27C_C883944E704A
 #define BASE64_H_C0CE2A47_D10E_42C9_A27C_C883944E704A
+#include <cstddef>
+#include <istream>
+#include <ostream>
 #include <string>
 #include <vector>
 #if __cplusplus >= 201703L
@@ -15,6 +18,56 @@ std::string base64_encode_mime(std::string const& s);
 std::string base64_decode(std::string const& s, bool remove_linebreaks = false);
 std::vector<unsigned char> base64_decode_binary(std::string const& s);
 std::string base64_encode(unsigned char const*, size_t len, bool url = false);
+
+//
+// Encoding into and decoding from caller provided buffers, without any
+// allocation. Bulk data is handled by SSSE3/AVX2 or NEON code when the
+// machine has it.
+//
+size_t base64_encoded_len(size_t len);
+size_t base64_decoded_max_len(size_t len);
+// out holds base64_encoded_len(len) characters, returns the number written
+size_t base64_encode_to(unsigned char const* in, size_t len, char* out, bool url = false);
+// out holds base64_decoded_max_len(len) bytes, returns the number written.
+// Throws std::runtime_error on characters outside of both alphabets.
+size_t base64_decode_to(char const* in, size_t len, unsigned char* out);
+
+//
+// Incremental encoding of data that arrives in pieces. update() keeps up to
+// two bytes for the next call, out holds base64_encoded_len(len) + 4
+// characters. finish() writes the last group with padding, at most 4.
+//
+class Base64Encoder {
+public:
+    explicit Base64Encoder(bool url = false);
+    size_t update(unsigned char const* in, size_t len, char* out);
+    size_t finish(char* out);
+
+private:
+    bool url_;
+    unsigned char pending_[3];
+    size_t pending_len_;
+};
+
+//
+// Incremental decoding, line breaks ('\n', '\r') are skipped. update() out
+// holds base64_decoded_max_len(len) + 3 bytes, finish() at most 3.
+// Both throw std::runtime_error on invalid data.
+//
+class Base64Decoder {
+public:
+    Base64Decoder();
+    size_t update(char const* in, size_t len, unsigned char* out);
+    size_t finish(unsigned char* out);
+
+private:
+    char pending_[4];
+    size_t pending_len_;
+};
+
+// Encode or decode a stream, e.g. a file, in chunks of 48 KiB
+void base64_encode_stream(std::istream& in, std::ostream& out, bool url = false);
+void base64_decode_stream(std::istream& in, std::ostream& out);
 #if __cplusplus >= 201703L
 //
 // Interface with std::string_view rather than const std::string&
@@ -0,0 +1,47 @@
+/**
+* @file credential_cache.h
+* @brief Precomputed login signature state on top of the file digest cache.
+* @date     2026/10/19
+* @par Copyright(c):    2026 megatronix. All rights reserved.
+*/
+
+#ifndef TSP_CLIENT_CREDENTIAL_CACHE_H
+#define TSP_CLIENT_CREDENTIAL_CACHE_H
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "openssl_wrapper/signature.h"
+
+/**
+ * Login signature state of the public key files. The md5 of a file comes
+ * from FileDigestCache, so the file is read again only after it was replaced
+ * or modified. The sha256 state after the md5 prefix is kept until the md5
+ * changes, a login after a reconnect only hashes the device time.
+ */
+class CredentialCache {
+public:
+    static CredentialCache& instance();
+
+    /**
+     * Login signature sha256(upper case hex of md5(public key file) + device
+     * time in decimal). Returns false if the file can't be read.
+     */
+    bool login_signature(const std::string &public_key_path, uint64_t device_time, std::vector<uint8_t> &signature);
+
+    void clear();
+
+private:
+    struct Entry {
+        std::vector<uint8_t> md5;
+        std::shared_ptr<const EVPDigest> login_prefix;
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+};
+
+#endif //TSP_CLIENT_CREDENTIAL_CACHE_H
@@ -6,7 +6,95 @@
 #define TSP_CLIENT_MD5_H
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
 int openssl_sha256(const unsigned char *data,  uint32_t data_size, unsigned char *out, uint32_t *out_size);
 
 int openssl_md5(const unsigned char *data,  uint32_t data_size, unsigned char *out, uint32_t *out_size);
+
+class EVPDigestException : public std::runtime_error {
+public:
+    EVPDigestException()
+            : std::runtime_error("EVP digest error"), err_code{ERR_peek_last_error()}, err_msg_buf{0} {}
+
+    virtual const char *what() {
+        return ERR_error_string(err_code, err_msg_buf);
+    }
+
+    unsigned long err_code;
+    char err_msg_buf[128];
+};
+
+/**
+ * Incremental message digest, e.g. EVPDigest(EVP_sha256()). update() can be
+ * called any number of times, final() returns the digest and starts over.
+ * Throws EVPDigestException when OpenSSL fails.
+ */
+class EVPDigest {
+public:
+    explicit EVPDigest(const EVP_MD *type);
+    // Copies the state, e.g. to finish a common prefix with different suffixes
+    EVPDigest(const EVPDigest &other);
+    EVPDigest& operator=(const EVPDigest &other) = delete;
+
+    void update(const void *data, size_t len);
+    void update(const std::vector<uint8_t> &data) { update(data.data(), data.size()); }
+    std::vector<uint8_t> final();
+    void reset();
+
+    size_t size() const { return static_cast<size_t>(EVP_MD_size(type_)); }
+
+private:
+    struct CtxFree {
+        void operator()(EVP_MD_CTX *ctx) const;
+    };
+
+    const EVP_MD *type_;
+    std::unique_ptr<EVP_MD_CTX, CtxFree> ctx_;
+};
+
+/**
+ * Digest of a file, read in chunks. Returns false if the file can't be
+ * read.
+ */
+bool digest_file(const EVP_MD *type, const std::string &path, std::vector<uint8_t> &digest);
+
+/**
+ * Hex string of a digest, e.g. for the md5 of the public key file used in
+ * the login signature.
+ */
+std::string digest_to_hex(const std::vector<uint8_t> &digest, bool upper_case = false);
+
+/**
+ * Digests of files that rarely change, such as certificates and keys.
+ * A digest is computed again only when the size, mtime or inode of the file
+ * differs from when it was cached, checking that costs one stat() per call.
+ */
+class FileDigestCache {
+public:
+    static FileDigestCache& instance();
+
+    bool get(const EVP_MD *type, const std::string &path, std::vector<uint8_t> &digest);
+    void clear();
+
+private:
+    struct Entry {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        int64_t mtime_ns;
+        std::vector<uint8_t> digest;
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+};
 #endif //TSP_CLIENT_MD5_H
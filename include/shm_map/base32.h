@@ -26,6 +26,7 @@
 #define __BASE32_H_
 
 #include <stddef.h>   // size_t
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -40,11 +41,34 @@ extern "C" {
 
 /**
  * Returns the length of the output buffer required to decode a base32 string
- * of len characters. Please note that len must be a multiple of 8 as per
- * definition of a base32 string. This is a macro to allow users to define
- * buffer size at compilation time.
+ * of len characters. This is exact for an unpadded string and an upper bound
+ * when it is padded. This is a macro to allow users to define buffer size at
+ * compilation time.
+ */
+#define UNBASE32_LEN(len)  (((len)/8)*5 + ((len)%8)*5/8)
+
+/**
+ * Returned by the decoding functions for an invalid base32 string or when
+ * the output buffer is too small.
+ */
+#define BASE32_ERROR ((size_t)-1)
+
+/**
+ * State of an incremental encoding, see base32_encode_update().
+ */
+typedef struct base32_encoder {
+    unsigned char pending[5];   // octets of an incomplete sequence
+    uint32_t pending_len;
+} base32_encoder;
+
+/**
+ * State of an incremental decoding, see base32_decode_update().
  */
-#define UNBASE32_LEN(len)  (((len)/8)*5)
+typedef struct base32_decoder {
+    unsigned char pending[8];   // characters of an incomplete sequence
+    uint32_t pending_len;
+    int finished;               // a padded sequence was decoded, nothing may follow
+} base32_decoder;
 
 /**
  * Encode the data pointed to by plain into base32 and store the
@@ -56,6 +80,37 @@ extern "C" {
  **/
 void base32_encode(const unsigned char *plain, size_t len, unsigned char *coded);
 
+/**
+ * Encode data that arrives in pieces. base32_encode_update() encodes the
+ * whole 5 octet sequences of the data given so far and keeps the rest for
+ * the next call; "coded" must have room for BASE32_LEN(len) + 8 characters.
+ * base32_encode_final() writes the last, padded sequence, at most 8
+ * characters. Both return the number of characters written.
+ **/
+void base32_encoder_init(base32_encoder *encoder);
+size_t base32_encode_update(base32_encoder *encoder, const unsigned char *plain, size_t len, unsigned char *coded);
+size_t base32_encode_final(base32_encoder *encoder, unsigned char *coded);
+
+/**
+ * Decode the len characters pointed to by coded into the plain_len bytes
+ * pointed to by plain. The last sequence may be padded or not.
+ * Returns the length of the decoded data, or BASE32_ERROR if a character
+ * is not in the [A-Z2-7=] set, padding is followed by data, or the decoded
+ * data doesn't fit into plain.
+ **/
+size_t base32_decode_n(const unsigned char *coded, size_t len, unsigned char *plain, size_t plain_len);
+
+/**
+ * Decode a string that arrives in pieces, with the same rules as
+ * base32_decode_n(). The functions return the number of octets written
+ * into "plain" or BASE32_ERROR; base32_decode_update() writes at most
+ * UNBASE32_LEN(len) + 5 octets, base32_decode_final() at most 4.
+ **/
+void base32_decoder_init(base32_decoder *decoder);
+size_t base32_decode_update(base32_decoder *decoder, const unsigned char *coded, size_t len,
+                            unsigned char *plain, size_t plain_len);
+size_t base32_decode_final(base32_decoder *decoder, unsigned char *plain, size_t plain_len);
+
 /**
  * Decode the null terminated string pointed to by coded and write
  * the decoded data into the location pointed to by plain. The
@@ -63,7 +118,9 @@ void base32_encode(const unsigned char *plain, size_t len, unsigned char *coded)
  * space to store the whole decoded string.
  * Returns the length of the decoded string. This may be less than
  * expected due to padding. If an invalid base32 character is found
- * in the coded string, decoding will stop at that point.
+ * in the coded string, decoding will stop at that point; 0 is returned
+ * if the characters before it are not a valid base32 string.
+ * Kept for existing callers, use base32_decode_n() instead.
  **/
 size_t base32_decode(const unsigned char *coded, unsigned char *plain);
 
@@ -1,6 +1,6 @@
 /**
  *
- * 基于各种尺寸大小的空闲块链实现的内存池
+ * 小块按尺寸分级从slab分配，大块从可合并的边界标记区分配的内存池
  *
  * @file m_pool.h
  * @author chosen0ne
@@ -15,16 +15,42 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #define padding(p) *((uint32_t *)p) = 0
 #define NIL -1
-/* 允许内存块的最大值为 8*128 = 1Kb */
-#define FREE_LIST_SIZE 128
+
+/*
+ * 内存池内偏移量的位数。64位平台默认64位，内存池可以超过4G；
+ * 32位平台默认32位，节省索引的空间。数据文件头部记录位数，位数不同的文件不能打开
+ */
+#ifndef SHMMAP_OFFSET_BITS
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define SHMMAP_OFFSET_BITS 64
+#else
+#define SHMMAP_OFFSET_BITS 32
+#endif
+#endif
+/* slab的尺寸级数，最大的级为1Kb，更大的内存从大块区分配 */
+#define SLAB_CLASS_NUM 24
+#define SLAB_MAX_SIZE 1024
+/* 一个slab占用的字节数 */
+#define SLAB_SIZE (16 * 1024)
+/* 大块空闲链的个数，第i个链的块大小在[2^(i+5), 2^(i+6)) */
+#define LARGE_BIN_NUM 59
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#if SHMMAP_OFFSET_BITS == 64
+typedef uint64_t M_offset;
+#else
+typedef uint32_t M_offset;
+#endif
+/* NIL转换为偏移量类型后的值 */
+#define NIL_OFFSET ((M_offset)NIL)
+
 typedef enum {
 	SHMMAP_LOG_DEBUG,
 	SHMMAP_LOG_INFO,
@@ -37,58 +63,120 @@ typedef enum {
 typedef void (*shmmap_log)(shmmap_log_level level, const char *fmt, ...);
 
 /*
-	空闲块大小是8bytes的倍数，便于字节对齐
-	8:
-	16:
-	...
-	8n:
-	对于每个空闲块大小都有一个链表，组织所有的空闲块。
-	对于一个内存申请请求，需要提供所请求内存的大小len，
-	在空闲块列表free_list中查找恰好可以容纳len的空闲块链n8_list。
-	然后在n8_list中返回空闲块。
-	空闲块列表，就是数组：
+	内存池由头部和大块区组成。
+	大块区的每个块首尾各有8字节的边界标记，记录块大小和是否在使用，
+	释放时与前后相邻的空闲块合并。空闲块按大小挂在large_bins的链上：
 	-----------
-	| 8bytes  | --> block --> block --> block
+	| 32bytes | --> block --> block
 	|----------
-	| 16bytes | --> block
+	| 64bytes | --> block
 	|----------
 	|	...	  |
-	|---------|
-	| 8nbytes |
 	-----------
-	空闲块的结构：
+	申请时在对应的链中找最合适的块(best fit)，找不到时取更大链中的块，
+	多余的部分切分后放回空闲链。
+	不超过SLAB_MAX_SIZE的内存申请按尺寸分级，从该级的slab中分配。slab是从大块区
+	申请的SLAB_SIZE字节的块，切分为同样大小的对象。slab中的对象全部释放后，
+	slab还给大块区，所以释放的小块内存可以被其他尺寸复用。
+	大块区中的块：
+	---------------------------------------------
+	| size | 		payload			| size |
+	---------------------------------------------
+	分配出去的内存的结构：
 	{--------------头部-----------------}
 	-------------------------------------------------
-	| index | prev | next | data length | 	data	|
+	| index | data length | prev | next | 	data	|
 	-------------------------------------------------
-
+	index是slab的尺寸级或M_LARGE_IDX；对于slab中的对象，prev是所在slab的偏移量，
+	next是slab中空闲对象链的下一个。块的起始地址按8字节对齐。
  */
 
+/* 从大块区直接分配的块的index */
+#define M_LARGE_IDX 0x7FFFFFFF
+/* slab中已释放对象的index标记 */
+#define M_FREE_FLAG 0x80000000
+
 /*
- * 空闲块的头部
+ * 分配出去的块的头部
  */
 typedef struct m_block_hdr {
 	uint32_t idx;
-	uint32_t prev_offset;
-	uint32_t next_offset;
 	uint32_t data_len;
+	M_offset prev_offset;
+	M_offset next_offset;
 } M_block_hdr;
 
-// 分配内存时从header删除m_node，回收内存时在tail添加m_node
+// 空闲块链，插入和删除都在header
 typedef struct m_header {
-	uint32_t header_offset;
-	uint32_t tail_offset;
+	M_offset header_offset;
+	M_offset tail_offset;
 	uint32_t size;		// 链表的长度
 	uint32_t idx;
 } M_header;
 
+/* 共享内存中的内存池头部，定义在m_pool.c */
+struct m_pool_hdr;
+
+/*
+ * 一个内存池在本进程中的状态，指向共享内存中的索引。
+ * 同一块共享内存可以由多个M_pool访问，多个内存池互相独立
+ */
+typedef struct m_pool {
+	struct m_pool_hdr *hdr;		// 内存池头部，包括空闲链、slab和统计
+	void *pool_ptr_s;			// 共享内存的起始地址
+	void *pool_ptr_e;			// 共享内存的结束地址
+	uint64_t pool_byte_size;	// 内存池包含的字节数
+	shmmap_log log;				// 日志handler
+} M_pool;
+
+/* 一个slab尺寸级的使用情况 */
+typedef struct m_class_info {
+	uint32_t obj_size;			// 对象大小，包括块头部
+	uint32_t slab_count;
+	uint64_t used_count;		// 使用中的对象个数
+	uint64_t free_count;		// slab中空闲的对象个数
+} M_class_info;
+
 typedef struct m_mem_info {
-	uint32_t pool_size;
-	uint32_t free_area_size;
-	uint32_t allocated_area_size;
-	uint32_t real_used_size;
-	uint32_t allocated_area_free_size;
+	uint64_t pool_size;
+	uint64_t free_area_size;			// 大块区中空闲的字节数
+	uint64_t allocated_area_size;
+	uint64_t real_used_size;
+	uint64_t allocated_area_free_size;	// slab中空闲对象的字节数
+	uint64_t largest_free_block;		// 最大的空闲块，能分配的最大内存略小于它
+	uint64_t free_block_count;			// 空闲块个数，空闲字节数相同时越多碎片越严重
+	uint64_t slab_count;
+	uint64_t coalesce_count;			// 释放时合并相邻空闲块的次数
+	uint64_t slab_release_count;		// 空的slab还给大块区的次数
+	M_class_info classes[SLAB_CLASS_NUM];
 } M_mem_info;
+//**********************指定内存池的接口*****************//
+bool mp_init(M_pool *pool, char *pool_ptr, uint64_t pool_size, shmmap_log log, bool is_inited);
+void* mp_alloc(M_pool *pool, uint32_t len);
+/* 同mp_alloc，没有空间时不记录日志，用于调用者会淘汰后重试的情况 */
+void* mp_try_alloc(M_pool *pool, uint32_t len);
+void mp_free(M_pool *pool, void *p);
+/* 现在申请len字节能否成功，调用者持有锁 */
+bool mp_can_alloc(M_pool *pool, uint32_t len);
+/* p指向的块释放后能否直接容纳len字节：同一尺寸级的对象，或不小于所需大小的大块 */
+bool mp_block_fits(void *p, uint32_t len);
+uint64_t mp_free_size(M_pool *pool);
+uint64_t mp_pool_size(M_pool *pool);
+void mp_free_list_info(M_pool *pool);
+/* 填写内存使用情况。不需要加锁，其他进程同时分配时各项是近似值 */
+void mp_memory_info(M_pool *pool, M_mem_info *info);
+void* mp_get_ptr(M_pool *pool, M_offset offset);
+M_offset mp_ptr_offset(M_pool *pool, void *p);
+/*
+ * 分配和释放修改元数据前记录原值，进程在其中崩溃后内存池不一致。
+ * 取得锁时发现持有者已崩溃(EOWNERDEAD)，调用mp_recover回滚后再使用内存池
+ */
+void mp_recover(M_pool *pool);
+/* 校验大块区的边界标记和空闲链，调用者持有锁 */
+bool mp_check(M_pool *pool);
+
+
+//**********************默认内存池的接口*****************//
 /**
  * 内存池初始化
  * pool_ptr: 		内存块起始地址
@@ -96,7 +184,7 @@ typedef struct m_mem_info {
  * log				日志handler
  * is_inited: 		是否已经初始化。已经初始化则直接读取索引，否则建立索引。
  */
-bool m_init(char *pool_ptr, uint32_t pool_size, shmmap_log log, bool is_inited);
+bool m_init(char *pool_ptr, uint64_t pool_size, shmmap_log log, bool is_inited);
 /* 申请可以容纳len bytes的内存块 */
 void* m_alloc(uint32_t len);
 /* 释放p指向的内存块 */
@@ -104,10 +192,10 @@ void m_free(void *p);
 
 
 //**********************内存使用状况**********************//
-/* 返回空闲内存大小，bytes */
-uint32_t m_free_size();
+/* 返回大块区空闲内存大小，bytes */
+uint64_t m_free_size();
 /* 整个内存池大小 */
-uint32_t m_pool_size();
+uint64_t m_pool_size();
 /* 返回空闲列表信息 */
 void m_free_list_info();
 void m_memory_info(M_mem_info *info);
@@ -121,8 +209,8 @@ uint32_t get_mnode_data_len_by_data(void *data_ptr);
 
 
 //**********************指针、偏移量**********************//
-void* get_ptr(uint32_t offset);
-uint32_t ptr_offset(void *p);
+void* get_ptr(M_offset offset);
+M_offset ptr_offset(void *p);
 
 
 //**********************默认日志输出handler***************//
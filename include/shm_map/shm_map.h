@@ -19,53 +19,331 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "m_pool.h"
 
 #define FILE_MODE   (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
 #define DATA_FILE "shm_map.dat"
+/* 段(锁)的最大个数 */
+#define MAX_LOCK_STRIPES 64
+/* 槽区相对初始槽数预留的倍数，用于段扩容。旧表不回收，每段最多扩容到初始大小的约4倍 */
+#define SLOT_AREA_GROWTH 8
+/* 初始槽数的上限，保证槽区的槽数(初始槽数的SLOT_AREA_GROWTH倍)能用32位表示 */
+#define SHMMAP_MAX_SLOT_LEN (1U << 28)
+/* 容量的上限，负载因子3/4时初始槽数不超过SHMMAP_MAX_SLOT_LEN，约2亿个key */
+#define SHMMAP_MAX_CAPACITY ((int)(SHMMAP_MAX_SLOT_LEN / 4 * 3))
+/* 槽中内联保存的key前缀长度 */
+#define KEY_PREFIX_LEN 8
+/* 数据文件的魔数("SHMM")和格式版本 */
+#define SHMMAP_MAGIC 0x4D4D4853
+#define SHMMAP_VERSION 8
+/* 段undo日志的字节数 */
+#define JOURNAL_SIZE (16 * 1024)
+/* 定期msync的默认周期 */
+#define SHMMAP_SYNC_INTERVAL_MS 1000
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /*
- * hash链表的节点
+ * 内存池或段满时的处理
+ */
+typedef enum {
+	SHMMAP_EVICT_NONE,		// put失败并记录日志
+	SHMMAP_EVICT_CLOCK		// 按CLOCK算法淘汰同一段中的key，过期的key优先
+} shmmap_evict_policy;
+
+/*
+ * 数据文件写回磁盘的方式。路径含目录(如./map.dat、/var/lib/map.dat)时数据文件是普通文件，
+ * 否则在POSIX共享内存中，重启后丢失，此时只有JOURNAL的进程崩溃保护有效
+ */
+typedef enum {
+	SHMMAP_DURABILITY_NONE,		// 由内核自行写回
+	SHMMAP_DURABILITY_MSYNC,	// 后台线程定期msync，掉电最多丢失一个周期的写入
+	SHMMAP_DURABILITY_JOURNAL	// 定期msync，写索引前记录段的undo日志，进程崩溃时回滚写了一半的put/remove
+} shmmap_durability;
+
+/*
+ * 映射数据文件的选项，见shm_map_options.flags。
+ * HUGEPAGE: 数据文件在hugetlbfs上时总是使用hugetlb大页(文件大小按大页取整)，此时该选项不需要；
+ *	 否则按大页对齐映射地址并madvise(MADV_HUGEPAGE)使用透明大页，
+ *	 共享内存中的文件需要/sys/kernel/mm/transparent_hugepage/shmem_enabled为advise或always。
+ * POPULATE: 打开时预先分配物理页并建立页表，之后的访问不再缺页。整个映射区都会占用内存，包括槽区的扩容预留。
+ * MLOCK: 锁定映射区，不被换出。受RLIMIT_MEMLOCK限制，失败时只记录日志
+ */
+#define SHMMAP_OPT_HUGEPAGE 0x1
+#define SHMMAP_OPT_POPULATE 0x2
+#define SHMMAP_OPT_MLOCK 0x4
+
+/*
+ * shm_map_open_opts的选项，全部为0时同shm_map_open
+ */
+typedef struct shm_map_options {
+	shmmap_durability durability;	// 新建文件时决定是否有undo日志，打开已有文件时只影响msync
+	uint32_t sync_interval_ms;		// msync的周期，0为SHMMAP_SYNC_INTERVAL_MS
+	uint32_t flags;					// SHMMAP_OPT_*，只影响本进程的映射
+} shm_map_options;
+
+/*
+ * 数据文件头部，位于进程锁之后，magic最后写入。
+ * 版本1是没有头部的旧格式(32位偏移、链式桶)，不能直接打开，用map_import_v1导入。
+ */
+typedef struct file_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t offset_bits;		// 偏移量的位数，见SHMMAP_OFFSET_BITS
+	uint32_t segment_list_len;
+	uint32_t slot_area_len;		// 槽区的槽数，含扩容预留
+	uint32_t slot_area_used;
+	uint32_t evict_policy;		// shmmap_evict_policy，所有进程共用
+	uint32_t durability;		// 新建文件时的shmmap_durability
+	uint64_t mem_size;			// 内存池的字节数
+	uint32_t journal_len;		// undo日志的个数，0或MAX_LOCK_STRIPES
+	uint32_t padding;
+	uint64_t boot_id;			// 最后一次打开时系统启动的id，不同时说明重启过，锁需要重新初始化
+	uint64_t pool_lock_contended;	// 内存池锁被占用需要等待的次数
+	uint64_t pool_lock_wait_ns;		// 等待内存池锁的总时间
+	uint64_t put_failures;			// 内存池或段满导致写入失败的次数
+} H_file_hdr;
+
+/*
+ * key/value节点，key内联在节点之后。key可以是任意字节，之后再补一个0，
+ * 字符串key可以直接当作C字符串使用
  */
 typedef struct entry {
-	int prev_offset;
-	int next_offset;
-	int hash;
-	int key_offset;
-	int value_offset;
+	uint64_t hash;			// key的64位hash，扩容和重建索引时不需要重新计算
+	uint32_t key_len;		// key的字节数，不含补的0
+	uint32_t expire;		// 过期时间(UTC秒)，0表示不过期
+	M_offset value_offset;
+	char key[];
 } H_entry;
 
 /*
- * hash的桶
+ * value块。refcnt是entry持有的1个引用加上读者pin的个数，降为0时回收。
+ * pin住value的进程崩溃时该value不再回收。
  */
-typedef struct bulk {
-	int header_offset;
-	int tail_offset;
-	int size;
-} H_bulk;
+typedef struct value {
+	uint32_t refcnt;
+	uint32_t len;
+	char data[];
+} H_value;
+
+/*
+ * 开放寻址索引的槽，entry_offset为0表示空槽。
+ * 保存hash的低32位和key的前缀，多数查找不需要访问节点本身。
+ * accessed是CLOCK淘汰的访问位，读者不加锁设置。槽区不回收，
+ * 槽被移动时访问位最多落到别的key上，不会写坏节点。
+ */
+typedef struct slot {
+	M_offset entry_offset;
+	uint32_t hash;
+	uint32_t accessed;
+	char key_prefix[KEY_PREFIX_LEN];
+} H_slot;
+
+/*
+ * 索引按hash分成多个段，每段是一张线性探测的开放寻址表，由自己的锁保护。
+ * seq: 写者加锁后和解锁前各加1，为奇数时表示正在写，读者据此做无锁的乐观读
+ *
+ * 负载超过3/4时段扩容为两倍大小的新表，旧表保留到迁移完成：
+ * 每次put/get迁移旧表的若干个槽，查找时先查新表再查旧表。
+ * 迁移可重复执行，进程在迁移中崩溃后由下一个写者继续。
+ */
+typedef struct segment {
+	pthread_mutex_t lock;
+	uint32_t seq;
+	uint32_t size;			// 段内的节点数
+	uint32_t slot_len;		// 槽的个数，2的幂
+	uint32_t slot_offset;	// 槽数组在槽区中的下标
+	uint32_t old_slot_len;	// 迁移中的旧表，0表示没有迁移
+	uint32_t old_slot_offset;
+	uint32_t migrate_pos;	// 旧表中下一个要迁移的槽
+	uint32_t clock_hand;	// CLOCK淘汰下一个检查的槽
+	uint64_t lock_contended;	// 段锁被占用需要等待的次数，持锁时累加
+	uint64_t lock_wait_ns;		// 等待段锁的总时间
+	uint64_t evictions;			// 淘汰的key数
+} H_segment;
+
+/*
+ * 段的undo日志。写索引前把要改的字节追加到data，写完后提交。
+ * state: 高32位是事务号，低32位是data已用的字节数，提交时事务号加1、字节数清0，
+ * 旧事务的记录不再有效。checksum是state的校验，每条记录另有包含事务号的校验。
+ * 持锁进程崩溃后，下一个加锁的进程倒序写回记录
+ */
+typedef struct journal {
+	uint64_t state;
+	uint32_t checksum;
+	uint32_t padding;
+	char data[JOURNAL_SIZE];
+} H_journal;
 
 typedef void (*key_iter)(const char *k, const char *v);
+typedef void (*key_iter_bin)(const void *k, uint32_t k_len, const char *v, uint32_t v_len);
+typedef void (*shm_map_iter_fn)(const void *k, uint32_t k_len, const char *v, uint32_t v_len, void *arg);
+
+/*
+ * 批量读写中的一项。put时由调用者填写全部字段；
+ * get时填写key和k_len，返回value的地址和长度，key不存在时value为NULL
+ */
+typedef struct shm_map_kv {
+	const void *key;
+	uint32_t k_len;
+	uint32_t v_len;
+	const char *value;
+} shm_map_kv;
+
+/*
+ * map的运行时统计，见shm_map_get_stats。计数器保存在数据文件中，由所有进程累加，
+ * 从创建数据文件开始计数；其余各项在读取时从段和内存池汇总
+ */
+typedef struct shm_map_stats {
+	uint64_t entries;				// key的个数，包括还没有回收的过期key
+	uint64_t slots;					// 各段当前表的槽数之和
+	double load_factor;				// entries / slots，段在超过3/4时扩容
+	double avg_probe;				// 当前表中key的平均探测长度，在起始槽时为1
+	uint32_t max_probe;				// 最长的探测长度
+	uint32_t slot_area_used;		// 已分配的槽数，达到slot_area_len后段不能再扩容
+	uint32_t slot_area_len;
+	uint32_t padding;
+	uint64_t segment_lock_contended;	// 段锁被占用需要等待的次数
+	uint64_t segment_lock_wait_ns;		// 等待段锁的总时间
+	uint64_t pool_lock_contended;
+	uint64_t pool_lock_wait_ns;
+	uint64_t evictions;				// 淘汰的key数
+	uint64_t put_failures;			// 内存池或段满导致写入失败的次数
+	M_mem_info memory;				// 内存池的使用，包括各尺寸级的对象数
+} shm_map_stats;
+
+/*
+ * 打开的map的handle。一个进程可以打开多个数据文件，每个map有自己的锁和内存池。
+ * 一个handle可以被多个线程同时使用
+ */
+typedef struct shm_map_handle shm_map_t;
+
+/*
+ * 遍历map的快照。逐段把key和value复制到本进程的内存中，先按seq乐观复制，
+ * 多次冲突后才加段锁，复制完一个段后交给调用者，遍历期间其他进程的读写不被阻塞。
+ * 每个段内是复制时刻的一致视图，不同段的复制时刻不同；遍历期间写入的key，
+ * 在所在的段被复制之前写入时会出现在快照中。一个快照只能由一个线程使用
+ */
+typedef struct shm_map_snapshot shm_map_snapshot;
+
+/*
+ * 打开或创建map，参数同map_init，失败时返回NULL
+ */
+shm_map_t* shm_map_open(int capacity, uint64_t mem_size, const char *dat_file_path, shmmap_log log);
+/* 按选项打开或创建map，opts为NULL时同shm_map_open */
+shm_map_t* shm_map_open_opts(int capacity, uint64_t mem_size, const char *dat_file_path, shmmap_log log,
+							 const shm_map_options *opts);
+/* 解除映射并释放handle，之前get到的地址和pin住的value都不能再访问。开启msync时先同步一次 */
+void shm_map_close(shm_map_t *map);
+/* 同步写回数据文件，返回是否成功 */
+bool shm_map_sync(shm_map_t *map);
+/*
+ * 写入key，返回是否成功。内存池或段满且淘汰后仍没有空间时失败，key保持原来的value
+ */
+bool shm_map_put(shm_map_t *map, const void *k, uint32_t k_len, const char *v, uint32_t v_len);
+/*
+ * 写入ttl秒后过期的key，ttl为0时不过期。过期的key读不到，
+ * 在淘汰或shm_map_remove_expired时回收，回收前仍计入size。返回值同shm_map_put
+ */
+bool shm_map_put_ttl(shm_map_t *map, const void *k, uint32_t k_len, const char *v, uint32_t v_len, uint32_t ttl);
+/* 删除key，返回key是否存在。被pin住的value在unpin后回收 */
+bool shm_map_remove(shm_map_t *map, const void *k, uint32_t k_len);
+/* 回收所有过期的key，返回回收的个数 */
+int shm_map_remove_expired(shm_map_t *map);
+/* 设置内存池或段满时的处理，保存在数据文件中，对所有进程生效 */
+void shm_map_set_evict_policy(shm_map_t *map, shmmap_evict_policy policy);
+char* shm_map_get(shm_map_t *map, const void *k, uint32_t k_len, uint32_t *v_len);
+bool shm_map_contains(shm_map_t *map, const void *k, uint32_t k_len);
+int shm_map_size(shm_map_t *map);
+/*
+ * 读取统计，不加任何锁，可以由监控进程定期调用。各项是读取过程中的近似值，
+ * 耗时与槽数成正比
+ */
+void shm_map_get_stats(shm_map_t *map, shm_map_stats *stats);
+/* key的64位hash，与map中使用的相同，可以用于按key分片 */
+uint64_t shm_map_hash(const void *k, uint32_t k_len);
+/* 按快照遍历所有未过期的key，回调时不持有锁，可以在回调中读写map */
+void shm_map_iter(shm_map_t *map, shm_map_iter_fn fn, void *arg);
+/* 开始遍历，内存不足时返回NULL */
+shm_map_snapshot* shm_map_snapshot_open(shm_map_t *map);
+/*
+ * 取下一个key，没有更多的key时返回false。k和v指向快照中的复制，各自后面补一个0，
+ * 在下一次next或close前有效
+ */
+bool shm_map_snapshot_next(shm_map_snapshot *snap, const void **k, uint32_t *k_len, const char **v, uint32_t *v_len);
+/* 遍历是否因内存不足提前结束 */
+bool shm_map_snapshot_failed(const shm_map_snapshot *snap);
+void shm_map_snapshot_close(shm_map_snapshot *snap);
+M_offset shm_map_pin(shm_map_t *map, const void *k, uint32_t k_len, const char **v, uint32_t *v_len);
+void shm_map_unpin(shm_map_t *map, M_offset ref);
+bool shm_map_import_v1(shm_map_t *map, const char *legacy_file_path);
+/*
+ * 批量写入n项，返回写入成功的个数。按段分组，每个段只加一次段锁，
+ * 每组的内存在一次内存池锁内申请。同一个key出现多次时最后一项生效。写入的key不过期
+ */
+int shm_map_put_batch(shm_map_t *map, const shm_map_kv *kvs, uint32_t n);
+/* 批量查找n项，返回找到的个数。value的地址同map_get，key被再次put后可能失效 */
+int shm_map_get_batch(shm_map_t *map, shm_map_kv *kvs, uint32_t n);
+
+/*
+ * 以下接口操作map_init打开的默认map
+ */
 
 /*
  * 初始化map
- * capacity: map的容量
- * mem_size: map占用的内存大小，就是共享内存的大小
+ * capacity: map的容量，即预计的key个数，不能超过SHMMAP_MAX_CAPACITY
+ * mem_size: 内存池的大小，64位偏移时可以超过4G。打开已有的数据文件时使用文件中记录的大小
  * dat_file_path: 数据文件存储的位置
  * log: 日志handler
  */
-bool map_init(int capacity, int mem_size, const char *dat_file_path, shmmap_log log);
-void map_put(const char *k, const char *v, uint32_t v_len);
+bool map_init(int capacity, uint64_t mem_size, const char *dat_file_path, shmmap_log log);
+bool map_init_opts(int capacity, uint64_t mem_size, const char *dat_file_path, shmmap_log log,
+				   const shm_map_options *opts);
+/* map_init打开的map，没有时返回NULL */
+shm_map_t* map_default();
+bool map_put(const char *k, const char *v, uint32_t v_len);
+bool map_put_ttl(const char *k, const char *v, uint32_t v_len, uint32_t ttl);
+bool map_remove(const char *k);
+/*
+ * 返回value的地址，key被再次put后地址可能失效，长度不变时内容被直接覆盖。需要持续访问时使用map_pin_bin
+ */
 char* map_get(const char *k, uint32_t* v_len);
 
 int map_size();
 bool map_contains(const char *k);
 void map_iter(key_iter);
 
+/*
+ * 二进制key的版本，key为k_len个字节，可以包含0。
+ * 字符串key等同于不含结尾0的二进制key
+ */
+bool map_put_bin(const void *k, uint32_t k_len, const char *v, uint32_t v_len);
+char* map_get_bin(const void *k, uint32_t k_len, uint32_t *v_len);
+bool map_contains_bin(const void *k, uint32_t k_len);
+bool map_remove_bin(const void *k, uint32_t k_len);
+void map_iter_bin(key_iter_bin);
+
+/*
+ * pin住key当前的value，返回引用，key不存在时返回NIL。
+ * 在map_unpin之前value的内容保持有效，即使key被再次put
+ */
+M_offset map_pin_bin(const void *k, uint32_t k_len, const char **v, uint32_t *v_len);
+void map_unpin(M_offset ref);
+
+int map_put_batch(const shm_map_kv *kvs, uint32_t n);
+void map_get_stats(shm_map_stats *stats);
+int map_get_batch(shm_map_kv *kvs, uint32_t n);
+
+/*
+ * 把版本1数据文件(32位偏移、链式桶)中的所有key写入当前map，用于升级数据文件：
+ * 用新的文件名map_init，导入旧文件，再删除旧文件。导入期间不能有进程写旧文件
+ */
+bool map_import_v1(const char *legacy_file_path);
+
 #ifdef __cplusplus
 }
 #endif
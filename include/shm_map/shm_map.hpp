@@ -0,0 +1,298 @@
+/**
+* @file shm_map.hpp
+* @brief C++ access to the shared memory map with binary keys and zero copy reads.
+* @details get() pins the current value of a key and returns a ValueView on the
+ * bytes in shared memory. The bytes stay valid while the view lives, also when
+ * another process overwrites the key meanwhile; the old value is freed when the
+ * last view on it is released. Keys are arbitrary bytes and may contain zeros.
+ *
+ * ShmMap owns a map opened with shm_map_open(), several of them can be open in
+ * one process. The free functions work on the map opened by map_init(), it has
+ * to be called before any of them.
+* @date     2026/10/19
+* @par Copyright(c):    2026 megatronix. All rights reserved.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "shm_map/shm_map.h"
+
+namespace shm_map {
+
+/**
+ * \brief A pinned, read only value in the map. Move only, unpins on destruction.
+ */
+class ValueView
+{
+public:
+    ValueView() = default;
+    ~ValueView() { reset(); }
+
+    ValueView(const ValueView&) = delete;
+    ValueView& operator=(const ValueView&) = delete;
+
+    ValueView(ValueView&& other) noexcept
+        : map_{other.map_}, ref_{other.ref_}, data_{other.data_}, size_{other.size_}
+    {
+        other.release();
+    }
+
+    ValueView& operator=(ValueView&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            map_ = other.map_;
+            ref_ = other.ref_;
+            data_ = other.data_;
+            size_ = other.size_;
+            other.release();
+        }
+        return *this;
+    }
+
+    /**
+     * \brief Whether the key was found.
+     */
+    explicit operator bool() const { return ref_ != NIL_OFFSET; }
+
+    const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(data_); }
+    std::size_t size() const { return size_; }
+    const uint8_t* begin() const { return data(); }
+    const uint8_t* end() const { return data() + size_; }
+
+    std::string to_string() const { return std::string(data_, size_); }
+
+    /**
+     * \brief Unpin the value, the view becomes empty.
+     */
+    void reset()
+    {
+        if (map_ != nullptr) {
+            shm_map_unpin(map_, ref_);
+        }
+        release();
+    }
+
+private:
+    friend class ShmMap;
+
+    void release()
+    {
+        map_ = nullptr;
+        ref_ = NIL_OFFSET;
+        data_ = nullptr;
+        size_ = 0U;
+    }
+
+    shm_map_t* map_{nullptr};
+    M_offset ref_{NIL_OFFSET};
+    const char* data_{nullptr};
+    uint32_t size_{0U};
+};
+
+/**
+ * \brief A map in its own data file. Move only, closes the map on destruction;
+ * the ValueViews taken from it have to be released before.
+ */
+class ShmMap
+{
+public:
+    ShmMap() = default;
+    ~ShmMap() { close(); }
+
+    ShmMap(const ShmMap&) = delete;
+    ShmMap& operator=(const ShmMap&) = delete;
+
+    ShmMap(ShmMap&& other) noexcept : map_{other.map_}, owned_{other.owned_}
+    {
+        other.map_ = nullptr;
+    }
+
+    ShmMap& operator=(ShmMap&& other) noexcept
+    {
+        if (this != &other) {
+            close();
+            map_ = other.map_;
+            owned_ = other.owned_;
+            other.map_ = nullptr;
+        }
+        return *this;
+    }
+
+    /**
+     * \brief Open or create the map in path, see map_init() for the parameters.
+     */
+    bool open(int capacity, uint64_t mem_size, const char* path, shmmap_log log = nullptr)
+    {
+        close();
+        map_ = shm_map_open(capacity, mem_size, path, log);
+        owned_ = true;
+        return map_ != nullptr;
+    }
+
+    /**
+     * \brief Access to the map opened by map_init(), it is not closed by this object.
+     */
+    static ShmMap default_map()
+    {
+        ShmMap map;
+        map.map_ = map_default();
+        map.owned_ = false;
+        return map;
+    }
+
+    void close()
+    {
+        if (map_ != nullptr && owned_) {
+            shm_map_close(map_);
+        }
+        map_ = nullptr;
+    }
+
+    bool is_open() const { return map_ != nullptr; }
+    shm_map_t* handle() const { return map_; }
+
+    bool put(const void* key, std::size_t key_len, const void* value, std::size_t value_len)
+    {
+        return shm_map_put(map_, key, static_cast<uint32_t>(key_len), static_cast<const char*>(value),
+                    static_cast<uint32_t>(value_len));
+    }
+
+    bool put(const std::string& key, const std::vector<uint8_t>& value)
+    {
+        return put(key.data(), key.size(), value.data(), value.size());
+    }
+
+    /**
+     * \brief Pin the current value of key, an empty view if the key is missing.
+     */
+    ValueView get(const void* key, std::size_t key_len) const
+    {
+        ValueView view;
+        view.ref_ = shm_map_pin(map_, key, static_cast<uint32_t>(key_len), &view.data_, &view.size_);
+        if (view.ref_ != NIL_OFFSET) {
+            view.map_ = map_;
+        }
+        return view;
+    }
+
+    ValueView get(const std::string& key) const { return get(key.data(), key.size()); }
+
+    bool contains(const void* key, std::size_t key_len) const
+    {
+        return shm_map_contains(map_, key, static_cast<uint32_t>(key_len));
+    }
+
+    bool contains(const std::string& key) const { return contains(key.data(), key.size()); }
+
+    /**
+     * \brief Remove key, views pinned before stay valid until reset.
+     */
+    bool remove(const void* key, std::size_t key_len)
+    {
+        return shm_map_remove(map_, key, static_cast<uint32_t>(key_len));
+    }
+
+    bool remove(const std::string& key) { return remove(key.data(), key.size()); }
+
+    int size() const { return shm_map_size(map_); }
+
+    /**
+     * \brief Occupancy, memory and lock contention counters, read without locking.
+     */
+    shm_map_stats stats() const
+    {
+        shm_map_stats s;
+        shm_map_get_stats(map_, &s);
+        return s;
+    }
+
+    /**
+     * \brief Call fn(key, key_len, value, value_len) on a snapshot of every key, see
+     * shm_map_snapshot. No lock is held during fn, writers in other processes go on.
+     * Returns false if the snapshot could not be completed for lack of memory.
+     */
+    template <typename Fn>
+    bool for_each(Fn&& fn) const
+    {
+        shm_map_snapshot* snap = shm_map_snapshot_open(map_);
+        if (snap == nullptr) {
+            return false;
+        }
+        const void* key{nullptr};
+        const char* value{nullptr};
+        uint32_t key_len{0U};
+        uint32_t value_len{0U};
+        while (shm_map_snapshot_next(snap, &key, &key_len, &value, &value_len)) {
+            fn(key, static_cast<std::size_t>(key_len), value, static_cast<std::size_t>(value_len));
+        }
+        const bool ok = !shm_map_snapshot_failed(snap);
+        shm_map_snapshot_close(snap);
+        return ok;
+    }
+
+private:
+    shm_map_t* map_{nullptr};
+    bool owned_{true};
+};
+
+inline bool put(const void* key, std::size_t key_len, const void* value, std::size_t value_len)
+{
+    return map_put_bin(key, static_cast<uint32_t>(key_len), static_cast<const char*>(value),
+                static_cast<uint32_t>(value_len));
+}
+
+inline bool put(const std::vector<uint8_t>& key, const std::vector<uint8_t>& value)
+{
+    return put(key.data(), key.size(), value.data(), value.size());
+}
+
+inline bool put(const std::string& key, const std::vector<uint8_t>& value)
+{
+    return put(key.data(), key.size(), value.data(), value.size());
+}
+
+/**
+ * \brief Pin the current value of key, an empty view if the key is missing.
+ */
+inline ValueView get(const void* key, std::size_t key_len)
+{
+    return ShmMap::default_map().get(key, key_len);
+}
+
+inline ValueView get(const std::vector<uint8_t>& key)
+{
+    return get(key.data(), key.size());
+}
+
+inline ValueView get(const std::string& key)
+{
+    return get(key.data(), key.size());
+}
+
+inline bool contains(const void* key, std::size_t key_len)
+{
+    return map_contains_bin(key, static_cast<uint32_t>(key_len));
+}
+
+inline bool contains(const std::string& key)
+{
+    return contains(key.data(), key.size());
+}
+
+inline bool remove(const void* key, std::size_t key_len)
+{
+    return map_remove_bin(key, static_cast<uint32_t>(key_len));
+}
+
+inline bool remove(const std::string& key)
+{
+    return remove(key.data(), key.size());
+}
+
+} /* namespace shm_map */
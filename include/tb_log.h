@@ -20,4 +20,85 @@ static void TB_LOG_ERROR(const char* fmt, ...) {
     printf("\n");
 }
 
+#ifdef __cplusplus
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace tb_log {
+/**
+ * 每个日志调用点独享的限流状态, 由下面的宏以函数内static变量的方式定义.
+ */
+struct log_site_t {
+    std::atomic<uint64_t> count{0U};            // 调用点被执行的次数
+    std::atomic<int64_t> window_start_ms{0};    // 当前限流窗口的起始时间
+    std::atomic<uint32_t> window_count{0U};     // 当前窗口内已输出的条数
+    std::atomic<uint64_t> suppressed{0U};       // 上次输出后被丢弃的条数
+};
+
+inline int64_t steady_now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief 每n次输出1次
+ * @param[out] suppressed 本次输出前被丢弃的条数
+ */
+inline bool should_log_every_n(log_site_t &site, uint32_t n, uint64_t &suppressed) {
+    uint64_t count = site.count.fetch_add(1U, std::memory_order_relaxed);
+    if (n <= 1U || count % n == 0U) {
+        suppressed = site.suppressed.exchange(0U, std::memory_order_relaxed);
+        return true;
+    }
+    site.suppressed.fetch_add(1U, std::memory_order_relaxed);
+    return false;
+}
+
+/**
+ * @brief 每秒最多输出per_second条
+ * @param[out] suppressed 本次输出前被丢弃的条数
+ */
+inline bool should_log_rate_limited(log_site_t &site, uint32_t per_second, uint64_t &suppressed) {
+    int64_t now = steady_now_ms();
+    int64_t start = site.window_start_ms.load(std::memory_order_relaxed);
+    if (now - start >= 1000 &&
+        site.window_start_ms.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+        site.window_count.store(0U, std::memory_order_relaxed);
+    }
+    if (site.window_count.fetch_add(1U, std::memory_order_relaxed) < per_second) {
+        suppressed = site.suppressed.exchange(0U, std::memory_order_relaxed);
+        return true;
+    }
+    site.suppressed.fetch_add(1U, std::memory_order_relaxed);
+    return false;
+}
+} // namespace tb_log
+
+#define TB_LOG_SITE_IMPL(log_func, check, limit, ...)                                          \
+    do {                                                                                       \
+        static tb_log::log_site_t tb_log_site_;                                                \
+        uint64_t tb_log_suppressed_{0U};                                                       \
+        if (tb_log::check(tb_log_site_, (limit), tb_log_suppressed_)) {                        \
+            if (tb_log_suppressed_ > 0U) {                                                     \
+                log_func("%s:%d suppressed %llu messages", __FILE__, __LINE__,                 \
+                         static_cast<unsigned long long>(tb_log_suppressed_));                 \
+            }                                                                                  \
+            log_func(__VA_ARGS__);                                                             \
+        }                                                                                      \
+    } while (0)
+
+/**
+ * 高频调用点(每条消息都会执行)使用的日志宏, 避免突发流量时日志阻塞终端.
+ * TB_LOG_*_EVERY_N: 每n次输出1次
+ * TB_LOG_*_RATE_LIMITED: 每秒最多输出n条
+ * 恢复输出时会先打印一条被丢弃的条数.
+ * 参数只在放行时求值, hex dump等开销大的参数直接写在宏参数中, 不要提前生成.
+ */
+#define TB_LOG_INFO_EVERY_N(n, ...) TB_LOG_SITE_IMPL(TB_LOG_INFO, should_log_every_n, n, __VA_ARGS__)
+#define TB_LOG_ERROR_EVERY_N(n, ...) TB_LOG_SITE_IMPL(TB_LOG_ERROR, should_log_every_n, n, __VA_ARGS__)
+#define TB_LOG_INFO_RATE_LIMITED(n, ...) TB_LOG_SITE_IMPL(TB_LOG_INFO, should_log_rate_limited, n, __VA_ARGS__)
+#define TB_LOG_ERROR_RATE_LIMITED(n, ...) TB_LOG_SITE_IMPL(TB_LOG_ERROR, should_log_rate_limited, n, __VA_ARGS__)
+#endif // __cplusplus
+
 #endif //TSP_CLIENT_TB_LOG_H
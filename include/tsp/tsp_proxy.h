@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
 #include <unordered_map>
 #include "client/tsp_client.h"
@@ -18,6 +19,10 @@ public:
     typedef std::function<void(const std::string&, const std::vector<uint8_t>&)> reply_callback_t;
     using connect_state_t = tsp_client::connect_state_t;
     TspProxy();
+    /**
+     * @brief 按配置文件连接平台, 登录签名使用其中的public_key_path
+     */
+    explicit TspProxy(const std::string& str_config_path);
     virtual ~TspProxy() = default;
     /*
      * Ensure that objects of this type are not copyable and not movable.
@@ -133,6 +138,8 @@ private:
     void publish_msg_to_cloud(const std::string &str_topic, MessageHeader& header, std::vector<uint8_t> &msg_body);
 
     void on_message_published(const std::vector<uint8_t> &msg, bool published);
+
+    explicit TspProxy(std::unique_ptr<tsp_client::TspClient> tsp_client);
 private:
     common::Timer heartbeat_sleep_timer_;       // 休眠心跳维持timer
     reply_callback_t reply_callback_{nullptr};
@@ -11,6 +11,8 @@
 #include <iomanip>
 #include <iostream>
 #include "tb_log.h"
+#include "common/frame_trace.h"
+#include "openssl_wrapper/signature.h"
 
 namespace boost_support {
     namespace socket {
@@ -33,11 +35,11 @@ namespace boost_support {
                       exit_request_{false},
                       running_{false},
                       tls_cfg_{tls_cfg}{
+                if (!tls_cfg_.frame_trace_file.empty()) {
+                    common::FrameTrace::instance().open(tls_cfg_.frame_trace_file, tls_cfg_.frame_trace_size);
+                }
                 if (tls_cfg_.support_tls){
-                    using namespace boost::asio::ssl;
-                    tls_ctx_.load_verify_file(tls_cfg_.str_ca_path); // 如果证书是一个字节流，则使用接口add_certificate_authority
-                    tls_ctx_.use_private_key_file(tls_cfg_.str_client_key_path, context::pem);
-                    tls_ctx_.use_certificate_file(tls_cfg_.str_client_crt_path, context::pem);
+                    load_tls_credentials();
                     tcp_socket_tls_ = std::make_unique<boost::asio::ssl::stream<TcpSocket>>(io_context_, tls_ctx_);
                 } else {
                     // Create socket
@@ -52,9 +54,12 @@ namespace boost_support {
                         }
                         if (!exit_request_.load()) {
                             if (running_) {
+                                reading_ = true;
                                 lck.unlock();
                                 handle_message();
                                 lck.lock();
+                                reading_ = false;
+                                cond_var_.notify_all();
                             }
                         }
                     }
@@ -69,9 +74,62 @@ namespace boost_support {
                 thread_.join();
             }
 
+            // 证书和密钥各自的sha256依次拼接，任一文件更新后都会改变
+            bool CreateTcpClientSocket::tls_credentials_digest(std::vector<uint8_t>& digest) {
+                FileDigestCache& cache = FileDigestCache::instance();
+                std::vector<uint8_t> file_digest;
+                digest.clear();
+                for (const std::string* path : {&tls_cfg_.str_ca_path, &tls_cfg_.str_client_key_path,
+                                                &tls_cfg_.str_client_crt_path}) {
+                    if (!cache.get(EVP_sha256(), *path, file_digest)) {
+                        return false;
+                    }
+                    digest.insert(digest.end(), file_digest.begin(), file_digest.end());
+                }
+                return true;
+            }
+
+            // 文件的摘要由FileDigestCache缓存，重连时文件未更新则不重新读取和加载
+            bool CreateTcpClientSocket::load_tls_credentials() {
+                using namespace boost::asio::ssl;
+                if (!tls_credentials_digest(tls_digest_)) {
+                    TB_LOG_ERROR("Tcp tls credentials can't be read, ca:%s key:%s crt:%s\n", tls_cfg_.str_ca_path.c_str(),
+                                 tls_cfg_.str_client_key_path.c_str(), tls_cfg_.str_client_crt_path.c_str());
+                    return false;
+                }
+                TcpErrorCodeType ec{};
+                tls_ctx_.load_verify_file(tls_cfg_.str_ca_path, ec);
+                if (ec.value() == boost::system::errc::success) {
+                    tls_ctx_.use_private_key_file(tls_cfg_.str_client_key_path, context::pem, ec);
+                }
+                if (ec.value() == boost::system::errc::success) {
+                    tls_ctx_.use_certificate_file(tls_cfg_.str_client_crt_path, context::pem, ec);
+                }
+                if (ec.value() != boost::system::errc::success) {
+                    TB_LOG_ERROR("Tcp tls credentials loading failed with error:%s\n", ec.message().c_str());
+                    return false;
+                }
+                return true;
+            }
+
+            bool CreateTcpClientSocket::tls_credentials_changed() {
+                std::vector<uint8_t> digest;
+                return tls_credentials_digest(digest) && digest != tls_digest_;
+            }
+
             bool CreateTcpClientSocket::open() {
                 TcpErrorCodeType ec{};
                 bool retVal{false};
+                if (tls_cfg_.support_tls && !running_ && tls_credentials_changed()) {
+                    // 证书更新后重建context和tls stream，socket关闭后读线程很快退出handle_message，等它退出后再释放
+                    std::unique_lock<std::mutex> lck(mutex_);
+                    cond_var_.wait(lck, [this]() { return !reading_; });
+                    TB_LOG_INFO("Tcp tls credentials changed, reload\n");
+                    tcp_socket_tls_.reset();
+                    tls_ctx_ = boost::asio::ssl::context{boost::asio::ssl::context::tlsv12};
+                    load_tls_credentials();
+                    tcp_socket_tls_ = std::make_unique<boost::asio::ssl::stream<TcpSocket>>(io_context_, tls_ctx_);
+                }
                 if (tls_cfg_.support_tls){
                     tcp_socket_tls_->set_verify_mode(boost::asio::ssl::verify_peer);
                     tcp_socket_tls_->set_verify_callback([this](bool p, boost::asio::ssl::verify_context& context) {
@@ -177,6 +235,7 @@ namespace boost_support {
                         tcp_socket_tls_->handshake(boost::asio::ssl::stream_base::client, ec);
                         if (ec.value() == boost::system::errc::success){
                             TB_LOG_INFO("Tcp with tls Socket handshake to host");
+                            conn_id_ = common::FrameTrace::next_conn_id();
                             // start reading
                             running_ = true;
                             cond_var_.notify_all();
@@ -195,6 +254,7 @@ namespace boost_support {
                     if (ec.value() == boost::system::errc::success) {
                         TB_LOG_INFO("Tcp Socket connected to host %s:%d\n", tcp_socket_->remote_endpoint().address().to_string().c_str(),
                                     tcp_socket_->remote_endpoint().port());
+                        conn_id_ = common::FrameTrace::next_conn_id();
 
                         // start reading
                         running_ = true;
@@ -256,6 +316,7 @@ namespace boost_support {
                 if(!running_) {
                     return ret_val;
                 }
+                common::FrameTrace::instance().record(common::FrameDirection::kTx, conn_id_, tcpMessage->txBuffer_);
                 if (tls_cfg_.support_tls){
                     boost::asio::write(*tcp_socket_tls_,
                                        boost::asio::buffer(tcpMessage->txBuffer_,
@@ -265,7 +326,7 @@ namespace boost_support {
                         //    tcp_socket_tls_->lowest_layer().remote_endpoint().port());
                         ret_val = true;
                     } else {
-                        TB_LOG_ERROR("Tcp message sending failed with error: %s\n", ec.message().c_str());
+                        TB_LOG_ERROR_RATE_LIMITED(10U, "Tcp message sending failed with error: %s\n", ec.message().c_str());
                     }
                 } else{
                     boost::asio::write(*tcp_socket_,
@@ -277,7 +338,7 @@ namespace boost_support {
                         //    tcp_socket_->remote_endpoint().address().to_string().c_str(), tcp_socket_->remote_endpoint().port());
                         ret_val = true;
                     } else {
-                        TB_LOG_ERROR("Tcp message sending failed with error: %s\n", ec.message().c_str());
+                        TB_LOG_ERROR_RATE_LIMITED(10U, "Tcp message sending failed with error: %s\n", ec.message().c_str());
                     }
                 }
                 return ret_val;
@@ -312,7 +373,12 @@ namespace boost_support {
                 }
                 // Check for error
                 if (ec.value() == boost::system::errc::success) {
-                    TB_LOG_INFO("header dump:%s\n", convert_to_hex_string(tcp_rx_message->rxBuffer_).c_str());
+                    common::FrameTrace& frame_trace = common::FrameTrace::instance();
+                    if (frame_trace.is_enabled()) {
+                        frame_trace.record(common::FrameDirection::kRx, conn_id_, tcp_rx_message->rxBuffer_);
+                    } else {
+                        TB_LOG_INFO_RATE_LIMITED(10U, "header dump:%s\n", convert_to_hex_string(tcp_rx_message->rxBuffer_).c_str());
+                    }
                     // read the next bytes to read
                     uint32_t read_next_bytes =0;/* [&tcp_rx_message](uint8_t body_length_index, uint8_t body_length_size) {
                         if (body_length_size == 2) {
@@ -366,14 +432,16 @@ namespace boost_support {
                         }
                     }*/
                     // all message received, transfer to upper layer
+                    // socket可能已被disconnect_from_host关闭，不能使用抛异常的接口
+                    TcpErrorCodeType endpoint_ec{};
                     Tcp::endpoint const endpoint_{tls_cfg_.support_tls ?
-                                                  tcp_socket_tls_->lowest_layer().remote_endpoint()
-                                                                       : tcp_socket_->remote_endpoint()};
+                                                  tcp_socket_tls_->lowest_layer().remote_endpoint(endpoint_ec)
+                                                                       : tcp_socket_->remote_endpoint(endpoint_ec)};
                     // fill the remote endpoints
                     tcp_rx_message->host_ip_address_ = endpoint_.address().to_string();
                     tcp_rx_message->host_port_num_ = endpoint_.port();
 
-                    TB_LOG_INFO("Tcp Message received from %s:%d data size:%d\n", endpoint_.address().to_string().c_str(),
+                    TB_LOG_INFO_RATE_LIMITED(10U, "Tcp Message received from %s:%d data size:%d\n", endpoint_.address().to_string().c_str(),
                         endpoint_.port(), tcp_rx_message->rxBuffer_.size());
                     // send data to upper layer
                     if(!running_.load()) {
@@ -62,6 +62,12 @@ namespace boost_support {
                 // function to handle read
                 void handle_message();
                 bool verify_certificate(bool pre_verified,  boost::asio::ssl::verify_context& ctx);
+                // load CA, key and certificate files into tls_ctx_
+                bool load_tls_credentials();
+                // digest of the CA, key and certificate files
+                bool tls_credentials_digest(std::vector<uint8_t>& digest);
+                // whether a credential file changed since tls_ctx_ was loaded
+                bool tls_credentials_changed();
             private:
                 // local Ip address
                 std::string local_ip_address_;
@@ -74,6 +80,8 @@ namespace boost_support {
                 // boost io context
                 boost::asio::io_context io_context_;
                 boost::asio::ssl::context tls_ctx_{boost::asio::ssl::context::tlsv12};
+                // digest of the files tls_ctx_ was loaded from
+                std::vector<uint8_t> tls_digest_;
                 // flag to terminate the thread
                 std::atomic_bool exit_request_;
                 // flag th start the thread
@@ -84,10 +92,14 @@ namespace boost_support {
                 std::thread thread_;
                 // locking critical section
                 std::mutex mutex_;
+                // the thread is in handle_message, guarded by mutex_
+                bool reading_{false};
                 // Handler invoked during read operation
                 TcpHandlerRead tcp_handler_read_;
                 // tls config
                 tls_config tls_cfg_;
+                // connection id used by the frame trace
+                std::atomic<uint32_t> conn_id_{0U};
             };
         }  // namespace tcp
     }  // namespace socket
@@ -131,7 +131,7 @@ namespace tcp {
             // Check for error
             if (ec.value() == boost::system::errc::success) {
                 Tcp::endpoint endpoint_{tcp_socket_->remote_endpoint()};
-                TB_LOG_INFO("Tcp message sent to <%s,%d>\n",
+                TB_LOG_INFO_RATE_LIMITED(10U, "Tcp message sent to <%s,%d>\n",
                             endpoint_.address().to_string().c_str(), endpoint_.port());
                 ret_val = true;
             } else {
@@ -150,7 +150,7 @@ namespace tcp {
             // Check for error
             if (ec.value() == boost::system::errc::success) {
                 Tcp::endpoint endpoint_{tcp_socket_ssl_->lowest_layer().remote_endpoint()};
-                TB_LOG_INFO("Tcp with ssl message sent to <%s,%d>\n",
+                TB_LOG_INFO_RATE_LIMITED(10U, "Tcp with ssl message sent to <%s,%d>\n",
                             endpoint_.address().to_string().c_str(), endpoint_.port());
                 ret_val = true;
             } else {
@@ -188,7 +188,7 @@ namespace tcp {
                                                       read_next_bytes), ec);
                 // all message received, transfer to upper layer
                 Tcp::endpoint endpoint{tcp_socket_->remote_endpoint()};
-                TB_LOG_INFO("Tcp Message received from <%s,%d>\n", endpoint.address().to_string().c_str(),
+                TB_LOG_INFO_RATE_LIMITED(10U, "Tcp Message received from <%s,%d>\n", endpoint.address().to_string().c_str(),
                             endpoint.port());
                 // fill the remote endpoints
                 tcp_rx_message->host_ip_address_ = endpoint.address().to_string();
@@ -199,7 +199,7 @@ namespace tcp {
                                                       read_next_bytes), ec);
                 // all message received, transfer to upper layer
                 Tcp::endpoint endpoint{tcp_socket_ssl_->lowest_layer().remote_endpoint()};
-                TB_LOG_INFO("Tcp with ssl Message received from <%s,%d>\n", endpoint.address().to_string().c_str(),
+                TB_LOG_INFO_RATE_LIMITED(10U, "Tcp with ssl Message received from <%s,%d>\n", endpoint.address().to_string().c_str(),
                             endpoint.port());
                 // fill the remote endpoints
                 tcp_rx_message->host_ip_address_ = endpoint.address().to_string();
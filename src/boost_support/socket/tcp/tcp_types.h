@@ -24,6 +24,8 @@ namespace tcp {
         uint8_t msg_tail_size{1};
         uint8_t terminal_mark{0};
         std::string ifc{};
+        std::string frame_trace_file{};
+        uint64_t frame_trace_size{4U << 20U};
     };
     // tcp message type
     class TcpMessageType {
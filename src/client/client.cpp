@@ -1,6 +1,7 @@
 #include <iostream>
 #include <csignal>
 #include "client/client.h"
+#include "common/clock_source.h"
 #include "tb_log.h"
 #include "packages/messages.h"
 
@@ -208,7 +209,7 @@ namespace tsp_client {
                     return; // Exit thread
                 }
                 if(!can_be_published_) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(10000));
+                    common::clock().sleep_for(std::chrono::milliseconds(10000));
                     TB_LOG_ERROR("client::thread_send_message_entry wait to connect to remote host ip:%s\n",
                                  client_connection_.get_remote_host_ip().c_str());
                     continue;
@@ -228,7 +229,7 @@ namespace tsp_client {
                     }
                 } else {
                     can_be_published_ = false;
-                    std::this_thread::sleep_for(std::chrono::milliseconds(10000));
+                    common::clock().sleep_for(std::chrono::milliseconds(10000));
                     TB_LOG_ERROR("client::thread_send_message_entry send msg failed remote host ip:%s\n",
                                  client_connection_.get_remote_host_ip().c_str());
                     if(max_reconnects_ == 0) { // no try reconnect
@@ -328,7 +329,7 @@ namespace tsp_client {
             connect_callback_(server_ip_, server_port_, connect_state_t::sleeping);
         }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(reconnect_interval_msecs_));
+        common::clock().sleep_for(std::chrono::milliseconds(reconnect_interval_msecs_));
     }
 
     bool client::should_reconnect(void) const {
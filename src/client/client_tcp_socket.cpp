@@ -29,6 +29,8 @@ namespace tsp_client {
         tls_cfg.msg_tail_size = tls_tcp_cfg_.msg_tail_size;
         tls_cfg.terminal_mark = tls_tcp_cfg_.terminal_mark;
         tls_cfg.ifc = tls_tcp_cfg_.ifc;
+        tls_cfg.frame_trace_file = tls_tcp_cfg_.frame_trace_file;
+        tls_cfg.frame_trace_size = tls_tcp_cfg_.frame_trace_size;
 
         bool res{false};
         if(tcp_socket_ == nullptr) {
@@ -23,6 +23,8 @@ namespace tsp_client {
         tsp_client_config_.body_length_index   = tls_tcp_cfg.body_length_index;
         tsp_client_config_.body_length_size    = tls_tcp_cfg.body_length_size;
         tsp_client_config_.ifc                 = tls_tcp_cfg.ifc;
+        tsp_client_config_.frame_trace_file    = tls_tcp_cfg.frame_trace_file;
+        tsp_client_config_.str_public_key_path = tls_tcp_cfg.public_key_path;
     }
 
     TspClient::TspClient(const tsp_client::tls_tcp_config &config):tsp_client_config_(config){
@@ -38,6 +40,10 @@ namespace tsp_client {
         reload_cfg_ = true;
     }
 
+    const tsp_client::tls_tcp_config& TspClient::get_config() const {
+        return tsp_client_config_;
+    }
+
     bool TspClient::connect(std::int32_t max_reconnects) {
         TB_LOG_INFO("TspClient::connect\n");
 
@@ -35,6 +35,12 @@ bool TspClientConfig::load_config(const std::string &config_path)
         server_ip    = config[environment].at("server_ip");
         port         = config[environment]["port"];
         support_tls  = config[environment]["support_tls"];
+        if (config[environment].contains("frame_trace_file")) {
+            frame_trace_file = config[environment].at("frame_trace_file");
+        }
+        if (config[environment].contains("public_key_path")) {
+            public_key_path = config[environment].at("public_key_path");
+        }
         /*
         ca_path      = config[environment].at("ca_path");
         key_path     = config[environment].at("key_path");
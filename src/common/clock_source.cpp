@@ -0,0 +1,115 @@
+#include "common/clock_source.h"
+#include <atomic>
+#include <thread>
+#include "common/timer_service.h"
+
+namespace common {
+
+ClockSource::ClockSource() = default;
+
+ClockSource::~ClockSource() = default;
+
+TimerService& ClockSource::timer_service() {
+    const std::lock_guard<std::mutex> lock(service_mutex_);
+    if (timer_service_ == nullptr) {
+        timer_service_.reset(new TimerService(*this, true));
+    }
+    return *timer_service_;
+}
+
+TimerService* ClockSource::created_timer_service() const {
+    const std::lock_guard<std::mutex> lock(service_mutex_);
+    return timer_service_.get();
+}
+
+void ClockSource::destroy_timer_service() {
+    std::unique_ptr<TimerService> service;
+    {
+        const std::lock_guard<std::mutex> lock(service_mutex_);
+        service = std::move(timer_service_);
+    }
+}
+
+SystemClockSource::~SystemClockSource() {
+    destroy_timer_service();
+}
+
+void SystemClockSource::sleep_until(Clock::time_point tp) {
+    std::this_thread::sleep_until(tp);
+}
+
+SimulatedClock::SimulatedClock(Clock::time_point start) : now_{start} {
+}
+
+SimulatedClock::~SimulatedClock() {
+    destroy_timer_service();
+}
+
+ClockSource::Clock::time_point SimulatedClock::now() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return now_;
+}
+
+void SimulatedClock::sleep_until(Clock::time_point tp) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++sleepers_;
+    sleepers_cv_.notify_all();
+    time_cv_.wait(lock, [this, tp]() { return now_ >= tp; });
+    --sleepers_;
+}
+
+void SimulatedClock::advance(Clock::duration duration) {
+    advance_to(now() + duration);
+}
+
+void SimulatedClock::advance_to(Clock::time_point tp) {
+    TimerService* service = created_timer_service();
+    while (true) {
+        Clock::time_point step = tp;
+        Clock::time_point event;
+        if (service != nullptr && service->next_event(event) && event < step) {
+            step = event;
+        }
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            if (step > now_) {
+                now_ = step;
+            }
+        }
+        time_cv_.notify_all();
+        if (service != nullptr) {
+            service->dispatch();
+        }
+        if (step >= tp) {
+            break;
+        }
+    }
+}
+
+std::size_t SimulatedClock::sleeper_count() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return sleepers_;
+}
+
+bool SimulatedClock::wait_for_sleepers(std::size_t count, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return sleepers_cv_.wait_for(lock, timeout, [this, count]() { return sleepers_ >= count; });
+}
+
+static SystemClockSource& system_clock_source() {
+    static SystemClockSource source;
+    return source;
+}
+
+static std::atomic<ClockSource*> g_clock{nullptr};
+
+ClockSource& clock() {
+    ClockSource* source = g_clock.load(std::memory_order_acquire);
+    return (source != nullptr) ? *source : system_clock_source();
+}
+
+void set_clock(ClockSource* source) {
+    g_clock.store(source, std::memory_order_release);
+}
+
+} /* namespace common */
@@ -0,0 +1,142 @@
+#include "common/frame_trace.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tb_log.h"
+
+namespace common {
+
+static uint64_t align_up(uint64_t size) {
+    return (size + kFrameTraceAlign - 1U) & ~static_cast<uint64_t>(kFrameTraceAlign - 1U);
+}
+
+FrameTrace& FrameTrace::instance() {
+    static FrameTrace trace;
+    return trace;
+}
+
+FrameTrace::~FrameTrace() {
+    close();
+}
+
+uint32_t FrameTrace::next_conn_id() {
+    static std::atomic<uint32_t> conn_id{0U};
+    return ++conn_id;
+}
+
+bool FrameTrace::open(const std::string& path, uint64_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (enabled_) {
+        if (path == path_) {
+            return true;
+        }
+        TB_LOG_ERROR("FrameTrace::open already tracing to %s, ignore %s", path_.c_str(), path.c_str());
+        return false;
+    }
+    capacity &= ~static_cast<uint64_t>(kFrameTraceAlign - 1U);
+    if (capacity < 2U * sizeof(FrameTraceRecord)) {
+        TB_LOG_ERROR("FrameTrace::open capacity:%llu is too small", static_cast<unsigned long long>(capacity));
+        return false;
+    }
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        TB_LOG_ERROR("FrameTrace::open open %s failed: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    const uint64_t file_size = sizeof(FrameTraceFileHeader) + capacity;
+    struct stat st{};
+    bool reuse = (fstat(fd, &st) == 0) && (static_cast<uint64_t>(st.st_size) == file_size);
+    if (!reuse && ftruncate(fd, static_cast<off_t>(file_size)) == -1) {
+        TB_LOG_ERROR("FrameTrace::open ftruncate %s failed: %s", path.c_str(), strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        TB_LOG_ERROR("FrameTrace::open mmap %s failed: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    map_ = static_cast<uint8_t*>(p);
+    map_size_ = file_size;
+    header_ = reinterpret_cast<FrameTraceFileHeader*>(map_);
+    ring_ = map_ + sizeof(FrameTraceFileHeader);
+    if (!reuse || header_->magic != kFrameTraceFileMagic || header_->version != kFrameTraceVersion
+        || header_->capacity != capacity) {
+        memset(header_, 0, sizeof(FrameTraceFileHeader));
+        header_->magic = kFrameTraceFileMagic;
+        header_->version = kFrameTraceVersion;
+        header_->header_size = sizeof(FrameTraceFileHeader);
+        header_->capacity = capacity;
+    }
+    path_ = path;
+    enabled_ = true;
+    TB_LOG_INFO("FrameTrace::open tracing frames to %s capacity:%llu", path.c_str(),
+                static_cast<unsigned long long>(capacity));
+    return true;
+}
+
+void FrameTrace::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (map_ != nullptr) {
+        munmap(map_, map_size_);
+    }
+    enabled_ = false;
+    map_ = nullptr;
+    header_ = nullptr;
+    ring_ = nullptr;
+    map_size_ = 0;
+    path_.clear();
+}
+
+void FrameTrace::write_bytes(const void* src, uint64_t size) {
+    memcpy(ring_ + header_->write_pos % header_->capacity, src, size);
+}
+
+void FrameTrace::record(FrameDirection direction, uint32_t conn_id, const uint8_t* data, uint32_t size) {
+    if (!enabled_) {
+        return;
+    }
+    FrameTraceRecord rec{};
+    rec.magic = kFrameTraceRecordMagic;
+    rec.length = size;
+    rec.timestamp_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+    rec.conn_id = conn_id;
+    rec.direction = static_cast<uint8_t>(direction);
+    const uint64_t total = align_up(sizeof(FrameTraceRecord) + size);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!enabled_ || total > header_->capacity) {
+        return;
+    }
+    const uint64_t remain = header_->capacity - header_->write_pos % header_->capacity;
+    if (remain < total) {
+        // 记录不跨越环尾, 剩余空间用padding记录填满
+        if (remain >= sizeof(FrameTraceRecord)) {
+            FrameTraceRecord pad{};
+            pad.magic = kFrameTraceRecordMagic;
+            pad.length = static_cast<uint32_t>(remain - sizeof(FrameTraceRecord));
+            pad.direction = static_cast<uint8_t>(FrameDirection::kPadding);
+            write_bytes(&pad, sizeof(pad));
+        } else {
+            memset(ring_ + header_->write_pos % header_->capacity, 0, remain);
+        }
+        header_->write_pos += remain;
+    }
+    rec.sequence = header_->record_count;
+    const uint64_t pos = header_->write_pos % header_->capacity;
+    memcpy(ring_ + pos, &rec, sizeof(rec));
+    if (size > 0U) {
+        memcpy(ring_ + pos + sizeof(rec), data, size);
+    }
+    header_->write_pos += total;
+    ++header_->record_count;
+}
+
+} /* namespace common */
@@ -44,116 +44,149 @@ namespace common{
 
 Timer::Timer(timer_handler a_timer_handler)
     : timer_handler_{std::move(a_timer_handler)}
-    , mode_{Timer::Mode::kOneshot}{
-    thread_ = std::thread(&Timer::run, this);
+    , mode_{Timer::Mode::kOneshot}
+    , service_{TimerService::instance()}
+    , node_{[this]() { on_expired(); }}{
+}
+
+Timer::Timer(Timer::timer_handler a_timer_handler, Timer::Mode timer_mode)
+        : timer_handler_{std::move(a_timer_handler)},
+          mode_{timer_mode},
+          backoff_{timer_mode == kBackOff},
+          service_{TimerService::instance()},
+          node_{[this]() { on_expired(); }} {
+}
+
+Timer::Timer(Timer::timer_handler a_timer_handler, Timer::Mode timer_mode, TimerService& service)
+        : timer_handler_{std::move(a_timer_handler)},
+          mode_{timer_mode},
+          backoff_{timer_mode == kBackOff},
+          service_{service},
+          node_{[this]() { on_expired(); }} {
 }
 
 Timer::~Timer() noexcept{
-    if(!joined_.load()){
-        stop_and_join_run_thread();
-    }
+    stop_and_join_run_thread();
+}
+
+void Timer::arm(){
+    ++generation_;
+    fire_count_ = 0U;
+    running_ = true;
+    service_.schedule(node_, next_expiry_point_, slack_);
 }
 
 void Timer::start_once(const Timer::Clock::duration timeout, const boost::any& user_data){
     const std::unique_lock<std::mutex> lock(mutex_);
     mode_ = kOneshot;
-    next_expiry_point_ = Clock::now() + timeout;
+    next_expiry_point_ = service_.now() + timeout;
     user_data_ = user_data;
-    running_ = true;
-    condition_variable_.notify_all();
+    arm();
 }
 
 void Timer::start_periodic_immediate(const Timer::Clock::duration period, const boost::any& user_data){
     const std::unique_lock<std::mutex> lock(mutex_);
     mode_ = kPeriodic;
-    next_expiry_point_ = Clock::now();
+    next_expiry_point_ = service_.now();
     period_ = period;
     user_data_ = user_data;
-    running_ = true;
-    condition_variable_.notify_all();
+    arm();
 }
 
 void Timer::start_count_periodic_immediate(const Timer::Clock::duration period, const uint16_t &count,const boost::any& user_data){
     const std::unique_lock<std::mutex> lock(mutex_);
     mode_ = kCountPeriodic;
-    next_expiry_point_ = Clock::now();
+    next_expiry_point_ = service_.now();
     period_ = period;
     user_data_ = user_data;
-    running_ = true;
     max_count_ = count;
-    condition_variable_.notify_all();
+    arm();
 }
 
 void Timer::start_periodic_delayed(const Timer::Clock::duration period, const boost::any& user_data){
     const std::unique_lock<std::mutex> lock(mutex_);
     mode_ = kPeriodic;
-    next_expiry_point_ = Clock::now() + period;
+    next_expiry_point_ = service_.now() + period;
     period_ = period;
     user_data_ = user_data;
-    running_ = true;
-    condition_variable_.notify_all();
+    arm();
 }
 
 void Timer::start_periodic_delayed(const Timer::Clock::duration period, const uint64_t u_period_count, const boost::any& user_data){
     const std::unique_lock<std::mutex> lock(mutex_);
     mode_ = kPeriodic;
-    next_expiry_point_ = Clock::now() + period;
+    next_expiry_point_ = service_.now() + period;
     period_ = period;
     u_start_value_ = u_period_count;
     u_period_count_ = u_period_count;
     user_data_ = user_data;
-    running_ = true;
-    condition_variable_.notify_all();
+    arm();
 }
 
 void Timer::start_periodic_delayed(const Clock::duration period, const Clock::duration delay, const boost::any& user_data){
     const std::unique_lock<std::mutex> lock(mutex_);
     mode_ = kPeriodic;
-    next_expiry_point_ = Clock::now() + delay;
+    next_expiry_point_ = service_.now() + delay;
     period_ = period;
     user_data_ = user_data;
-    running_ = true;
-    condition_variable_.notify_all();
+    arm();
 }
 
 std::chrono::steady_clock::duration Timer::get_time_remaining() const {
     const std::lock_guard<std::mutex> lock(mutex_);
-    return next_expiry_point_ - Clock::now();
+    return next_expiry_point_ - service_.now();
 }
 
-void Timer::run(){
-    std::unique_lock<std::mutex> lock(mutex_);
-    while (!exit_requested_.load()) {
-        // Block until timer expires or timer is started again
-        if (running_.load()) {
-            (void)condition_variable_.wait_until(lock, next_expiry_point_);
-        } else {
-            condition_variable_.wait(lock);
+void Timer::on_expired(){
+    boost::any user_data;
+    uint64_t generation{0U};
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_) {
+            return;
         }
+        user_data = user_data_;
+        generation = generation_;
+    }
+    timer_handler_(user_data);
 
-        if (running_.load()) {
-            if (next_expiry_point_ <= Clock::now()) {
-                // Unlock the mutex during a potentially long-running operation
-                lock.unlock();
-                timer_handler_(user_data_);
-                lock.lock();
-                // Determine if we have to set the timer again
-                if (kOneshot == mode_) {
-                    running_ = false;
-                } else if (kCountPeriodic == mode_) {
-                    static uint32_t count{0U};
-                    if (++count < max_count_) {
-                        next_expiry_point_ += period_;
-                    } else {
-                        count = 0U;
-                        running_ = false;
-                    }
-                }else {
-                    next_expiry_point_ = Clock::now() + period_;
-                }
-            }
+    const std::lock_guard<std::mutex> lock(mutex_);
+    // Stopped or restarted by the handler or by another thread meanwhile
+    if (!running_ || generation != generation_) {
+        return;
+    }
+    // Determine if we have to set the timer again
+    if (kOneshot == mode_) {
+        running_ = false;
+        return;
+    }
+    if (kCountPeriodic == mode_) {
+        if (++fire_count_ < max_count_) {
+            next_expiry_point_ += period_;
+        } else {
+            fire_count_ = 0U;
+            running_ = false;
+            return;
         }
+    } else if (backoff_) {
+        u_period_count_ += u_period_count_;
+        // backoff algorithm
+        std::random_device rd;
+        std::mt19937 mt(rd());
+        std::uniform_int_distribution<uint64_t> dis(u_start_value_, u_period_count_);
+        uint64_t u_random_value = dis(mt);
+        auto timer_interval = std::chrono::milliseconds(u_random_value);
+        Clock::duration timer_period{timer_interval};
+        next_expiry_point_ = service_.now() + timer_period;
+    } else {
+        next_expiry_point_ = service_.now() + period_;
     }
+    service_.schedule(node_, next_expiry_point_, slack_);
+}
+
+void Timer::set_slack(const Timer::Clock::duration slack){
+    const std::lock_guard<std::mutex> lock(mutex_);
+    slack_ = slack;
 }
 
 bool Timer::is_running() const {
@@ -169,17 +202,14 @@ bool Timer::is_periodic() const noexcept {
 void Timer::stop() noexcept {
     const std::lock_guard<std::mutex> lock(mutex_);
     running_ = false;
+    ++generation_;
+    service_.cancel(node_, false);
 }
 
 void Timer::stop_and_join_run_thread(){
-    joined_ = true;
-    exit_requested_ = true;
     stop();
-    // Lift the thread out of its waiting state
-    condition_variable_.notify_all();
-    if(thread_.joinable()){
-        thread_.join();
-    }
+    // Must not hold mutex_ here, the running handler takes it when it returns
+    service_.cancel(node_, true);
 }
 
 std::chrono::steady_clock::time_point Timer::get_next_expiry_point() const {
@@ -187,56 +217,4 @@ std::chrono::steady_clock::time_point Timer::get_next_expiry_point() const {
     return next_expiry_point_;
 }
 
-Timer::Timer(Timer::timer_handler a_timer_handler, Timer::Mode timer_mode)
-        : timer_handler_{std::move(a_timer_handler)},
-          mode_{timer_mode} {
-    if (mode_ == kBackOff){
-        thread_ = std::thread(&Timer::run_backoff, this);
-    } else {
-        thread_ = std::thread(&Timer::run, this);
-    }
-}
-
-void Timer::run_backoff() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    while (!exit_requested_.load()) {
-        // Block until timer expires or timer is started again
-        if (running_.load()) {
-            (void)condition_variable_.wait_until(lock, next_expiry_point_);
-        } else {
-            condition_variable_.wait(lock);
-        }
-
-        if (running_.load()) {
-            if (next_expiry_point_ <= Clock::now()) {
-                // Unlock the mutex during a potentially long-running operation
-                lock.unlock();
-                timer_handler_(user_data_);
-                lock.lock();
-                // Determine if we have to set the timer again
-                if (kOneshot == mode_) {
-                    running_ = false;
-                } else if (kCountPeriodic == mode_) {
-                    static uint32_t count{0U};
-                    if (++count < max_count_) {
-                        next_expiry_point_ += period_;
-                    } else {
-                        count = 0U;
-                        running_ = false;
-                    }
-                }else {
-                    u_period_count_ += u_period_count_;
-                    // backoff algorithm
-                    std::random_device rd;
-                    std::mt19937 mt(rd());
-                    std::uniform_int_distribution<uint64_t> dis(u_start_value_, u_period_count_);
-                    uint64_t u_random_value = dis(mt);
-                    auto timer_interval = std::chrono::milliseconds(u_random_value);
-                    Clock::duration timer_period{timer_interval};
-                    next_expiry_point_ = Clock::now() + timer_period;
-                }
-            }
-        }
-    }
-}
-} /* namespace common */
\ No newline at end of file
+} /* namespace common */
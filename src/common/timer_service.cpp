@@ -0,0 +1,378 @@
+#include "common/timer_service.h"
+#include "common/clock_source.h"
+#include <cerrno>
+#include <system_error>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace common {
+
+TimerService& TimerService::instance() {
+    return clock().timer_service();
+}
+
+TimerService::TimerService(bool own_thread) : TimerService(clock(), own_thread) {
+}
+
+TimerService::TimerService(ClockSource& clock, bool own_thread) : clock_{clock}, epoch_{clock.now()} {
+    if (clock_.is_simulated()) {
+        return;
+    }
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epoll_fd_ == -1 || timer_fd_ == -1) {
+        throw std::system_error(errno, std::generic_category(), "TimerService timerfd");
+    }
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = timer_fd_;
+    (void)epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &ev);
+    if (own_thread) {
+        event_fd_ = eventfd(0U, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd_ == -1) {
+            throw std::system_error(errno, std::generic_category(), "TimerService eventfd");
+        }
+        ev.data.fd = event_fd_;
+        (void)epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+        thread_ = std::thread(&TimerService::run, this);
+    }
+}
+
+TimerService::~TimerService() {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        exit_requested_ = true;
+    }
+    if (event_fd_ != -1) {
+        uint64_t one = 1U;
+        (void)write(event_fd_, &one, sizeof(one));
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    if (event_fd_ != -1) {
+        close(event_fd_);
+    }
+    if (timer_fd_ != -1) {
+        close(timer_fd_);
+    }
+    if (epoll_fd_ != -1) {
+        close(epoll_fd_);
+    }
+}
+
+void TimerService::arm_timerfd(uint64_t tick) {
+    if (timer_fd_ == -1) {
+        return;
+    }
+    struct itimerspec spec{};
+    if (tick != kNoTick) {
+        // The system clock source is steady_clock, i.e. CLOCK_MONOTONIC, so its time points are valid timerfd deadlines
+        const auto since = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                to_time_point(tick).time_since_epoch()).count();
+        spec.it_value.tv_sec = static_cast<time_t>(since / 1000000000);
+        spec.it_value.tv_nsec = static_cast<long>(since % 1000000000);
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+    (void)timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+uint64_t TimerService::to_tick_ceil(Clock::time_point tp) const {
+    if (tp <= epoch_) {
+        return 0U;
+    }
+    auto elapsed = tp - epoch_;
+    auto ticks = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed);
+    if (ticks < elapsed) {
+        ++ticks;
+    }
+    return static_cast<uint64_t>(ticks.count());
+}
+
+uint64_t TimerService::to_tick_floor(Clock::time_point tp) const {
+    if (tp <= epoch_) {
+        return 0U;
+    }
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(tp - epoch_).count());
+}
+
+TimerService::Clock::time_point TimerService::to_time_point(uint64_t tick) const {
+    return epoch_ + std::chrono::milliseconds(tick);
+}
+
+void TimerService::link(Node* node) {
+    // The level is given by the most significant wheel digit in which the expiry
+    // differs from the current tick, the slot by the expiry's digit on that level.
+    const uint64_t diff = node->expiry_tick_ ^ current_tick_;
+    int32_t level = 0;
+    if (diff >= kWheelSlots) {
+        level = (63 - __builtin_clzll(diff)) / static_cast<int32_t>(kWheelBits);
+    }
+    Node** head = &overflow_;
+    if (level < kOverflowLevel) {
+        node->slot_ = static_cast<uint32_t>(node->expiry_tick_ >> (static_cast<uint32_t>(level) * kWheelBits))
+                      & (kWheelSlots - 1U);
+        head = &slots_[level][node->slot_];
+        occupied_[level][node->slot_ / 64U] |= 1ULL << (node->slot_ % 64U);
+    } else {
+        level = kOverflowLevel;
+        node->slot_ = 0U;
+    }
+    node->level_ = level;
+    node->prev_ = nullptr;
+    node->next_ = *head;
+    if (*head != nullptr) {
+        (*head)->prev_ = node;
+    }
+    *head = node;
+}
+
+void TimerService::unlink(Node* node) {
+    Node** head = (node->level_ == kOverflowLevel) ? &overflow_ : &slots_[node->level_][node->slot_];
+    if (node->prev_ != nullptr) {
+        node->prev_->next_ = node->next_;
+    } else {
+        *head = node->next_;
+    }
+    if (node->next_ != nullptr) {
+        node->next_->prev_ = node->prev_;
+    }
+    if (*head == nullptr && node->level_ != kOverflowLevel) {
+        occupied_[node->level_][node->slot_ / 64U] &= ~(1ULL << (node->slot_ % 64U));
+    }
+    node->prev_ = nullptr;
+    node->next_ = nullptr;
+    node->level_ = -1;
+}
+
+void TimerService::cascade(uint32_t level, uint32_t slot) {
+    Node* node = slots_[level][slot];
+    slots_[level][slot] = nullptr;
+    occupied_[level][slot / 64U] &= ~(1ULL << (slot % 64U));
+    while (node != nullptr) {
+        Node* next = node->next_;
+        link(node);
+        node = next;
+    }
+}
+
+void TimerService::process_tick(uint64_t tick) {
+    current_tick_ = tick;
+    if (tick != 0U && (tick & ((1ULL << (kWheelLevels * kWheelBits)) - 1U)) == 0U) {
+        Node* node = overflow_;
+        overflow_ = nullptr;
+        while (node != nullptr) {
+            Node* next = node->next_;
+            link(node);
+            node = next;
+        }
+    }
+    for (uint32_t level = kWheelLevels - 1U; level > 0U; --level) {
+        if ((tick & ((1ULL << (level * kWheelBits)) - 1U)) == 0U) {
+            cascade(level, static_cast<uint32_t>(tick >> (level * kWheelBits)) & (kWheelSlots - 1U));
+        }
+    }
+    const uint32_t slot = static_cast<uint32_t>(tick) & (kWheelSlots - 1U);
+    Node* node = slots_[0][slot];
+    slots_[0][slot] = nullptr;
+    occupied_[0][slot / 64U] &= ~(1ULL << (slot % 64U));
+    while (node != nullptr) {
+        Node* next = node->next_;
+        node->prev_ = nullptr;
+        node->next_ = nullptr;
+        node->level_ = -1;
+        node->ready_ = true;
+        --size_;
+        ready_.push_back(node);
+        node = next;
+    }
+    current_tick_ = tick + 1U;
+}
+
+void TimerService::advance(uint64_t now_tick) {
+    while (current_tick_ <= now_tick) {
+        const uint64_t next = next_event_tick();
+        if (next > now_tick) {
+            current_tick_ = now_tick + 1U;
+            break;
+        }
+        process_tick(next);
+    }
+}
+
+int32_t TimerService::find_slot(uint32_t level, uint32_t from) const {
+    for (uint32_t word = from / 64U; word < kWheelSlots / 64U; ++word) {
+        uint64_t bits = occupied_[level][word];
+        if (word == from / 64U) {
+            bits &= ~0ULL << (from % 64U);
+        }
+        if (bits != 0U) {
+            return static_cast<int32_t>(word * 64U + static_cast<uint32_t>(__builtin_ctzll(bits)));
+        }
+    }
+    return -1;
+}
+
+uint64_t TimerService::next_event_tick() const {
+    // Every non empty slot holds expiries whose higher digits equal those of the
+    // current tick, so the first set bit at or after the current digit is the
+    // next tick at which the level has to be cascaded or fired.
+    const uint64_t now = current_tick_;
+    uint64_t best = kNoTick;
+    for (uint32_t level = 0U; level < kWheelLevels; ++level) {
+        const uint32_t shift = level * kWheelBits;
+        const uint32_t digit = static_cast<uint32_t>(now >> shift) & (kWheelSlots - 1U);
+        const int32_t slot = find_slot(level, digit);
+        if (slot < 0) {
+            continue;
+        }
+        const uint64_t upper = (now >> (shift + kWheelBits)) << (shift + kWheelBits);
+        uint64_t tick = upper | (static_cast<uint64_t>(slot) << shift);
+        if (tick < now) {
+            tick = now;
+        }
+        if (tick < best) {
+            best = tick;
+        }
+    }
+    if (overflow_ != nullptr) {
+        const uint32_t shift = kWheelLevels * kWheelBits;
+        const uint64_t tick = ((now >> shift) + 1U) << shift;
+        if (tick < best) {
+            best = tick;
+        }
+    }
+    return best;
+}
+
+void TimerService::schedule(Node& node, Clock::time_point expiry, Clock::duration slack) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (node.level_ >= 0) {
+        unlink(&node);
+        --size_;
+    } else if (node.ready_) {
+        node.ready_ = false;
+        for (auto it = ready_.begin(); it != ready_.end(); ++it) {
+            if (*it == &node) {
+                ready_.erase(it);
+                break;
+            }
+        }
+    }
+    uint64_t tick = to_tick_ceil(expiry);
+    const auto slack_ticks = std::chrono::duration_cast<std::chrono::milliseconds>(slack).count();
+    if (slack_ticks > 0) {
+        // Round up onto a grid shared by all timers, delaying by less than the slack
+        const uint64_t granularity = 1ULL << (63 - __builtin_clzll(static_cast<uint64_t>(slack_ticks)));
+        tick = (tick + granularity - 1U) & ~(granularity - 1U);
+    }
+    if (tick < current_tick_) {
+        tick = current_tick_;
+    }
+    node.expiry_tick_ = tick;
+    link(&node);
+    ++size_;
+    if (tick < planned_wakeup_) {
+        planned_wakeup_ = tick;
+        arm_timerfd(tick);
+    }
+}
+
+void TimerService::cancel(Node& node, bool wait_if_firing) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (node.level_ >= 0) {
+        unlink(&node);
+        --size_;
+    } else if (node.ready_) {
+        node.ready_ = false;
+        for (auto it = ready_.begin(); it != ready_.end(); ++it) {
+            if (*it == &node) {
+                ready_.erase(it);
+                break;
+            }
+        }
+    }
+    if (wait_if_firing && std::this_thread::get_id() != dispatcher_) {
+        idle_cv_.wait(lock, [this, &node]() { return firing_ != &node; });
+    }
+}
+
+bool TimerService::is_scheduled(const Node& node) const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return node.level_ >= 0 || node.ready_;
+}
+
+std::size_t TimerService::size() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return size_ + ready_.size();
+}
+
+TimerService::Clock::time_point TimerService::now() const {
+    return clock_.now();
+}
+
+bool TimerService::next_event(Clock::time_point& tp) const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (!ready_.empty()) {
+        tp = clock_.now();
+        return true;
+    }
+    const uint64_t tick = next_event_tick();
+    if (tick == kNoTick) {
+        return false;
+    }
+    tp = to_time_point(tick);
+    return true;
+}
+
+void TimerService::dispatch() {
+    if (timer_fd_ != -1) {
+        uint64_t expirations{0U};
+        (void)read(timer_fd_, &expirations, sizeof(expirations));
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    dispatcher_ = std::this_thread::get_id();
+    advance(to_tick_floor(clock_.now()));
+    while (!ready_.empty() && !exit_requested_) {
+        Node* node = ready_.front();
+        ready_.pop_front();
+        node->ready_ = false;
+        firing_ = node;
+        // No locks are held while the callback runs, it may re-arm itself
+        lock.unlock();
+        node->callback_();
+        lock.lock();
+        firing_ = nullptr;
+        idle_cv_.notify_all();
+    }
+    dispatcher_ = std::thread::id{};
+    // Expiries that became due while the callbacks ran make the timerfd fire at once
+    planned_wakeup_ = next_event_tick();
+    arm_timerfd(planned_wakeup_);
+}
+
+void TimerService::run() {
+    struct epoll_event events[2];
+    while (true) {
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            if (exit_requested_) {
+                break;
+            }
+        }
+        const int count = epoll_wait(epoll_fd_, events, 2, -1);
+        if (count < 0 && errno != EINTR) {
+            break;
+        }
+        if (count > 0) {
+            dispatch();
+        }
+    }
+}
+
+} /* namespace common */
@@ -29,13 +29,27 @@
 
    René Nyffenegger rene.nyffenegger@adp-gmbh.ch
 
+   Altered version: the codec works on caller provided buffers, bulk data is
+   encoded and decoded with SSSE3/AVX2 (chosen at run time) or NEON kernels,
+   and Base64Encoder/Base64Decoder add incremental operation. The string
+   functions keep their behaviour and are built on top of it.
+
 */
 
 #include "openssl_wrapper/base64.h"
 
 #include <algorithm>
+#include <cstring>
 #include <stdexcept>
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BASE64_X86_SIMD
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define BASE64_NEON
+#include <arm_neon.h>
+#endif
+
 //
 // Depending on the url parameter in base64_chars, one of
 // two sets of base64 characters needs to be chosen.
@@ -52,22 +66,463 @@ static const char* base64_chars[2] = {
         "0123456789"
         "-_"};
 
-static unsigned int pos_of_char(const unsigned char chr) {
+static const unsigned char invalid_char = 0xff;
+
+//
+// Position of every character in base64_chars, invalid_char for characters
+// outside of both alphabets. Be liberal with input and accept both url
+// ('-', '_') and non-url ('+', '/') base 64 characters.
+//
+struct DecodeTable {
+    unsigned char pos[256];
+
+    DecodeTable() {
+        std::fill(pos, pos + 256, invalid_char);
+        for (unsigned char i = 0; i < 64; i++) {
+            pos[static_cast<unsigned char>(base64_chars[0][i])] = i;
+            pos[static_cast<unsigned char>(base64_chars[1][i])] = i;
+        }
+    }
+};
+
+static const DecodeTable decode_table;
+
+static void throw_invalid() {
     //
-    // Return the position of chr within base64_encode()
+    // 2020-10-23: Throw std::exception rather than const char*
+    //(Pablo Martin-Gomez, https://github.com/Bouska)
     //
+    throw std::runtime_error("Input is not valid base64-encoded data.");
+}
 
-    if      (chr >= 'A' && chr <= 'Z') return chr - 'A';
-    else if (chr >= 'a' && chr <= 'z') return chr - 'a' + ('Z' - 'A')               + 1;
-    else if (chr >= '0' && chr <= '9') return chr - '0' + ('Z' - 'A') + ('z' - 'a') + 2;
-    else if (chr == '+' || chr == '-') return 62; // Be liberal with input and accept both url ('-') and non-url ('+') base 64 characters (
-    else if (chr == '/' || chr == '_') return 63; // Ditto for '/' and '_'
-    else
-        //
-        // 2020-10-23: Throw std::exception rather than const char*
-        //(Pablo Martin-Gomez, https://github.com/Bouska)
-        //
-        throw std::runtime_error("Input is not valid base64-encoded data.");
+static bool is_padding(char c) {
+    // accept URL-safe base 64 strings, too, so check for '.' also.
+    return c == '=' || c == '.';
+}
+
+//
+// Scalar code, used for the bytes the vector kernels leave over and on
+// machines without them.
+//
+static void encode_triples(const unsigned char* in, size_t triples, char* out, const char* chars) {
+    for (size_t i = 0; i < triples; i++, in += 3, out += 4) {
+        const unsigned int v = (in[0] << 16) | (in[1] << 8) | in[2];
+        out[0] = chars[v >> 18];
+        out[1] = chars[(v >> 12) & 0x3f];
+        out[2] = chars[(v >> 6) & 0x3f];
+        out[3] = chars[v & 0x3f];
+    }
+}
+
+//
+// Decode up to quads complete groups of four characters. The last group of
+// an encoded string may be padded with equal signs or dots, a padded group
+// ends the data of that group but, like before, decoding goes on with the
+// next one. Returns the number of bytes written.
+//
+static size_t decode_quads(const char* in, size_t quads, unsigned char* out) {
+    const unsigned char* pos = decode_table.pos;
+    unsigned char* p = out;
+
+    for (size_t i = 0; i < quads; i++, in += 4) {
+        const unsigned int c0 = pos[static_cast<unsigned char>(in[0])];
+        const unsigned int c1 = pos[static_cast<unsigned char>(in[1])];
+        const unsigned int c2 = pos[static_cast<unsigned char>(in[2])];
+        const unsigned int c3 = pos[static_cast<unsigned char>(in[3])];
+
+        if (((c0 | c1 | c2 | c3) & 0xc0) == 0) {
+            const unsigned int v = (c0 << 18) | (c1 << 12) | (c2 << 6) | c3;
+            p[0] = static_cast<unsigned char>(v >> 16);
+            p[1] = static_cast<unsigned char>(v >> 8);
+            p[2] = static_cast<unsigned char>(v);
+            p += 3;
+            continue;
+        }
+        if (c0 == invalid_char || c1 == invalid_char) throw_invalid();
+        *p++ = static_cast<unsigned char>((c0 << 2) | (c1 >> 4));
+        if (is_padding(in[2])) continue;
+        if (c2 == invalid_char) throw_invalid();
+        *p++ = static_cast<unsigned char>(((c1 & 0x0f) << 4) | (c2 >> 2));
+        if (is_padding(in[3])) continue;
+        if (c3 == invalid_char) throw_invalid();
+        *p++ = static_cast<unsigned char>(((c2 & 0x03) << 6) | c3);
+    }
+    return p - out;
+}
+
+//
+// Vector kernels. They encode whole blocks of input and stop at the first
+// block of characters that is not plain base64 (padding, line breaks or
+// invalid data), leaving it to decode_quads(). Both return the number of
+// input bytes consumed; the number of output bytes follows from it.
+//
+using EncodeKernel = size_t (*)(const unsigned char* in, size_t len, char* out, bool url);
+using DecodeKernel = size_t (*)(const char* in, size_t len, unsigned char* out);
+
+static size_t encode_none(const unsigned char*, size_t, char*, bool) { return 0; }
+static size_t decode_none(const char*, size_t, unsigned char*) { return 0; }
+
+#ifdef BASE64_X86_SIMD
+
+//
+// 6 bit indices to characters, see Wojciech Muła, "Base64 encoding with
+// SIMD instructions". The index is reduced to a row of a 16 entry table
+// holding the offset from the index to the character.
+//
+__attribute__((target("ssse3")))
+static inline __m128i sse_index_to_chars(__m128i indices, bool url) {
+    const __m128i shift_lut = _mm_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, static_cast<char>((url ? '-' : '+') - 62),
+            static_cast<char>((url ? '_' : '/') - 63), 'A', 0, 0);
+    __m128i row = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    row = _mm_or_si128(row, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(shift_lut, row), indices);
+}
+
+// Spread 12 bytes over 16 lanes of 6 bit indices
+__attribute__((target("ssse3")))
+static inline __m128i sse_split_bytes(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i sse_in_range(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(static_cast<char>(lo - 1))),
+                         _mm_cmpgt_epi8(_mm_set1_epi8(static_cast<char>(hi + 1)), v));
+}
+
+//
+// Characters to 6 bit values. Returns false if a lane holds something other
+// than a character of either alphabet.
+//
+__attribute__((target("ssse3")))
+static inline bool sse_chars_to_values(__m128i v, __m128i* values) {
+    const __m128i upper = sse_in_range(v, 'A', 'Z');
+    const __m128i lower = sse_in_range(v, 'a', 'z');
+    const __m128i digit = sse_in_range(v, '0', '9');
+    const __m128i plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+    const __m128i minus = _mm_cmpeq_epi8(v, _mm_set1_epi8('-'));
+    const __m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+    const __m128i underscore = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+    const __m128i valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)),
+                                       _mm_or_si128(_mm_or_si128(minus, slash), underscore));
+    if (_mm_movemask_epi8(valid) != 0xffff) return false;
+
+    __m128i shift = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+    shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+    shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+    shift = _mm_or_si128(shift, _mm_and_si128(plus, _mm_set1_epi8(62 - '+')));
+    shift = _mm_or_si128(shift, _mm_and_si128(minus, _mm_set1_epi8(62 - '-')));
+    shift = _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+    shift = _mm_or_si128(shift, _mm_and_si128(underscore, _mm_set1_epi8(63 - '_')));
+    *values = _mm_add_epi8(v, shift);
+    return true;
+}
+
+// Join 16 6 bit values to 12 bytes in the low lanes
+__attribute__((target("ssse3")))
+static inline __m128i sse_join_values(__m128i values) {
+    const __m128i ab_bc = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i abcd = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(abcd, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(const unsigned char* in, size_t len, char* out, bool url) {
+    size_t i = 0;
+    // Each step loads 16 bytes and uses 12 of them
+    for (; len - i >= 16; i += 12, out += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), sse_index_to_chars(sse_split_bytes(bytes), url));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(const char* in, size_t len, unsigned char* out) {
+    size_t i = 0;
+    __m128i values;
+    for (; len - i >= 16; i += 16, out += 12) {
+        if (!sse_chars_to_values(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), &values)) break;
+        const __m128i bytes = sse_join_values(values);
+        const uint32_t last = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(bytes, 8)));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), bytes);
+        std::memcpy(out + 8, &last, 4);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_in_range(__m256i v, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(static_cast<char>(lo - 1))),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(hi + 1)), v));
+}
+
+//
+// The AVX2 kernels run the SSSE3 steps on both 128 bit lanes, 24 bytes to
+// 32 characters at a time.
+//
+__attribute__((target("avx2")))
+static size_t encode_avx2(const unsigned char* in, size_t len, char* out, bool url) {
+    const __m256i shift_lut = _mm256_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, static_cast<char>((url ? '-' : '+') - 62),
+            static_cast<char>((url ? '_' : '/') - 63), 'A', 0, 0,
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, static_cast<char>((url ? '-' : '+') - 62),
+            static_cast<char>((url ? '_' : '/') - 63), 'A', 0, 0);
+    const __m256i spread = _mm256_setr_epi8(
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    size_t i = 0;
+    // Each step loads 12 bytes into each lane with two 16 byte loads
+    for (; len - i >= 28; i += 24, out += 32) {
+        __m256i v = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12)), 1);
+        v = _mm256_shuffle_epi8(v, spread);
+        const __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i row = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        row = _mm256_or_si256(row, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        const __m256i chars = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, row), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), chars);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const char* in, size_t len, unsigned char* out) {
+    size_t i = 0;
+    for (; len - i >= 32; i += 32, out += 24) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        const __m256i upper = avx2_in_range(v, 'A', 'Z');
+        const __m256i lower = avx2_in_range(v, 'a', 'z');
+        const __m256i digit = avx2_in_range(v, '0', '9');
+        const __m256i plus = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'));
+        const __m256i minus = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-'));
+        const __m256i slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+        const __m256i underscore = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+        const __m256i valid = _mm256_or_si256(
+                _mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, plus)),
+                _mm256_or_si256(_mm256_or_si256(minus, slash), underscore));
+        if (_mm256_movemask_epi8(valid) != -1) break;
+
+        __m256i shift = _mm256_and_si256(upper, _mm256_set1_epi8(-'A'));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(minus, _mm256_set1_epi8(62 - '-')));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(underscore, _mm256_set1_epi8(63 - '_')));
+        const __m256i values = _mm256_add_epi8(v, shift);
+
+        const __m256i ab_bc = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        __m256i bytes = _mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+        bytes = _mm256_shuffle_epi8(bytes, _mm256_setr_epi8(
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        // Move the 12 bytes of the upper lane next to those of the lower one
+        bytes = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(bytes));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 16), _mm256_extracti128_si256(bytes, 1));
+    }
+    return i;
+}
+
+struct Kernels {
+    EncodeKernel encode;
+    DecodeKernel decode;
+
+    Kernels() : encode{encode_none}, decode{decode_none} {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            encode = encode_avx2;
+            decode = decode_avx2;
+        } else if (__builtin_cpu_supports("ssse3")) {
+            encode = encode_ssse3;
+            decode = decode_ssse3;
+        }
+    }
+};
+
+#elif defined(BASE64_NEON)
+
+//
+// 48 bytes to 64 characters at a time. The loads and stores deinterleave,
+// so every lane of the four index vectors is one character position.
+//
+static size_t encode_neon(const unsigned char* in, size_t len, char* out, bool url) {
+    const char* chars = base64_chars[url];
+    uint8x16x4_t table;
+    table.val[0] = vld1q_u8(reinterpret_cast<const uint8_t*>(chars));
+    table.val[1] = vld1q_u8(reinterpret_cast<const uint8_t*>(chars) + 16);
+    table.val[2] = vld1q_u8(reinterpret_cast<const uint8_t*>(chars) + 32);
+    table.val[3] = vld1q_u8(reinterpret_cast<const uint8_t*>(chars) + 48);
+    const uint8x16_t mask = vdupq_n_u8(0x3f);
+    size_t i = 0;
+    for (; len - i >= 48; i += 48, out += 64) {
+        const uint8x16x3_t bytes = vld3q_u8(in + i);
+        uint8x16x4_t indices;
+        indices.val[0] = vshrq_n_u8(bytes.val[0], 2);
+        indices.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(bytes.val[0], 4), vshrq_n_u8(bytes.val[1], 4)), mask);
+        indices.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(bytes.val[1], 2), vshrq_n_u8(bytes.val[2], 6)), mask);
+        indices.val[3] = vandq_u8(bytes.val[2], mask);
+        indices.val[0] = vqtbl4q_u8(table, indices.val[0]);
+        indices.val[1] = vqtbl4q_u8(table, indices.val[1]);
+        indices.val[2] = vqtbl4q_u8(table, indices.val[2]);
+        indices.val[3] = vqtbl4q_u8(table, indices.val[3]);
+        vst4q_u8(reinterpret_cast<uint8_t*>(out), indices);
+    }
+    return i;
+}
+
+static inline uint8x16_t neon_in_range(uint8x16_t v, uint8_t lo, uint8_t hi) {
+    return vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)), vcleq_u8(v, vdupq_n_u8(hi)));
+}
+
+// Characters to 6 bit values, lanes outside of both alphabets are set in *invalid
+static inline uint8x16_t neon_chars_to_values(uint8x16_t v, uint8x16_t* invalid) {
+    const uint8x16_t upper = neon_in_range(v, 'A', 'Z');
+    const uint8x16_t lower = neon_in_range(v, 'a', 'z');
+    const uint8x16_t digit = neon_in_range(v, '0', '9');
+    const uint8x16_t plus = vceqq_u8(v, vdupq_n_u8('+'));
+    const uint8x16_t minus = vceqq_u8(v, vdupq_n_u8('-'));
+    const uint8x16_t slash = vceqq_u8(v, vdupq_n_u8('/'));
+    const uint8x16_t underscore = vceqq_u8(v, vdupq_n_u8('_'));
+    const uint8x16_t valid = vorrq_u8(vorrq_u8(vorrq_u8(upper, lower), vorrq_u8(digit, plus)),
+                                      vorrq_u8(vorrq_u8(minus, slash), underscore));
+    *invalid = vorrq_u8(*invalid, vmvnq_u8(valid));
+
+    uint8x16_t shift = vandq_u8(upper, vdupq_n_u8(static_cast<uint8_t>(-'A')));
+    shift = vorrq_u8(shift, vandq_u8(lower, vdupq_n_u8(static_cast<uint8_t>(26 - 'a'))));
+    shift = vorrq_u8(shift, vandq_u8(digit, vdupq_n_u8(static_cast<uint8_t>(52 - '0'))));
+    shift = vorrq_u8(shift, vandq_u8(plus, vdupq_n_u8(static_cast<uint8_t>(62 - '+'))));
+    shift = vorrq_u8(shift, vandq_u8(minus, vdupq_n_u8(static_cast<uint8_t>(62 - '-'))));
+    shift = vorrq_u8(shift, vandq_u8(slash, vdupq_n_u8(static_cast<uint8_t>(63 - '/'))));
+    shift = vorrq_u8(shift, vandq_u8(underscore, vdupq_n_u8(static_cast<uint8_t>(63 - '_'))));
+    return vaddq_u8(v, shift);
+}
+
+static size_t decode_neon(const char* in, size_t len, unsigned char* out) {
+    size_t i = 0;
+    for (; len - i >= 64; i += 64, out += 48) {
+        const uint8x16x4_t chars = vld4q_u8(reinterpret_cast<const uint8_t*>(in + i));
+        uint8x16_t invalid = vdupq_n_u8(0);
+        const uint8x16_t a = neon_chars_to_values(chars.val[0], &invalid);
+        const uint8x16_t b = neon_chars_to_values(chars.val[1], &invalid);
+        const uint8x16_t c = neon_chars_to_values(chars.val[2], &invalid);
+        const uint8x16_t d = neon_chars_to_values(chars.val[3], &invalid);
+        if (vmaxvq_u8(invalid) != 0) break;
+        uint8x16x3_t bytes;
+        bytes.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+        bytes.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(c, 2));
+        bytes.val[2] = vorrq_u8(vshlq_n_u8(c, 6), d);
+        vst3q_u8(out, bytes);
+    }
+    return i;
+}
+
+struct Kernels {
+    EncodeKernel encode{encode_neon};
+    DecodeKernel decode{decode_neon};
+};
+
+#else
+
+struct Kernels {
+    EncodeKernel encode{encode_none};
+    DecodeKernel decode{decode_none};
+};
+
+#endif
+
+static const Kernels& kernels() {
+    static const Kernels k;
+    return k;
+}
+
+size_t base64_encoded_len(size_t len) {
+    return (len + 2) / 3 * 4;
+}
+
+size_t base64_decoded_max_len(size_t len) {
+    return (len + 3) / 4 * 3;
+}
+
+size_t base64_encode_to(unsigned char const* in, size_t len, char* out, bool url) {
+    const char* chars = base64_chars[url];
+    const size_t done = kernels().encode(in, len, out, url);
+    const size_t triples = (len - done) / 3;
+    char* p = out + done / 3 * 4;
+
+    encode_triples(in + done, triples, p, chars);
+    p += triples * 4;
+    in += done + triples * 3;
+
+    const unsigned char trailing_char = url ? '.' : '=';
+    switch (len - done - triples * 3) {
+        case 1:
+            p[0] = chars[in[0] >> 2];
+            p[1] = chars[(in[0] & 0x03) << 4];
+            p[2] = trailing_char;
+            p[3] = trailing_char;
+            p += 4;
+            break;
+        case 2:
+            p[0] = chars[in[0] >> 2];
+            p[1] = chars[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+            p[2] = chars[(in[1] & 0x0f) << 2];
+            p[3] = trailing_char;
+            p += 4;
+            break;
+        default:
+            break;
+    }
+    return p - out;
+}
+
+size_t base64_decode_to(char const* in, size_t len, unsigned char* out) {
+    size_t done = 0;
+    unsigned char* p = out;
+
+    //
+    // The kernel stops at a block it can't handle, the quads of that block
+    // are decoded one by one and then the kernel takes over again.
+    //
+    while (len - done >= 4) {
+        const size_t n = kernels().decode(in + done, len - done, p);
+        p += n / 4 * 3;
+        done += n;
+        const size_t quads = std::min<size_t>((len - done) / 4, 4);
+        p += decode_quads(in + done, quads, p);
+        done += quads * 4;
+    }
+
+    //
+    // The last chunk might be padded with equal signs or dots in order to
+    // make it 4 bytes in size as well, but this is not required as per
+    // RFC 2045. Without padding two or three characters are left.
+    //
+    if (len - done == 1) throw_invalid();
+    if (len > done) {
+        char last[4] = {'=', '=', '=', '='};
+        std::memcpy(last, in + done, len - done);
+        p += decode_quads(last, 1, p);
+    }
+    return p - out;
 }
 
 static std::string insert_linebreaks(std::string str, size_t distance) {
@@ -109,53 +564,8 @@ static std::string encode(String s, bool url) {
 }
 
 std::string base64_encode(unsigned char const* bytes_to_encode, size_t in_len, bool url) {
-
-    size_t len_encoded = (in_len +2) / 3 * 4;
-
-    unsigned char trailing_char = url ? '.' : '=';
-
-    //
-    // Choose set of base64 characters. They differ
-    // for the last two positions, depending on the url
-    // parameter.
-    // A bool (as is the parameter url) is guaranteed
-    // to evaluate to either 0 or 1 in C++ therefore,
-    // the correct character set is chosen by subscripting
-    // base64_chars with url.
-    //
-    const char* base64_chars_ = base64_chars[url];
-
-    std::string ret;
-    ret.reserve(len_encoded);
-
-    unsigned int pos = 0;
-
-    while (pos < in_len) {
-        ret.push_back(base64_chars_[(bytes_to_encode[pos + 0] & 0xfc) >> 2]);
-
-        if (pos+1 < in_len) {
-            ret.push_back(base64_chars_[((bytes_to_encode[pos + 0] & 0x03) << 4) + ((bytes_to_encode[pos + 1] & 0xf0) >> 4)]);
-
-            if (pos+2 < in_len) {
-                ret.push_back(base64_chars_[((bytes_to_encode[pos + 1] & 0x0f) << 2) + ((bytes_to_encode[pos + 2] & 0xc0) >> 6)]);
-                ret.push_back(base64_chars_[  bytes_to_encode[pos + 2] & 0x3f]);
-            }
-            else {
-                ret.push_back(base64_chars_[(bytes_to_encode[pos + 1] & 0x0f) << 2]);
-                ret.push_back(trailing_char);
-            }
-        }
-        else {
-
-            ret.push_back(base64_chars_[(bytes_to_encode[pos + 0] & 0x03) << 4]);
-            ret.push_back(trailing_char);
-            ret.push_back(trailing_char);
-        }
-
-        pos += 3;
-    }
-
-
+    std::string ret(base64_encoded_len(in_len), '\0');
+    base64_encode_to(bytes_to_encode, in_len, &ret[0], url);
     return ret;
 }
 
@@ -177,66 +587,13 @@ static std::string decode(String const& encoded_string, bool remove_linebreaks)
         return base64_decode(copy, false);
     }
 
-    size_t length_of_string = encoded_string.length();
-    size_t pos = 0;
-
     //
-    // The approximate length (bytes) of the decoded string might be one or
-    // two bytes smaller, depending on the amount of trailing equal signs
-    // in the encoded string. This approximation is needed to reserve
-    // enough space in the string to be returned.
+    // The decoded string might be one or two bytes smaller, depending on
+    // the amount of trailing equal signs in the encoded string.
     //
-    size_t approx_length_of_decoded_string = length_of_string / 4 * 3;
-    std::string ret;
-    ret.reserve(approx_length_of_decoded_string);
-
-    while (pos < length_of_string) {
-        //
-        // Iterate over encoded input string in chunks. The size of all
-        // chunks except the last one is 4 bytes.
-        //
-        // The last chunk might be padded with equal signs or dots
-        // in order to make it 4 bytes in size as well, but this
-        // is not required as per RFC 2045.
-        //
-        // All chunks except the last one produce three output bytes.
-        //
-        // The last chunk produces at least one and up to three bytes.
-        //
-
-        size_t pos_of_char_1 = pos_of_char(encoded_string.at(pos+1) );
-
-        //
-        // Emit the first output byte that is produced in each chunk:
-        //
-        ret.push_back(static_cast<std::string::value_type>( ( (pos_of_char(encoded_string.at(pos+0)) ) << 2 ) + ( (pos_of_char_1 & 0x30 ) >> 4)));
-
-        if ( ( pos + 2 < length_of_string  )       &&  // Check for data that is not padded with equal signs (which is allowed by RFC 2045)
-             encoded_string.at(pos+2) != '='     &&
-             encoded_string.at(pos+2) != '.'         // accept URL-safe base 64 strings, too, so check for '.' also.
-                )
-        {
-            //
-            // Emit a chunk's second byte (which might not be produced in the last chunk).
-            //
-            unsigned int pos_of_char_2 = pos_of_char(encoded_string.at(pos+2) );
-            ret.push_back(static_cast<std::string::value_type>( (( pos_of_char_1 & 0x0f) << 4) + (( pos_of_char_2 & 0x3c) >> 2)));
-
-            if ( ( pos + 3 < length_of_string )     &&
-                 encoded_string.at(pos+3) != '='  &&
-                 encoded_string.at(pos+3) != '.'
-                    )
-            {
-                //
-                // Emit a chunk's third byte (which might not be produced in the last chunk).
-                //
-                ret.push_back(static_cast<std::string::value_type>( ( (pos_of_char_2 & 0x03 ) << 6 ) + pos_of_char(encoded_string.at(pos+3))   ));
-            }
-        }
-
-        pos += 4;
-    }
-
+    std::string ret(base64_decoded_max_len(encoded_string.length()), '\0');
+    ret.resize(base64_decode_to(encoded_string.data(), encoded_string.length(),
+                             reinterpret_cast<unsigned char*>(&ret[0])));
     return ret;
 }
 
@@ -260,46 +617,117 @@ bool is_base64(unsigned char c) {
     return (isalnum(c) || (c == '+') || (c == '/'));
 }
 
+//
+// Decodes the characters up to the first '=' or one that is not in the
+// non-url alphabet and ignores the rest, a trailing single character is
+// dropped.
+//
 std::vector<unsigned char> base64_decode_binary(std::string const& encoded_string) {
-    std::string str_base64_chars = base64_chars[0];
-    int in_len = encoded_string.size();
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-    unsigned char char_array_4[4], char_array_3[3];
-    std::vector<unsigned char> ret;
-
-    while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-        char_array_4[i++] = encoded_string[in_]; in_++;
-        if (i ==4) {
-            for (i = 0; i <4; i++)
-                char_array_4[i] = str_base64_chars.find(char_array_4[i]);
-
-            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-            for (i = 0; (i < 3); i++)
-                ret.push_back(char_array_3[i]);
-            i = 0;
+    const unsigned char* pos = decode_table.pos;
+    const size_t in_len = std::find_if(encoded_string.begin(), encoded_string.end(), [pos](char c) {
+        return pos[static_cast<unsigned char>(c)] == invalid_char || c == '-' || c == '_';
+    }) - encoded_string.begin();
+    const size_t tail = in_len % 4;
+    std::vector<unsigned char> ret(base64_decoded_max_len(in_len));
+    size_t out_len = base64_decode_to(encoded_string.data(), in_len - tail, ret.data());
+
+    if (tail >= 2) {
+        out_len += base64_decode_to(encoded_string.data() + in_len - tail, tail, ret.data() + out_len);
+    }
+    ret.resize(out_len);
+    return ret;
+}
+
+Base64Encoder::Base64Encoder(bool url) : url_{url}, pending_len_{0} {}
+
+size_t Base64Encoder::update(unsigned char const* in, size_t len, char* out) {
+    size_t written = 0;
+
+    if (pending_len_ > 0) {
+        while (pending_len_ < 3 && len > 0) {
+            pending_[pending_len_++] = *in++;
+            len--;
         }
+        if (pending_len_ < 3) return 0;
+        written = base64_encode_to(pending_, 3, out, url_);
+        pending_len_ = 0;
     }
+    const size_t whole = len - len % 3;
+    written += base64_encode_to(in, whole, out + written, url_);
+    std::memcpy(pending_, in + whole, len - whole);
+    pending_len_ = len - whole;
+    return written;
+}
 
-    if (i) {
-        for (j = i; j <4; j++)
-            char_array_4[j] = 0;
+size_t Base64Encoder::finish(char* out) {
+    const size_t written = base64_encode_to(pending_, pending_len_, out, url_);
+    pending_len_ = 0;
+    return written;
+}
 
-        for (j = 0; j <4; j++)
-            char_array_4[j] = str_base64_chars.find(char_array_4[j]);
+Base64Decoder::Base64Decoder() : pending_len_{0} {}
 
-        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+size_t Base64Decoder::update(char const* in, size_t len, unsigned char* out) {
+    const char* end = in + len;
+    size_t written = 0;
 
-        for (j = 0; (j < i - 1); j++) ret.push_back(char_array_3[j]);
+    while (in < end) {
+        // Line breaks are skipped, the data between them is decoded in place
+        const char* line_end = std::find_if(in, end, [](char c) { return c == '\n' || c == '\r'; });
+        const char* p = in;
+
+        if (pending_len_ > 0) {
+            while (pending_len_ < 4 && p < line_end) {
+                pending_[pending_len_++] = *p++;
+            }
+            if (pending_len_ == 4) {
+                written += base64_decode_to(pending_, 4, out + written);
+                pending_len_ = 0;
+            }
+        }
+        const size_t whole = (line_end - p) / 4 * 4;
+        written += base64_decode_to(p, whole, out + written);
+        p += whole;
+        std::memcpy(pending_ + pending_len_, p, line_end - p);
+        pending_len_ += line_end - p;
+        in = line_end == end ? end : line_end + 1;
     }
+    return written;
+}
 
-    return ret;
+size_t Base64Decoder::finish(unsigned char* out) {
+    const size_t written = base64_decode_to(pending_, pending_len_, out);
+    pending_len_ = 0;
+    return written;
+}
+
+static const size_t stream_chunk_size = 48 * 1024;
+
+void base64_encode_stream(std::istream& in, std::ostream& out, bool url) {
+    Base64Encoder encoder(url);
+    std::vector<char> plain(stream_chunk_size);
+    std::vector<char> encoded(base64_encoded_len(stream_chunk_size) + 4);
+
+    while (in) {
+        in.read(plain.data(), plain.size());
+        const size_t n = encoder.update(reinterpret_cast<const unsigned char*>(plain.data()),
+                                        static_cast<size_t>(in.gcount()), encoded.data());
+        out.write(encoded.data(), n);
+    }
+    out.write(encoded.data(), encoder.finish(encoded.data()));
+}
+
+void base64_decode_stream(std::istream& in, std::ostream& out) {
+    Base64Decoder decoder;
+    std::vector<char> encoded(stream_chunk_size);
+    std::vector<unsigned char> plain(base64_decoded_max_len(stream_chunk_size) + 3);
+
+    while (in) {
+        in.read(encoded.data(), encoded.size());
+        const size_t n = decoder.update(encoded.data(), static_cast<size_t>(in.gcount()), plain.data());
+        out.write(reinterpret_cast<const char*>(plain.data()), n);
+    }
+    out.write(reinterpret_cast<const char*>(plain.data()), decoder.finish(plain.data()));
 }
 
 #if __cplusplus >= 201703L
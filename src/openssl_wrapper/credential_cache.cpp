@@ -0,0 +1,47 @@
+/**
+* @file credential_cache.cpp
+* @brief Precomputed login signature state on top of the file digest cache.
+* @date     2026/10/19
+* @par Copyright(c):    2026 megatronix. All rights reserved.
+*/
+#include "openssl_wrapper/credential_cache.h"
+
+CredentialCache& CredentialCache::instance() {
+    static CredentialCache cache;
+    return cache;
+}
+
+bool CredentialCache::login_signature(const std::string &public_key_path, uint64_t device_time,
+                                      std::vector<uint8_t> &signature) {
+    std::vector<uint8_t> md5;
+    if (!FileDigestCache::instance().get(EVP_md5(), public_key_path, md5)) {
+        return false;
+    }
+    std::shared_ptr<const EVPDigest> prefix;
+    try {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Entry &entry = entries_[public_key_path];
+            if (!entry.login_prefix || entry.md5 != md5) {
+                auto sha256 = std::make_shared<EVPDigest>(EVP_sha256());
+                std::string str_md5 = digest_to_hex(md5, true);
+                sha256->update(str_md5.data(), str_md5.size());
+                entry = Entry{md5, sha256};
+            }
+            prefix = entry.login_prefix;
+        }
+        // 复制前缀的状态，只对时间计算
+        EVPDigest sha256(*prefix);
+        std::string str_time = std::to_string(device_time);
+        sha256.update(str_time.data(), str_time.size());
+        signature = sha256.final();
+    } catch (EVPDigestException &e) {
+        return false;
+    }
+    return true;
+}
+
+void CredentialCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+}
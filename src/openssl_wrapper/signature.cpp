@@ -1,48 +1,171 @@
 //
 // Created by wuting.xu on 2023/11/22.
 //
-#include <openssl/sha.h>
-#include <openssl/md5.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "openssl_wrapper/signature.h"
 
+static int evp_digest(const EVP_MD *type, const unsigned char *data, uint32_t data_size, unsigned char *out,
+                      uint32_t *out_size) {
+    unsigned int size{0};
+    int nResult = EVP_Digest(data, data_size, out, &size, type, nullptr);
+    if (nResult == 1) {
+        *out_size = size;
+    }
+    return nResult;
+}
+
 int openssl_sha256(const unsigned char *data, uint32_t data_size, unsigned char *out, uint32_t *out_size) {
-    int nResult;
+    return evp_digest(EVP_sha256(), data, data_size, out, out_size); // 1 for success, 0 otherwise
+}
 
-    SHA256_CTX sha256_ctx;
+int openssl_md5(const unsigned char *data, uint32_t data_size, unsigned char *out, uint32_t *out_size) {
+    return evp_digest(EVP_md5(), data, data_size, out, out_size); // 1 for success, 0 otherwise
+}
+
+void EVPDigest::CtxFree::operator()(EVP_MD_CTX *ctx) const {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    EVP_MD_CTX_destroy(ctx);
+#else
+    EVP_MD_CTX_free(ctx);
+#endif
+}
 
-    nResult = SHA256_Init(&sha256_ctx);
-    if (nResult < 0) {
-        return nResult;
+EVPDigest::EVPDigest(const EVP_MD *type) : type_{type} {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    ctx_.reset(EVP_MD_CTX_create());
+#else
+    ctx_.reset(EVP_MD_CTX_new());
+#endif
+    if (!ctx_) {
+        throw EVPDigestException();
     }
-    nResult = SHA256_Update(&sha256_ctx, data, data_size);
-    if (nResult < 0) {
-        return nResult;
+    reset();
+}
+
+EVPDigest::EVPDigest(const EVPDigest &other) : type_{other.type_} {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    ctx_.reset(EVP_MD_CTX_create());
+#else
+    ctx_.reset(EVP_MD_CTX_new());
+#endif
+    if (!ctx_ || EVP_MD_CTX_copy_ex(ctx_.get(), other.ctx_.get()) != 1) {
+        throw EVPDigestException();
     }
-    nResult = SHA256_Final((uint8_t *) out, &sha256_ctx);
-    if (nResult >= 0) {
-        *out_size = SHA256_DIGEST_LENGTH;
+}
+
+void EVPDigest::reset() {
+    if (EVP_DigestInit_ex(ctx_.get(), type_, nullptr) != 1) {
+        throw EVPDigestException();
     }
+}
 
-    return nResult; // 1 for success, 0 otherwise
+void EVPDigest::update(const void *data, size_t len) {
+    if (EVP_DigestUpdate(ctx_.get(), data, len) != 1) {
+        throw EVPDigestException();
+    }
 }
 
-int openssl_md5(const unsigned char *data, uint32_t data_size, unsigned char *out, uint32_t *out_size) {
-    int nResult;
+std::vector<uint8_t> EVPDigest::final() {
+    std::vector<uint8_t> digest(EVP_MAX_MD_SIZE);
+    unsigned int size{0};
+    if (EVP_DigestFinal_ex(ctx_.get(), digest.data(), &size) != 1) {
+        throw EVPDigestException();
+    }
+    digest.resize(size);
+    reset();
+    return digest;
+}
 
-    MD5_CTX md5_ctx;
+// 分块读取。证书和密钥只有几KB，不用mmap：文件在计算时被原地截断会触发SIGBUS
+static bool digest_fd(EVPDigest &digest, int fd) {
+    std::vector<uint8_t> buf(64 * 1024);
+    while (true) {
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if (n == 0) {
+            return true;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        digest.update(buf.data(), static_cast<size_t>(n));
+    }
+}
+
+static bool digest_file(const EVP_MD *type, const std::string &path, std::vector<uint8_t> &digest, struct stat &st) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok{false};
+    try {
+        EVPDigest evp_digest(type);
+        if (fstat(fd, &st) == 0 && digest_fd(evp_digest, fd)) {
+            digest = evp_digest.final();
+            ok = true;
+        }
+    } catch (EVPDigestException &e) {
+        ok = false;
+    }
+    close(fd);
+    return ok;
+}
+
+bool digest_file(const EVP_MD *type, const std::string &path, std::vector<uint8_t> &digest) {
+    struct stat st;
+    return digest_file(type, path, digest, st);
+}
 
-    nResult = MD5_Init(&md5_ctx);
-    if (nResult < 0) {
-        return nResult;
+std::string digest_to_hex(const std::vector<uint8_t> &digest, bool upper_case) {
+    const char *digits = upper_case ? "0123456789ABCDEF" : "0123456789abcdef";
+    std::string hex(digest.size() * 2, '0');
+    for (size_t i = 0; i < digest.size(); ++i) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0x0F];
     }
-    nResult = MD5_Update(&md5_ctx, data, data_size);
-    if (nResult < 0) {
-        return nResult;
+    return hex;
+}
+
+static int64_t mtime_ns(const struct stat &st) {
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+FileDigestCache& FileDigestCache::instance() {
+    static FileDigestCache cache;
+    return cache;
+}
+
+bool FileDigestCache::get(const EVP_MD *type, const std::string &path, std::vector<uint8_t> &digest) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
     }
-    nResult = MD5_Final((uint8_t *) out, &md5_ctx);
-    if (nResult >= 0) {
-        *out_size = MD5_DIGEST_LENGTH;
+    // 同一文件的不同算法分别缓存
+    std::string key = std::to_string(EVP_MD_type(type)) + ':' + path;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = entries_.find(key);
+        if (iter != entries_.end() && iter->second.dev == st.st_dev && iter->second.ino == st.st_ino &&
+            iter->second.size == st.st_size && iter->second.mtime_ns == mtime_ns(st)) {
+            digest = iter->second.digest;
+            return true;
+        }
     }
+    // 计算时不加锁，文件在stat之后被替换时以计算时的属性为准
+    if (!digest_file(type, path, digest, st)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[key] = Entry{st.st_dev, st.st_ino, st.st_size, mtime_ns(st), digest};
+    return true;
+}
 
-    return nResult; // 1 for success, 0 otherwise
+void FileDigestCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
 }
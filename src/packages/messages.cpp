@@ -77,7 +77,7 @@ namespace tsp_client {
             pack >> long_length;
             value.resize(long_length);
         }
-        pack.serialize(value.data(), value.size());
+        pack.parse(value.data(), value.size());
         return pack.noerr();
     }
 
@@ -96,7 +96,8 @@ namespace tsp_client {
         Packet pack(data.data(), data.size());
         pack >> random >> sid >> mid;
         BYTE type[2];
-        while (pack.has_remain_bytes()){
+        // 读取出错时pos不再前进，需要结束循环
+        while (pack.has_remain_bytes() && pack.noerr()){
             TLV tlv{is_short_tlv};
             pack >> tlv.type;
 
@@ -107,7 +108,7 @@ namespace tsp_client {
                 pack >> tlv.long_length;
                 tlv.value.resize(tlv.long_length);
             }
-            pack.serialize(tlv.value.data(), tlv.value.size());
+            pack.parse(tlv.value.data(), tlv.value.size());
             content.emplace_back(tlv);
         }
         return pack.noerr();
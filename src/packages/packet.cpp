@@ -126,7 +126,7 @@ namespace tsp_client {
     }
 
     bool Packet::has_remain_bytes() const {
-        return size_ == pos_ + 1;
+        return pos_ < size_;
     }
 
     Packet &Packet::set(const uint8_t *p, uint16_t size) {
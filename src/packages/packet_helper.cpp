@@ -14,5 +14,58 @@ namespace tsp_client {
         MessageHeader *header = (MessageHeader *) data;
         return header->body_length;
     }
+
+    static bool need_escape(uint8_t uchar) {
+        return uchar == 202U || uchar == 87U || uchar == 255U || uchar == 0x3D;
+    }
+
+    void PackHelper::escape_message(const std::vector<uint8_t> &message, std::vector<uint8_t> &escaped) {
+        escaped.push_back(message[0]);
+        for(size_t i = 1; i < message.size(); ++i) {
+            uint8_t uchar = message[i];
+            if(need_escape(uchar)) {
+                escaped.push_back(0x3D);
+                escaped.push_back(uchar^0x3D);
+            }else {
+                escaped.push_back(uchar);
+            }
+        }
+    }
+
+    void PackHelper::unescape_message(const std::vector<uint8_t> &message, std::vector<uint8_t> &unescaped) {
+        //需要对消息除了 LinkHeader 和 LinkTail 外的部分进行转义后再进行传输
+        unescaped.push_back(message[0]);
+        for(size_t i = 1; i < message.size() - 1; ++i) {
+            uint8_t uchar = message[i];
+            if(uchar != 0x3D){
+                unescaped.push_back(uchar);
+            }else {
+                ++i;
+                unescaped.push_back(message[i]^0x3D);
+            }
+        }
+    }
+
+    void PackHelper::escape_data(const std::vector<uint8_t> &data, std::vector<uint8_t> &escaped) {
+        for(auto uchar: data) {
+            if(need_escape(uchar)) {
+                escaped.push_back(0x3D);
+                escaped.push_back(uchar^0x3D);
+            }else {
+                escaped.push_back(uchar);
+            }
+        }
+    }
+
+    void PackHelper::unescape_data(const std::vector<uint8_t> &data, std::vector<uint8_t> &unescaped) {
+        for(auto iter = data.begin(); iter != data.end(); ++iter) {
+            if(*iter != 0x3D){
+                unescaped.push_back(*iter);
+            }else {
+                ++iter;
+                unescaped.push_back(*iter^0x3D);
+            }
+        }
+    }
 }
 
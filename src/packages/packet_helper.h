@@ -16,5 +16,13 @@ public:
     static uint8_t get_message_header_size();
     static uint32_t parse_message_header(const uint8_t *data, uint32_t size);
 
+    // 转义message，首字节(LinkHeader)不转义
+    static void escape_message(const std::vector<uint8_t> &message, std::vector<uint8_t> &escaped);
+    // 去除转义，首字节保留，末字节(LinkTail)丢弃
+    static void unescape_message(const std::vector<uint8_t> &message, std::vector<uint8_t> &unescaped);
+    // 转义/去除转义全部数据
+    static void escape_data(const std::vector<uint8_t> &data, std::vector<uint8_t> &escaped);
+    static void unescape_data(const std::vector<uint8_t> &data, std::vector<uint8_t> &unescaped);
+
 };
 } // end of namespace  tsp_client
\ No newline at end of file
@@ -22,10 +22,8 @@
  * THE SOFTWARE.
  **/
 
-#include <assert.h>  // assert()
-#include <limits.h>  // CHAR_BIT
-#include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "shm_map/base32.h"
 
@@ -40,191 +38,246 @@
  * There are 5 octets of 8 bits each in each sequence.
  * There are 8 blocks of 5 bits each in each sequence.
  *
- * You probably want to refer to that graph when reading the algorithms in this
- * file. We use "octet" instead of "byte" intentionnaly as we really work with
- * 8 bits quantities. This implementation will probably not work properly on
- * systems that don't have exactly 8 bits per (unsigned) char.
+ * A whole sequence is handled as one 40 bit word: the octets are shifted
+ * into it and the blocks are taken out with one table lookup each, and the
+ * other way round when decoding.
  **/
 
-static size_t min(size_t x, size_t y)
-{
-    return x < y ? x : y;
-}
-
 static const unsigned char PADDING_CHAR = '=';
 
+static const unsigned char encode_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
 /**
- * Pad the given buffer with len padding characters.
+ * 5 bits value of every base32 character with VALID_BIT set, 0 for all other
+ * characters, so that a single AND over a sequence tells whether it is valid.
  */
-static void pad(unsigned char *buf, uint32_t len)
-{
-    for (uint32_t i = 0; i < len; i++)
-        buf[i] = PADDING_CHAR;
-}
+#define VALID_BIT 0x20
+
+static const unsigned char decode_table[256] = {
+    ['A'] = VALID_BIT | 0,  ['B'] = VALID_BIT | 1,  ['C'] = VALID_BIT | 2,  ['D'] = VALID_BIT | 3,
+    ['E'] = VALID_BIT | 4,  ['F'] = VALID_BIT | 5,  ['G'] = VALID_BIT | 6,  ['H'] = VALID_BIT | 7,
+    ['I'] = VALID_BIT | 8,  ['J'] = VALID_BIT | 9,  ['K'] = VALID_BIT | 10, ['L'] = VALID_BIT | 11,
+    ['M'] = VALID_BIT | 12, ['N'] = VALID_BIT | 13, ['O'] = VALID_BIT | 14, ['P'] = VALID_BIT | 15,
+    ['Q'] = VALID_BIT | 16, ['R'] = VALID_BIT | 17, ['S'] = VALID_BIT | 18, ['T'] = VALID_BIT | 19,
+    ['U'] = VALID_BIT | 20, ['V'] = VALID_BIT | 21, ['W'] = VALID_BIT | 22, ['X'] = VALID_BIT | 23,
+    ['Y'] = VALID_BIT | 24, ['Z'] = VALID_BIT | 25, ['2'] = VALID_BIT | 26, ['3'] = VALID_BIT | 27,
+    ['4'] = VALID_BIT | 28, ['5'] = VALID_BIT | 29, ['6'] = VALID_BIT | 30, ['7'] = VALID_BIT | 31,
+};
 
 /**
- * This convert a 5 bits value into a base32 character.
- * Only the 5 least significant bits are used.
+ * Encode a whole sequence of 5 octets into 8 characters.
  */
-static unsigned char encode_char(unsigned char c)
+static void encode_sequence(const unsigned char *plain, unsigned char *coded)
 {
-    static unsigned char base32[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
-    return base32[c & 0x1F];  // 0001 1111
+    uint64_t v = ((uint64_t)plain[0] << 32) | ((uint64_t)plain[1] << 24) | ((uint64_t)plain[2] << 16)
+                 | ((uint64_t)plain[3] << 8) | plain[4];
+
+    coded[0] = encode_table[(v >> 35) & 0x1F];
+    coded[1] = encode_table[(v >> 30) & 0x1F];
+    coded[2] = encode_table[(v >> 25) & 0x1F];
+    coded[3] = encode_table[(v >> 20) & 0x1F];
+    coded[4] = encode_table[(v >> 15) & 0x1F];
+    coded[5] = encode_table[(v >> 10) & 0x1F];
+    coded[6] = encode_table[(v >> 5) & 0x1F];
+    coded[7] = encode_table[v & 0x1F];
 }
 
 /**
- * Decode given character into a 5 bits value.
- * Returns -1 if the argument given was an invalid base32 character
- * or a padding character.
+ * Encode the last, shorter sequence of 1 to 4 octets. The missing octets
+ * count as zero and the blocks that contain none of the given bits are
+ * replaced by padding, as per the specification.
  */
-static uint32_t decode_char(unsigned char c)
+static void encode_tail(const unsigned char *plain, size_t len, unsigned char *coded)
 {
-    uint32_t retval = -1;
+    unsigned char sequence[5] = {0, 0, 0, 0, 0};
+    size_t blocks = (len * 8 + 4) / 5;
 
-    if (c >= 'A' && c <= 'Z')
-        retval = c - 'A';
-    if (c >= '2' && c <= '7')
-        retval = c - '2' + 26;
+    memcpy(sequence, plain, len);
+    encode_sequence(sequence, coded);
+    memset(coded + blocks, PADDING_CHAR, 8 - blocks);
+}
 
-    assert(retval == -1 || ((retval & 0x1F) == retval));
+/**
+ * Decode a whole sequence of 8 characters into 5 octets.
+ * Returns 0 without writing anything if a character is not in the base32
+ * alphabet, padding included.
+ */
+static int decode_sequence(const unsigned char *coded, unsigned char *plain)
+{
+    uint64_t c0 = decode_table[coded[0]], c1 = decode_table[coded[1]];
+    uint64_t c2 = decode_table[coded[2]], c3 = decode_table[coded[3]];
+    uint64_t c4 = decode_table[coded[4]], c5 = decode_table[coded[5]];
+    uint64_t c6 = decode_table[coded[6]], c7 = decode_table[coded[7]];
+    uint64_t v;
 
-    return  retval;
+    if ((c0 & c1 & c2 & c3 & c4 & c5 & c6 & c7 & VALID_BIT) == 0)
+        return 0;
+    v = ((c0 & 0x1F) << 35) | ((c1 & 0x1F) << 30) | ((c2 & 0x1F) << 25) | ((c3 & 0x1F) << 20)
+        | ((c4 & 0x1F) << 15) | ((c5 & 0x1F) << 10) | ((c6 & 0x1F) << 5) | (c7 & 0x1F);
+    plain[0] = (unsigned char)(v >> 32);
+    plain[1] = (unsigned char)(v >> 24);
+    plain[2] = (unsigned char)(v >> 16);
+    plain[3] = (unsigned char)(v >> 8);
+    plain[4] = (unsigned char)v;
+    return 1;
 }
 
 /**
- * Given a block id between 0 and 7 inclusive, this will return the index of
- * the octet in which this block starts. For example, given 3 it will return 1
- * because block 3 starts in octet 1:
- *
- * +--------+--------+
- * | ......<|.3 >....|
- * +--------+--------+
- *  octet 1 | octet 2
+ * Decode a sequence of up to 8 characters that may end with padding, or be
+ * the unpadded end of the input. Only 2, 4, 5 or 7 characters of data can
+ * end a sequence early; such a sequence is the last one, which is recorded
+ * in the decoder. Returns the number of octets written or BASE32_ERROR.
  */
-static uint32_t get_octet(uint32_t block)
+static size_t decode_last_sequence(base32_decoder *decoder, const unsigned char *coded, size_t len,
+                                   unsigned char *plain, size_t plain_len)
 {
-    assert(block >= 0 && block < 8);
-    return (block*5) / 8;
+    size_t data = 0, octets, i;
+    uint64_t v = 0;
+
+    while (data < len && coded[data] != PADDING_CHAR)
+        data++;
+    for (i = data; i < len; i++) {
+        if (coded[i] != PADDING_CHAR)
+            return BASE32_ERROR;
+    }
+    if (data < 8) {
+        if (data != 2 && data != 4 && data != 5 && data != 7)
+            return BASE32_ERROR;
+        decoder->finished = 1;
+    }
+    octets = data * 5 / 8;
+    if (octets > plain_len)
+        return BASE32_ERROR;
+    for (i = 0; i < data; i++) {
+        uint64_t c = decode_table[coded[i]];
+        if ((c & VALID_BIT) == 0)
+            return BASE32_ERROR;
+        v = (v << 5) | (c & 0x1F);
+    }
+    // the bits of the last block that don't make up a whole octet are dropped
+    v >>= data * 5 - octets * 8;
+    for (i = octets; i > 0; i--) {
+        plain[i - 1] = (unsigned char)v;
+        v >>= 8;
+    }
+    return octets;
 }
 
-/**
- * Given a block id between 0 and 7 inclusive, this will return how many bits
- * we can drop at the end of the octet in which this block starts.
- * For example, given block 0 it will return 3 because there are 3 bits
- * we don't care about at the end:
- *
- *  +--------+-
- *  |< 0 >...|
- *  +--------+-
- *
- * Given block 1, it will return -2 because there
- * are actually two bits missing to have a complete block:
- *
- *  +--------+-
- *  |.....< 1|..
- *  +--------+-
- **/
-static uint32_t get_offset(uint32_t block)
+void base32_encoder_init(base32_encoder *encoder)
 {
-    assert(block >= 0 && block < 8);
-    return (8 - 5 - (5*block) % 8);
+    encoder->pending_len = 0;
 }
 
-/**
- * Like "b >> offset" but it will do the right thing with negative offset.
- * We need this as bitwise shifting by a negative offset is undefined
- * behavior.
- */
-static unsigned char shift_right(unsigned char byte, uint32_t offset)
+size_t base32_encode_update(base32_encoder *encoder, const unsigned char *plain, size_t len, unsigned char *coded)
 {
-    //printf("byte:%d offset:%d\n", byte, offset);
-    /*
-     * offset如果为char类型，在某些平台上-char会越界
-     * char cc = -4;
-     * printf("decode char -4 :%d\n", -cc);
-     */
-    if (offset > 0)
-        return byte >>  offset;
-    else
-        return byte << -offset;
+    size_t written = 0;
+
+    if (encoder->pending_len > 0) {
+        while (encoder->pending_len < 5 && len > 0) {
+            encoder->pending[encoder->pending_len++] = *plain++;
+            len--;
+        }
+        if (encoder->pending_len < 5)
+            return 0;
+        encode_sequence(encoder->pending, coded);
+        encoder->pending_len = 0;
+        written = 8;
+    }
+    for (; len >= 5; plain += 5, len -= 5, written += 8)
+        encode_sequence(plain, coded + written);
+    memcpy(encoder->pending, plain, len);
+    encoder->pending_len = (uint32_t)len;
+    return written;
 }
 
-static unsigned char shift_left(unsigned char byte, uint32_t offset)
+size_t base32_encode_final(base32_encoder *encoder, unsigned char *coded)
 {
-    return shift_right(byte, - offset);
+    if (encoder->pending_len == 0)
+        return 0;
+    encode_tail(encoder->pending, encoder->pending_len, coded);
+    encoder->pending_len = 0;
+    return 8;
 }
 
-/**
- * Encode a sequence. A sequence is no longer than 5 octets by definition.
- * Thus passing a length greater than 5 to this function is an error. Encoding
- * sequences shorter than 5 octets is supported and padding will be added to the
- * output as per the specification.
- */
-static void encode_sequence(const unsigned char *plain, uint32_t len, unsigned char *coded)
+void base32_encode(const unsigned char *plain, size_t len, unsigned char *coded)
 {
-    assert(CHAR_BIT == 8);  // not sure this would work otherwise
-    assert(len >= 0 && len <= 5);
+    base32_encoder encoder;
 
-    for (uint32_t block = 0; block < 8; block++) {
-        uint32_t octet = get_octet(block);  // figure out which octet this block starts in
-        uint32_t junk = get_offset(block);  // how many bits do we drop from this octet?
+    base32_encoder_init(&encoder);
+    coded += base32_encode_update(&encoder, plain, len, coded);
+    base32_encode_final(&encoder, coded);
+}
 
-        if (octet >= len) { // we hit the end of the buffer
-            pad(&coded[block], 8 - block);
-            return;
-        }
+void base32_decoder_init(base32_decoder *decoder)
+{
+    decoder->pending_len = 0;
+    decoder->finished = 0;
+}
 
-        unsigned char c = shift_right(plain[octet], junk);  // first part
+size_t base32_decode_update(base32_decoder *decoder, const unsigned char *coded, size_t len,
+                            unsigned char *plain, size_t plain_len)
+{
+    size_t written = 0, n;
 
-        printf("octet:%d junk:%d c:%d\n", octet, junk, c);
-        if (junk < 0  // is there a second part?
-            &&  octet < len - 1)  // is there still something to read?
-        {
-            c |= shift_right(plain[octet+1], 8 + junk);
+    while (len > 0) {
+        // nothing may follow a sequence that ended early
+        if (decoder->finished)
+            return BASE32_ERROR;
+        if (decoder->pending_len > 0 || len < 8) {
+            while (decoder->pending_len < 8 && len > 0) {
+                decoder->pending[decoder->pending_len++] = *coded++;
+                len--;
+            }
+            if (decoder->pending_len < 8)
+                break;
+            n = decode_last_sequence(decoder, decoder->pending, 8, plain + written, plain_len - written);
+            decoder->pending_len = 0;
+        } else if (plain_len - written >= 5 && decode_sequence(coded, plain + written)) {
+            coded += 8;
+            len -= 8;
+            n = 5;
+        } else {
+            n = decode_last_sequence(decoder, coded, 8, plain + written, plain_len - written);
+            coded += 8;
+            len -= 8;
         }
-        coded[block] = encode_char(c);
+        if (n == BASE32_ERROR)
+            return BASE32_ERROR;
+        written += n;
     }
+    return written;
 }
 
-void base32_encode(const unsigned char *plain, size_t len, unsigned char *coded)
+size_t base32_decode_final(base32_decoder *decoder, unsigned char *plain, size_t plain_len)
 {
-    // All the hard work is done in encode_sequence(),
-    // here we just need to feed it the data sequence by sequence.
-    for (size_t i = 0, j = 0; i < len; i += 5, j += 8) {
-        encode_sequence(&plain[i], (uint32_t)min(len - i, 5), &coded[j]);
-    }
+    size_t n;
+
+    if (decoder->pending_len == 0)
+        return 0;
+    n = decode_last_sequence(decoder, decoder->pending, decoder->pending_len, plain, plain_len);
+    decoder->pending_len = 0;
+    return n;
 }
 
-static uint32_t decode_sequence(const unsigned char *coded, unsigned char *plain)
+size_t base32_decode_n(const unsigned char *coded, size_t len, unsigned char *plain, size_t plain_len)
 {
-    assert(CHAR_BIT == 8);
-    assert(coded && plain);
-
-    plain[0] = 0;
-    for (uint32_t block = 0; block < 8; block++) {
-        uint32_t offset = get_offset(block);
-        uint32_t octet = get_octet(block);
-
-        uint32_t c = decode_char(coded[block]);
-        if (c < 0)  // invalid char, stop here
-            return octet;
-
-        plain[octet] |= shift_left(c, offset);
-        if (offset < 0) {  // does this block overflows to next octet?
-            assert(octet < 4);
-            plain[octet+1] = shift_left(c, 8 + offset);
-        }
-    }
-    return 5;
+    base32_decoder decoder;
+    size_t n, last;
+
+    base32_decoder_init(&decoder);
+    n = base32_decode_update(&decoder, coded, len, plain, plain_len);
+    if (n == BASE32_ERROR)
+        return BASE32_ERROR;
+    last = base32_decode_final(&decoder, plain + n, plain_len - n);
+    return last == BASE32_ERROR ? BASE32_ERROR : n + last;
 }
 
 size_t base32_decode(const unsigned char *coded, unsigned char *plain)
 {
-    size_t written = 0;
-    for (size_t i = 0, j = 0; ; i += 8, j += 5) {
-        uint32_t n = decode_sequence(&coded[i], &plain[j]);
-        written += n;
-        if (n < 5)
-            return written;
-    }
+    size_t len = 0, n;
+
+    while (coded[len] == PADDING_CHAR || (decode_table[coded[len]] & VALID_BIT))
+        len++;
+    n = base32_decode_n(coded, len, plain, UNBASE32_LEN(len));
+    return n == BASE32_ERROR ? 0 : n;
 }
@@ -1,6 +1,6 @@
 /**
  *
- * 基于各种尺寸大小的空闲块链实现的内存池
+ * 小块按尺寸分级从slab分配，大块从可合并的边界标记区分配的内存池
  *
  * @file m_pool.c
  * @author chosen0ne
@@ -8,249 +8,780 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include "shm_map/m_pool.h"
 
-static uint32_t M_HEADER_SIZE = sizeof(M_header);
-static uint32_t BLOCK_HEADER_SIZE = sizeof(M_block_hdr);	// 空闲块头部大小
-static uint32_t INT_SIZE = sizeof(uint32_t);
-static uint32_t PTR_SIZE = sizeof(void *);
+#define M_TAG_USED 1
+#define M_TAG_SIZE(tag) ((tag) & ~(uint64_t)7)
+/* 大块空闲链中best fit查找的最多块数，超过后取已找到的最合适的块 */
+#define BEST_FIT_SCAN 16
+/* 一次分配或释放最多修改的元数据个数 */
+#define UNDO_REC_NUM 64
 
-static M_header* free_list = NULL;	// 空闲块链
-static uint32_t free_list_len;			// 空闲块链长度
-static void *pool_ptr_s;			// 共享内存的起始地址
-static void *pool_ptr_e;			// 共享内存的结束地址
-static uint32_t pool_byte_size;			// 内存池包含的字节数
-static uint32_t *current_p_offset;		// 当前空闲区的起始地址距离内存池起始地址的偏移量
-static shmmap_log m_pool_log;		// 日志handler
+static uint32_t TAG_SIZE = sizeof(uint64_t);				// 边界标记的大小
+static uint32_t BLOCK_HEADER_SIZE = sizeof(M_block_hdr);	// 分配出去的块的头部大小
+static uint32_t LARGE_MIN_BLOCK = 64;	// 大块区中块的最小值，小于它的剩余部分不切分
+
+/*
+ * 大块区中空闲块payload开始处的链表指针
+ */
+typedef struct m_free_links {
+	M_offset prev_offset;
+	M_offset next_offset;
+} M_free_links;
+
+/*
+ * slab头部，位于大块区中一个块的payload开始处，之后是capacity个对象
+ */
+typedef struct m_slab_hdr {
+	uint32_t class_idx;
+	uint32_t used;				// 使用中的对象个数
+	uint32_t capacity;
+	uint32_t padding;
+	M_offset free_offset;		// 空闲对象链
+	M_offset prev_offset;		// 同一尺寸级有空闲对象的slab链
+	M_offset next_offset;
+} M_slab_hdr;
+
+/*
+ * 修改元数据前记录的原内容。分配和释放结束时清空，
+ * 持锁的进程崩溃后由mp_recover按逆序恢复
+ */
+typedef struct m_undo_rec {
+	M_offset offset;
+	uint32_t len;
+	uint32_t padding;
+	uint64_t old[2];
+} M_undo_rec;
+
+/* slab头部占用的字节数，保证对象按8字节对齐 */
+#define SLAB_HDR_SIZE ((sizeof(M_slab_hdr) + 7) & ~(size_t)7)
+
+typedef struct m_slab_class {
+	M_offset partial_offset;	// 有空闲对象的slab链
+	uint32_t obj_size;			// 对象大小，包括块头部
+	uint32_t slab_count;
+	uint64_t used_count;		// 使用中的对象个数
+	uint64_t free_count;		// slab中空闲的对象个数
+} M_slab_class;
+
+/*
+ * 内存池头部：
+ * 头部后面是大块区，大块区首尾各有一个标记为使用中的8字节边界标记，合并时不会越界
+ */
+struct m_pool_hdr {
+	uint32_t slab_class_len;
+	uint32_t large_bin_len;
+	M_offset area_offset;		// 大块区中第一个块的偏移量
+	M_offset area_end;			// 大块区结尾边界标记的偏移量
+	uint64_t free_size;			// 大块区空闲字节数
+	uint64_t free_block_count;
+	uint64_t coalesce_count;
+	uint64_t slab_release_count;
+	M_header large_bins[LARGE_BIN_NUM];
+	M_slab_class slab_classes[SLAB_CLASS_NUM];
+	uint32_t undo_len;			// 未完成的操作的undo记录数
+	uint32_t padding;
+	M_undo_rec undo[UNDO_REC_NUM];
+};
+
+static M_pool default_pool;			// m_init等不带内存池参数的接口使用的内存池
 
 static const char *log_level_labels[SHMMAP_LOG_LEVEL_NUM] = {"DEBUG", "INFO", "WARN", "ERROR"};
 
-/* 根据申请的内存大小返回对应的空闲块链 */
-static uint32_t free_list_idx(uint32_t size);
-/* 根据空闲块的起始地址获取该空闲块对应的数据字段的起始地址*/
-static uint32_t get_mnode_data(uint32_t p);
-/* 根据空闲块中data字段的起始地址获取对应的空闲块的地址 */
-static uint32_t get_mnode_by_data(uint32_t p);
-static uint32_t get_mnode_by_data_ptr(void *p);
-static uint32_t m_free_blck_size();
-static void* get_cur_ptr();
-static void set_cur_ptr_offset(uint32_t offset);
-
-/* 根据块大小找到对应的链表在free_list中的下标 */
-static uint32_t
-free_list_idx(uint32_t size){
-	if(size % 8 == 0)
-		return (size >> 3) - 1;
-	return size >> 3;
+static inline void*
+at(M_pool *pool, M_offset offset){
+	return (char *)pool->pool_ptr_s + offset;
 }
 
-/* 根据空闲块的偏移量返回数据字段偏移量 */
-static uint32_t
-get_mnode_data(uint32_t block_ptr){
-	uint32_t data_offset = block_ptr + BLOCK_HEADER_SIZE;
-	if(data_offset > pool_byte_size){
-		m_pool_log(SHMMAP_LOG_ERROR, "[get_mnode_data]The offset(%d) of data ptr is bigger than pool_byte_size(%d)",
-                   data_offset, pool_byte_size);
-		return -1;
+static inline uint64_t*
+block_head(M_pool *pool, M_offset block_offset){
+	return (uint64_t *)at(pool, block_offset);
+}
+
+static inline M_free_links*
+block_links(M_pool *pool, M_offset block_offset){
+	return (M_free_links *)at(pool, block_offset + TAG_SIZE);
+}
+
+/*
+ * 修改p处len个字节前记录原内容。先写记录再增加记录数，
+ * 编译器屏障保证记录数先于修改写入
+ */
+static inline void
+undo_save(M_pool *pool, const void *p, uint32_t len){
+	struct m_pool_hdr 	*hdr = pool->hdr;
+	uint32_t 			n = hdr->undo_len;
+	M_undo_rec 			*rec;
+
+	if(n >= UNDO_REC_NUM){
+		pool->log(SHMMAP_LOG_ERROR, "[undo_save]More than %d changes in one operation", UNDO_REC_NUM);
+		return;
 	}
-	return data_offset;
+	rec = &hdr->undo[n];
+	rec->offset = (M_offset)((const char *)p - (const char *)pool->pool_ptr_s);
+	rec->len = len;
+	memcpy(rec->old, p, len);
+	__atomic_store_n(&hdr->undo_len, n + 1, __ATOMIC_RELEASE);
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
 }
 
-/* 根据数据字段的偏移量获取整个块的偏移量 */
+/* 记录原值后修改元数据字段 */
+#define UNDO_SET(pool, field, value) do { \
+		undo_save(pool, &(field), sizeof(field)); \
+		(field) = (value); \
+	} while(0)
+
+/* 操作完成，清空undo记录 */
+static inline void
+undo_commit(M_pool *pool){
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	__atomic_store_n(&pool->hdr->undo_len, 0, __ATOMIC_RELEASE);
+}
+
+/* 设置块首尾的边界标记 */
+static void
+set_block_tags(M_pool *pool, M_offset block_offset, uint64_t size, uint64_t used){
+	UNDO_SET(pool, *block_head(pool, block_offset), size | used);
+	UNDO_SET(pool, *(uint64_t *)at(pool, block_offset + size - TAG_SIZE), size | used);
+}
+
+/*
+ * 尺寸级：8到64字节每8字节一级，之后每次翻倍分为4级，最大SLAB_MAX_SIZE
+ */
 static uint32_t
-get_mnode_by_data(uint32_t data_offset){
-	uint32_t block_offset = data_offset - BLOCK_HEADER_SIZE;
-	if(block_offset < 0){
-		m_pool_log(SHMMAP_LOG_ERROR, "[get_mnode_by_data]The offset(%d) of block ptr is lesser than 0");
-		return -1;
-	}
-	return block_offset;
+slab_class_idx(uint32_t size){
+	uint32_t units = (size + 7) >> 3;
+	uint32_t p;
+	if(units <= 8)
+		return units == 0 ? 0 : units - 1;
+	p = 31 - __builtin_clz(units - 1);
+	return 8 + (p - 3) * 4 + ((units - 1 - (1u << p)) >> (p - 2));
 }
 
-/* 根据数据字段的指针获取块的偏移量 */
 static uint32_t
-get_mnode_by_data_ptr(void *p){
-	uint32_t offset = ptr_offset(p);
-	return get_mnode_by_data(offset);
+slab_class_size(uint32_t idx){
+	uint32_t p, k;
+	if(idx < 8)
+		return (idx + 1) << 3;
+	p = (idx - 8) / 4 + 3;
+	k = (idx - 8) % 4;
+	return ((1u << p) + ((k + 1) << (p - 2))) << 3;
 }
 
-static void*
-get_cur_ptr(){
-	return (char *)pool_ptr_s + *current_p_offset;
+/* 块大小对应的大块空闲链 */
+static uint32_t
+large_bin_idx(uint64_t size){
+	uint32_t i = 63 - __builtin_clzll(size);
+	i = i < 5 ? 0 : i - 5;
+	return i < LARGE_BIN_NUM ? i : LARGE_BIN_NUM - 1;
+}
+
+/* 块加入空闲链。链表指针覆盖块原来的内容(释放时是块头部)，整体记录 */
+static void
+bin_insert(M_pool *pool, M_offset block_offset, uint64_t size){
+	M_header 		*bin = &pool->hdr->large_bins[large_bin_idx(size)];
+	M_free_links 	*links = block_links(pool, block_offset);
+
+	undo_save(pool, links, sizeof(*links));
+	links->prev_offset = NIL_OFFSET;
+	links->next_offset = bin->header_offset;
+	if(bin->header_offset != NIL_OFFSET)
+		UNDO_SET(pool, block_links(pool, bin->header_offset)->prev_offset, block_offset);
+	UNDO_SET(pool, bin->header_offset, block_offset);
+	UNDO_SET(pool, bin->size, bin->size + 1);
+	UNDO_SET(pool, pool->hdr->free_size, pool->hdr->free_size + size);
+	UNDO_SET(pool, pool->hdr->free_block_count, pool->hdr->free_block_count + 1);
 }
 
+/* 块移出空闲链。调用者随后会覆盖块的链表指针，先记录下来 */
 static void
-set_cur_ptr_offset(uint32_t offset){
-	*current_p_offset = *current_p_offset + offset;
+bin_remove(M_pool *pool, M_offset block_offset, uint64_t size){
+	M_header 		*bin = &pool->hdr->large_bins[large_bin_idx(size)];
+	M_free_links 	*links = block_links(pool, block_offset);
+
+	undo_save(pool, links, sizeof(*links));
+	if(links->prev_offset != NIL_OFFSET)
+		UNDO_SET(pool, block_links(pool, links->prev_offset)->next_offset, links->next_offset);
+	else
+		UNDO_SET(pool, bin->header_offset, links->next_offset);
+	if(links->next_offset != NIL_OFFSET)
+		UNDO_SET(pool, block_links(pool, links->next_offset)->prev_offset, links->prev_offset);
+	UNDO_SET(pool, bin->size, bin->size - 1);
+	UNDO_SET(pool, pool->hdr->free_size, pool->hdr->free_size - size);
+	UNDO_SET(pool, pool->hdr->free_block_count, pool->hdr->free_block_count - 1);
 }
 
 /**
- * 分配大小为size字节的内存
- * return: 返回距离内存池起始地址的偏移量
+ * 从大块区分配size字节(包括边界标记)的块
+ * return: 块的偏移量，没有足够大的空闲块时返回NIL_OFFSET
  */
-static uint32_t
-_m_alloc(uint32_t size){
-	M_header 		*hdr;
-	M_block_hdr 	*p, *q;
-	uint32_t 			idx, p_offset, q_offset;
-
-	idx = free_list_idx(size);
-	if(idx >= free_list_len){
-		m_pool_log(SHMMAP_LOG_ERROR, "[_m_alloc]The max block size is %d, the request is too large %d", free_list_len<<3, size);
-		return -1;
-	}
-	hdr = &free_list[idx];
-
-	if(hdr->size > 0){
-		// 有空闲块链，直接分配内存，从header删除m_node
-		p_offset = hdr->header_offset;
-		p = (M_block_hdr *)get_ptr(p_offset);
-		q_offset = p->next_offset;
-		if(q_offset != NIL){
-			q = (M_block_hdr *)get_ptr(q_offset);
-			q->prev_offset = NIL;
+static M_offset
+large_alloc(M_pool *pool, uint64_t size){
+	uint32_t 	idx = large_bin_idx(size), n;
+	M_offset 	p_offset, best = NIL_OFFSET;
+	uint64_t 	p_size, best_size = 0;
+
+	// 在对应的链中找最合适的块
+	for(n=0, p_offset=pool->hdr->large_bins[idx].header_offset; p_offset!=NIL_OFFSET && n<BEST_FIT_SCAN;
+			n++, p_offset=block_links(pool, p_offset)->next_offset){
+		p_size = M_TAG_SIZE(*block_head(pool, p_offset));
+		if(p_size >= size && (best == NIL_OFFSET || p_size < best_size)){
+			best = p_offset;
+			best_size = p_size;
+			if(p_size == size)
+				break;
 		}
-		hdr->header_offset = q_offset;
-		hdr->size--;
-		return get_mnode_data(p_offset);
-	}else{
-		// 没有空闲块时，直接从空闲内存分配
-		uint32_t chunck_size = (idx+1) << 3;
-		uint32_t block_size = BLOCK_HEADER_SIZE + chunck_size;
-		if(*current_p_offset + block_size > pool_byte_size){
-			m_pool_log(SHMMAP_LOG_ERROR, "[_m_alloc]The unallocated area is used up, the size of free space is %d",
-				m_free_size());
-			return -1;
+	}
+	// 更大的链中的块都能容纳
+	for(idx++; best == NIL_OFFSET && idx < LARGE_BIN_NUM; idx++){
+		if(pool->hdr->large_bins[idx].size > 0){
+			best = pool->hdr->large_bins[idx].header_offset;
+			best_size = M_TAG_SIZE(*block_head(pool, best));
 		}
-		p = (M_block_hdr *)get_cur_ptr();
-		// 标记这个内存块对应的空闲块列表的下标
-		p->idx = idx;
+	}
+	if(best == NIL_OFFSET)
+		return NIL_OFFSET;
+
+	bin_remove(pool, best, best_size);
+	if(best_size - size >= LARGE_MIN_BLOCK){
+		set_block_tags(pool, best + size, best_size - size, 0);
+		bin_insert(pool, best + size, best_size - size);
+		best_size = size;
+	}
+	set_block_tags(pool, best, best_size, M_TAG_USED);
+	return best;
+}
+
+/* 释放大块区中的块，与相邻的空闲块合并 */
+static void
+large_free(M_pool *pool, M_offset block_offset){
+	uint64_t 	tag = *block_head(pool, block_offset);
+	uint64_t 	size = M_TAG_SIZE(tag), neighbor;
 
-		set_cur_ptr_offset(block_size);
-		padding(get_cur_ptr());
-		set_cur_ptr_offset(INT_SIZE);
-		return get_mnode_data(ptr_offset(p));
+	if(!(tag & M_TAG_USED)){
+		pool->log(SHMMAP_LOG_ERROR, "[large_free]The block at offset %" PRIu64 " is already free", (uint64_t)block_offset);
+		return;
+	}
+	neighbor = *block_head(pool, block_offset + size);
+	if(!(neighbor & M_TAG_USED)){
+		bin_remove(pool, block_offset + size, M_TAG_SIZE(neighbor));
+		size += M_TAG_SIZE(neighbor);
+		pool->hdr->coalesce_count++;
+	}
+	neighbor = *(uint64_t *)at(pool, block_offset - TAG_SIZE);
+	if(!(neighbor & M_TAG_USED)){
+		block_offset -= M_TAG_SIZE(neighbor);
+		bin_remove(pool, block_offset, M_TAG_SIZE(neighbor));
+		size += M_TAG_SIZE(neighbor);
+		pool->hdr->coalesce_count++;
 	}
+	set_block_tags(pool, block_offset, size, 0);
+	bin_insert(pool, block_offset, size);
+}
+
+static void
+slab_link(M_pool *pool, M_slab_class *cls, M_offset slab_offset){
+	M_slab_hdr *slab = (M_slab_hdr *)at(pool, slab_offset);
+	UNDO_SET(pool, slab->prev_offset, NIL_OFFSET);
+	UNDO_SET(pool, slab->next_offset, cls->partial_offset);
+	if(cls->partial_offset != NIL_OFFSET)
+		UNDO_SET(pool, ((M_slab_hdr *)at(pool, cls->partial_offset))->prev_offset, slab_offset);
+	UNDO_SET(pool, cls->partial_offset, slab_offset);
+}
+
+static void
+slab_unlink(M_pool *pool, M_slab_class *cls, M_offset slab_offset){
+	M_slab_hdr *slab = (M_slab_hdr *)at(pool, slab_offset);
+	if(slab->prev_offset != NIL_OFFSET)
+		UNDO_SET(pool, ((M_slab_hdr *)at(pool, slab->prev_offset))->next_offset, slab->next_offset);
+	else
+		UNDO_SET(pool, cls->partial_offset, slab->next_offset);
+	if(slab->next_offset != NIL_OFFSET)
+		UNDO_SET(pool, ((M_slab_hdr *)at(pool, slab->next_offset))->prev_offset, slab->prev_offset);
 }
 
 /*
- * 释放内存
- * data_offset: 数据字段距离内存池起始地址的偏移量
+ * 为尺寸级idx申请一个新的slab，所有对象加入空闲对象链。
+ * 新块中的内容不记录undo，回滚后块回到空闲链，内容无效
  */
-void
-_m_free(uint32_t data_offset){
-	M_block_hdr		*block_ptr, *tail_block_ptr;
-	uint32_t 			idx, block_offset, tail_block_offset;
-	M_header		*hdr;
-
-	block_offset = get_mnode_by_data(data_offset);
-	if(block_offset == -1){
-		m_pool_log(SHMMAP_LOG_ERROR, "[_m_free]Get block offset error");
-		return;
+static bool
+slab_new(M_pool *pool, uint32_t idx){
+	M_slab_class 	*cls = &pool->hdr->slab_classes[idx];
+	M_slab_hdr 		*slab;
+	M_block_hdr 	*obj;
+	M_offset 		block_offset, slab_offset, obj_offset;
+	uint32_t 		i;
+
+	block_offset = large_alloc(pool, SLAB_SIZE);
+	if(block_offset == NIL_OFFSET)
+		return false;
+	slab_offset = block_offset + TAG_SIZE;
+	slab = (M_slab_hdr *)at(pool, slab_offset);
+	slab->class_idx = idx;
+	slab->used = 0;
+	slab->capacity = (SLAB_SIZE - 2 * TAG_SIZE - SLAB_HDR_SIZE) / cls->obj_size;
+	slab->padding = 0;
+	slab->free_offset = NIL_OFFSET;
+	// 倒序加入空闲链，按地址顺序分配
+	for(i=slab->capacity; i>0; i--){
+		obj_offset = slab_offset + SLAB_HDR_SIZE + (M_offset)(i - 1) * cls->obj_size;
+		obj = (M_block_hdr *)at(pool, obj_offset);
+		obj->idx = idx | M_FREE_FLAG;
+		obj->data_len = 0;
+		obj->prev_offset = slab_offset;
+		obj->next_offset = slab->free_offset;
+		slab->free_offset = obj_offset;
 	}
-	block_ptr = (M_block_hdr *)get_ptr(block_offset);
-	idx = block_ptr->idx;
-	if(idx<0 || idx>=free_list_len){
-		m_pool_log(SHMMAP_LOG_ERROR, "[_m_free]The free block linked list do not exist. The length of free list is %d, "
-                                     "and the index of the block to free is %d",
-			free_list_len, idx);
-		return;
+	slab_link(pool, cls, slab_offset);
+	UNDO_SET(pool, cls->slab_count, cls->slab_count + 1);
+	UNDO_SET(pool, cls->free_count, cls->free_count + slab->capacity);
+	return true;
+}
+
+/* 从尺寸级idx的slab分配一个对象，返回块头部的偏移量 */
+static M_offset
+slab_alloc(M_pool *pool, uint32_t idx){
+	M_slab_class 	*cls = &pool->hdr->slab_classes[idx];
+	M_slab_hdr 		*slab;
+	M_block_hdr 	*obj;
+	M_offset 		obj_offset;
+
+	if(cls->partial_offset == NIL_OFFSET && !slab_new(pool, idx))
+		return NIL_OFFSET;
+	slab = (M_slab_hdr *)at(pool, cls->partial_offset);
+	obj_offset = slab->free_offset;
+	obj = (M_block_hdr *)at(pool, obj_offset);
+	UNDO_SET(pool, slab->free_offset, obj->next_offset);
+	UNDO_SET(pool, slab->used, slab->used + 1);
+	if(slab->free_offset == NIL_OFFSET)
+		slab_unlink(pool, cls, cls->partial_offset);
+	UNDO_SET(pool, obj->idx, idx);
+	UNDO_SET(pool, obj->next_offset, NIL_OFFSET);
+	UNDO_SET(pool, cls->used_count, cls->used_count + 1);
+	UNDO_SET(pool, cls->free_count, cls->free_count - 1);
+	return obj_offset;
+}
+
+/* 释放slab中的对象，slab空了且不是该级唯一有空闲对象的slab时还给大块区 */
+static void
+slab_free(M_pool *pool, M_offset obj_offset, M_block_hdr *obj){
+	M_offset 		slab_offset = obj->prev_offset;
+	M_slab_hdr 		*slab = (M_slab_hdr *)at(pool, slab_offset);
+	M_slab_class 	*cls = &pool->hdr->slab_classes[slab->class_idx];
+	bool 			was_full = slab->free_offset == NIL_OFFSET;
+
+	UNDO_SET(pool, obj->idx, obj->idx | M_FREE_FLAG);
+	UNDO_SET(pool, obj->next_offset, slab->free_offset);
+	UNDO_SET(pool, slab->free_offset, obj_offset);
+	UNDO_SET(pool, slab->used, slab->used - 1);
+	UNDO_SET(pool, cls->used_count, cls->used_count - 1);
+	UNDO_SET(pool, cls->free_count, cls->free_count + 1);
+	if(was_full)
+		slab_link(pool, cls, slab_offset);
+	if(slab->used == 0 && !(cls->partial_offset == slab_offset && slab->next_offset == NIL_OFFSET)){
+		slab_unlink(pool, cls, slab_offset);
+		UNDO_SET(pool, cls->slab_count, cls->slab_count - 1);
+		UNDO_SET(pool, cls->free_count, cls->free_count - slab->capacity);
+		pool->hdr->slab_release_count++;
+		large_free(pool, slab_offset - TAG_SIZE);
+	}
+}
+
+/**
+ * 分配可以容纳size字节的内存
+ * return: 返回块头部距离内存池起始地址的偏移量
+ */
+/* 从大块区分配size字节的数据需要的块大小 */
+static uint64_t
+large_block_size(uint32_t size){
+	uint64_t block_size = ((uint64_t)size + BLOCK_HEADER_SIZE + 2 * TAG_SIZE + 7) & ~(uint64_t)7;
+	return block_size < LARGE_MIN_BLOCK ? LARGE_MIN_BLOCK : block_size;
+}
+
+/* 大块区中是否有不小于size的空闲块 */
+static bool
+large_can_alloc(M_pool *pool, uint64_t size){
+	uint32_t 	idx = large_bin_idx(size), n;
+	M_offset 	p_offset;
+
+	for(n=0, p_offset=pool->hdr->large_bins[idx].header_offset; p_offset!=NIL_OFFSET && n<BEST_FIT_SCAN;
+			n++, p_offset=block_links(pool, p_offset)->next_offset){
+		if(M_TAG_SIZE(*block_head(pool, p_offset)) >= size)
+			return true;
 	}
-	hdr = &free_list[idx];
-	if(hdr->size == 0){
-		block_ptr->prev_offset = NIL;
-		hdr->header_offset = hdr->tail_offset = block_offset;
+	for(idx++; idx < LARGE_BIN_NUM; idx++){
+		if(pool->hdr->large_bins[idx].size > 0)
+			return true;
+	}
+	return false;
+}
+
+static M_offset
+_m_alloc(M_pool *pool, uint32_t size, bool log_miss){
+	M_offset 	block_offset;
+	M_block_hdr *p;
+	uint64_t 	block_size;
+
+	if(size <= SLAB_MAX_SIZE){
+		block_offset = slab_alloc(pool, slab_class_idx(size));
+		if(block_offset != NIL_OFFSET)
+			return block_offset;
+		// 没有空间创建slab时，直接从大块区分配
+	}
+	block_size = large_block_size(size);
+	block_offset = large_alloc(pool, block_size);
+	if(block_offset == NIL_OFFSET){
+		if(log_miss)
+			pool->log(SHMMAP_LOG_ERROR, "[_m_alloc]No free block for %u bytes, the size of free space is %" PRIu64 " in %" PRIu64 " blocks",
+			size, pool->hdr->free_size, pool->hdr->free_block_count);
+		return NIL_OFFSET;
+	}
+	block_offset += TAG_SIZE;
+	p = (M_block_hdr *)at(pool, block_offset);
+	p->idx = M_LARGE_IDX;
+	p->prev_offset = NIL_OFFSET;
+	p->next_offset = NIL_OFFSET;
+	return block_offset;
+}
+
+/*
+ * 释放内存
+ * block_offset: 块头部距离内存池起始地址的偏移量
+ */
+static void
+_m_free(M_pool *pool, M_offset block_offset){
+	M_block_hdr *block_ptr = (M_block_hdr *)at(pool, block_offset);
+
+	if(block_ptr->idx == M_LARGE_IDX){
+		large_free(pool, block_offset - TAG_SIZE);
+	}else if(block_ptr->idx < SLAB_CLASS_NUM){
+		slab_free(pool, block_offset, block_ptr);
 	}else{
-		// 加入空闲块链表，在tail添加
-		tail_block_offset = hdr->tail_offset;
-		tail_block_ptr = (M_block_hdr *)get_ptr(tail_block_offset);
-		block_ptr->prev_offset = tail_block_offset;
-		tail_block_ptr->next_offset = block_offset;
-		hdr->tail_offset = block_offset;
+		pool->log(SHMMAP_LOG_ERROR, "[_m_free]The block at offset %" PRIu64 " has invalid index %#x, it may be freed twice",
+			(uint64_t)block_offset, block_ptr->idx);
 	}
-	block_ptr->next_offset = NIL;
-	hdr->size ++;
 }
 
 bool
-m_init(char *p, uint32_t pool_byte_len, shmmap_log log, bool is_inited){
-	uint32_t 	i;
-	uint32_t 	*size_p;
+mp_init(M_pool *pool, char *p, uint64_t pool_byte_len, shmmap_log log, bool is_inited){
+	uint32_t 		i;
+	uint64_t 		hdr_size = (sizeof(struct m_pool_hdr) + 7) & ~(uint64_t)7;
+	struct m_pool_hdr *hdr;
 
 	// 初始化日志handler
-	m_pool_log = log;
+	pool->log = log;
 	if(log == NULL){
-		m_pool_log = default_shmmap_log;
+		pool->log = default_shmmap_log;
 	}
 
-	free_list_len = FREE_LIST_SIZE;
-	if(pool_byte_len < INT_SIZE*3 + M_HEADER_SIZE*free_list_len + PTR_SIZE){
-		m_pool_log(SHMMAP_LOG_ERROR, "[m_init]The pool size is too small %d bytes，it can't allocate memory for index %d bytes",
-			pool_byte_len, INT_SIZE*2+M_HEADER_SIZE*free_list_len);
+	if(((uintptr_t)p & 7) != 0){
+		pool->log(SHMMAP_LOG_ERROR, "[m_init]The pool address %p is not 8 bytes aligned", p);
+		return false;
+	}
+	if(pool_byte_len < hdr_size + 2 * TAG_SIZE + LARGE_MIN_BLOCK){
+		pool->log(SHMMAP_LOG_ERROR, "[m_init]The pool size is too small %" PRIu64 " bytes，it can't allocate memory for index %" PRIu64 " bytes",
+			pool_byte_len, hdr_size);
+		return false;
+	}
+	if(pool_byte_len > (uint64_t)NIL_OFFSET){
+		pool->log(SHMMAP_LOG_ERROR, "[m_init]The pool size %" PRIu64 " bytes exceeds the range of %d bit offsets",
+			pool_byte_len, SHMMAP_OFFSET_BITS);
 		return false;
 	}
 
-	pool_ptr_s = p;
-	pool_byte_size = pool_byte_len;
-	pool_ptr_e = p + pool_byte_size;
+	pool->pool_ptr_s = p;
+	pool->pool_byte_size = pool_byte_len;
+	pool->pool_ptr_e = p + pool->pool_byte_size;
+	pool->hdr = hdr = (struct m_pool_hdr *)p;
 
-	/**
-	 * 内存池头部：
-	 * Free List Len 	(4bytes)
-	 * padding			(4bytes)
-	 * current ptr		(PTR_SIZE)
-	 * padding			(4bytes)
-	 * Free List		(M_HEADER_SIZE * free_list_len)
-	 */
 	if(is_inited){
-		p += 2 * INT_SIZE;
-		current_p_offset = (uint32_t *)p;
-		p += PTR_SIZE + INT_SIZE;
-		free_list = (M_header *)p;
+		if(hdr->slab_class_len != SLAB_CLASS_NUM || hdr->large_bin_len != LARGE_BIN_NUM
+				|| hdr->area_end + TAG_SIZE > pool_byte_len){
+			pool->log(SHMMAP_LOG_ERROR, "[m_init]The pool header doesn't match, %u slab classes, %u bins, area end at %" PRIu64,
+				hdr->slab_class_len, hdr->large_bin_len, (uint64_t)hdr->area_end);
+			return false;
+		}
 	}else{
-		size_p = (uint32_t *)p;
-		*size_p++ = free_list_len;
-		*size_p = 0;	// padding
-		p += INT_SIZE * 2;
-		current_p_offset = (uint32_t *)p;
-		p += PTR_SIZE;
-		padding(p);
-		p += INT_SIZE;
-		free_list = (M_header *)p;
-		for(i=0; i<free_list_len; i++){
-			(free_list+i)->idx = i;
-			(free_list+i)->size = 0;
+		memset(hdr, 0, hdr_size);
+		hdr->slab_class_len = SLAB_CLASS_NUM;
+		hdr->large_bin_len = LARGE_BIN_NUM;
+		for(i=0; i<LARGE_BIN_NUM; i++){
+			hdr->large_bins[i].header_offset = NIL_OFFSET;
+			hdr->large_bins[i].tail_offset = NIL_OFFSET;
+			hdr->large_bins[i].idx = i;
 		}
-		p += M_HEADER_SIZE * free_list_len;
-		padding(p);
-		*current_p_offset = p + INT_SIZE - (char *)pool_ptr_s;
+		for(i=0; i<SLAB_CLASS_NUM; i++){
+			hdr->slab_classes[i].partial_offset = NIL_OFFSET;
+			hdr->slab_classes[i].obj_size = BLOCK_HEADER_SIZE + slab_class_size(i);
+		}
+		// 首尾的边界标记标为使用中，中间是一个空闲块
+		hdr->area_offset = hdr_size + TAG_SIZE;
+		hdr->area_end = (pool_byte_len & ~(uint64_t)7) - TAG_SIZE;
+		*(uint64_t *)at(pool, hdr->area_offset - TAG_SIZE) = M_TAG_USED;
+		*(uint64_t *)at(pool, hdr->area_end) = M_TAG_USED;
+		set_block_tags(pool, hdr->area_offset, hdr->area_end - hdr->area_offset, 0);
+		bin_insert(pool, hdr->area_offset, hdr->area_end - hdr->area_offset);
+		// 初始化完成，否则第一次分配提交前的mp_recover会回滚唯一的空闲块
+		undo_commit(pool);
 	}
 
-	m_pool_log(SHMMAP_LOG_INFO, "[m_init]Init memory pool, address start at %p, end at %p, cur offset at %d, size is %d",
-		pool_ptr_s, pool_ptr_e, *current_p_offset, pool_byte_len);
+	pool->log(SHMMAP_LOG_INFO, "[m_init]Init memory pool, address start at %p, end at %p, free %" PRIu64 " bytes, size is %" PRIu64,
+		pool->pool_ptr_s, pool->pool_ptr_e, hdr->free_size, pool_byte_len);
 
 	return true;
 }
 
 /**
- * 返回空闲块的起始地址
+ * 返回数据字段的起始地址
  */
 void*
-m_alloc(uint32_t size){
-	uint32_t ptr_offset = _m_alloc(size);
-	if(ptr_offset != -1){
-		return get_ptr(ptr_offset);
+mp_alloc(M_pool *pool, uint32_t size){
+	M_offset block_offset = _m_alloc(pool, size, true);
+	undo_commit(pool);
+	if(block_offset != NIL_OFFSET){
+		return (char *)at(pool, block_offset) + BLOCK_HEADER_SIZE;
 	}
 	return NULL;
 }
 
+void*
+mp_try_alloc(M_pool *pool, uint32_t size){
+	M_offset block_offset = _m_alloc(pool, size, false);
+	undo_commit(pool);
+	if(block_offset != NIL_OFFSET){
+		return (char *)at(pool, block_offset) + BLOCK_HEADER_SIZE;
+	}
+	return NULL;
+}
+
+bool
+mp_can_alloc(M_pool *pool, uint32_t size){
+	if(size <= SLAB_MAX_SIZE){
+		if(pool->hdr->slab_classes[slab_class_idx(size)].partial_offset != NIL_OFFSET
+				|| large_can_alloc(pool, SLAB_SIZE))
+			return true;
+	}
+	return large_can_alloc(pool, large_block_size(size));
+}
+
+bool
+mp_block_fits(void *data_ptr, uint32_t size){
+	M_block_hdr *p = (M_block_hdr *)((char *)data_ptr - BLOCK_HEADER_SIZE);
+	if(p->idx == M_LARGE_IDX)
+		return M_TAG_SIZE(*(uint64_t *)((char *)p - TAG_SIZE)) >= large_block_size(size);
+	return size <= SLAB_MAX_SIZE && p->idx == slab_class_idx(size);
+}
+
 /**
- * 传入要释放的空闲块的data字段起始地址
+ * 传入要释放的块的data字段起始地址
+ */
+void
+mp_free(M_pool *pool, void *data_ptr){
+	_m_free(pool, mp_ptr_offset(pool, data_ptr) - BLOCK_HEADER_SIZE);
+	undo_commit(pool);
+}
+
+/*
+ * 回滚持锁进程崩溃时未完成的分配或释放，然后校验大块区
+ */
+void
+mp_recover(M_pool *pool){
+	struct m_pool_hdr 	*hdr = pool->hdr;
+	uint32_t 			n = hdr->undo_len, i;
+	M_undo_rec 			*rec;
+
+	if(n > UNDO_REC_NUM)
+		n = UNDO_REC_NUM;
+	for(i=n; i>0; i--){
+		rec = &hdr->undo[i - 1];
+		if(rec->len > sizeof(rec->old) || rec->offset > pool->pool_byte_size - rec->len){
+			pool->log(SHMMAP_LOG_ERROR, "[mp_recover]Invalid undo record at offset %" PRIu64 ", %u bytes",
+				(uint64_t)rec->offset, rec->len);
+			continue;
+		}
+		memcpy(at(pool, rec->offset), rec->old, rec->len);
+	}
+	undo_commit(pool);
+	if(n > 0)
+		pool->log(SHMMAP_LOG_WARN, "[mp_recover]%u changes of an unfinished operation are rolled back", n);
+	if(!mp_check(pool))
+		pool->log(SHMMAP_LOG_ERROR, "[mp_recover]The pool is still inconsistent after rollback");
+}
+
+/*
+ * 按边界标记遍历大块区，校验首尾标记一致、没有相邻的空闲块，
+ * 空闲链中的块和统计与遍历的结果一致
+ */
+bool
+mp_check(M_pool *pool){
+	struct m_pool_hdr 	*hdr = pool->hdr;
+	M_offset 			offset = hdr->area_offset, p_offset;
+	uint64_t 			tag, size, free_size = 0, free_count = 0, listed = 0;
+	bool 				prev_free = false;
+	uint32_t 			i;
+
+	while(offset < hdr->area_end){
+		tag = *block_head(pool, offset);
+		size = M_TAG_SIZE(tag);
+		if(size < LARGE_MIN_BLOCK || size > hdr->area_end - offset
+				|| *(uint64_t *)at(pool, offset + size - TAG_SIZE) != tag){
+			pool->log(SHMMAP_LOG_ERROR, "[mp_check]Invalid boundary tag %#" PRIx64 " at offset %" PRIu64, tag, (uint64_t)offset);
+			return false;
+		}
+		if(!(tag & M_TAG_USED)){
+			if(prev_free){
+				pool->log(SHMMAP_LOG_ERROR, "[mp_check]Free block at offset %" PRIu64 " isn't coalesced", (uint64_t)offset);
+				return false;
+			}
+			free_size += size;
+			free_count++;
+		}
+		prev_free = !(tag & M_TAG_USED);
+		offset += size;
+	}
+	for(i=0; i<LARGE_BIN_NUM; i++){
+		for(p_offset=hdr->large_bins[i].header_offset; p_offset!=NIL_OFFSET;
+				p_offset=block_links(pool, p_offset)->next_offset){
+			if(p_offset < hdr->area_offset || p_offset >= hdr->area_end || ++listed > free_count
+					|| (*block_head(pool, p_offset) & M_TAG_USED)
+					|| large_bin_idx(M_TAG_SIZE(*block_head(pool, p_offset))) != i){
+				pool->log(SHMMAP_LOG_ERROR, "[mp_check]Invalid block at offset %" PRIu64 " in free list %u", (uint64_t)p_offset, i);
+				return false;
+			}
+		}
+	}
+	if(listed != free_count || free_size != hdr->free_size || free_count != hdr->free_block_count){
+		pool->log(SHMMAP_LOG_ERROR, "[mp_check]%" PRIu64 " free blocks of %" PRIu64 " bytes, %" PRIu64 " listed, recorded %" PRIu64 " blocks of %" PRIu64 " bytes",
+			free_count, free_size, listed, hdr->free_block_count, hdr->free_size);
+		return false;
+	}
+	return true;
+}
+
+uint64_t
+mp_free_size(M_pool *pool){
+	return pool->hdr->free_size;
+}
+
+uint64_t
+mp_pool_size(M_pool *pool){
+	return pool->pool_byte_size;
+}
+
+void
+mp_free_list_info(M_pool *pool){
+	uint32_t i;
+	M_slab_class *cls;
+	for(i=0; i<SLAB_CLASS_NUM; i++){
+		cls = &pool->hdr->slab_classes[i];
+		if(cls->slab_count != 0){
+			pool->log(SHMMAP_LOG_INFO, "[slab %u bytes] slabs: %u, used: %" PRIu64 ", free: %" PRIu64,
+				slab_class_size(i), cls->slab_count, cls->used_count, cls->free_count);
+		}
+	}
+	for(i=0; i<LARGE_BIN_NUM; i++){
+		if(pool->hdr->large_bins[i].size != 0){
+			pool->log(SHMMAP_LOG_INFO, "[large %" PRIu64 " bytes] free blocks: %u",
+				(uint64_t)1 << (i + 5), pool->hdr->large_bins[i].size);
+		}
+	}
+}
+
+/*
+ * 最大的空闲块。不加锁读取时链表可能正在被修改，只访问大块区内的偏移量，
+ * 每个链最多访问链长个块
  */
+static uint64_t
+largest_free_block(M_pool *pool){
+	int 		i;
+	uint32_t 	n, len;
+	M_offset 	p_offset;
+	uint64_t 	size, largest = 0;
+	M_offset 	area_offset = pool->hdr->area_offset, area_end = pool->hdr->area_end;
+
+	for(i=LARGE_BIN_NUM-1; i>=0 && largest==0; i--){
+		len = __atomic_load_n(&pool->hdr->large_bins[i].size, __ATOMIC_RELAXED);
+		p_offset = __atomic_load_n(&pool->hdr->large_bins[i].header_offset, __ATOMIC_RELAXED);
+		for(n=0; n<len && p_offset>=area_offset && p_offset<area_end; n++){
+			size = M_TAG_SIZE(__atomic_load_n(block_head(pool, p_offset), __ATOMIC_RELAXED));
+			if(size > largest && size <= area_end - p_offset)
+				largest = size;
+			p_offset = __atomic_load_n(&block_links(pool, p_offset)->next_offset, __ATOMIC_RELAXED);
+		}
+	}
+	return largest;
+}
+
+void
+mp_memory_info(M_pool *pool, M_mem_info *info){
+	uint32_t i;
+	M_slab_class *cls;
+
+	info->pool_size = pool->pool_byte_size;
+	info->free_area_size = __atomic_load_n(&pool->hdr->free_size, __ATOMIC_RELAXED);
+	info->allocated_area_size = pool->pool_byte_size - info->free_area_size;
+	info->allocated_area_free_size = 0;
+	info->slab_count = 0;
+	for(i=0; i<SLAB_CLASS_NUM; i++){
+		cls = &pool->hdr->slab_classes[i];
+		info->classes[i].obj_size = cls->obj_size;
+		info->classes[i].slab_count = __atomic_load_n(&cls->slab_count, __ATOMIC_RELAXED);
+		info->classes[i].used_count = __atomic_load_n(&cls->used_count, __ATOMIC_RELAXED);
+		info->classes[i].free_count = __atomic_load_n(&cls->free_count, __ATOMIC_RELAXED);
+		info->allocated_area_free_size += info->classes[i].free_count * cls->obj_size;
+		info->slab_count += info->classes[i].slab_count;
+	}
+	// 不加锁读取时各计数不是同一时刻的值
+	info->real_used_size = info->allocated_area_size > info->allocated_area_free_size ?
+		info->allocated_area_size - info->allocated_area_free_size : 0;
+	info->largest_free_block = largest_free_block(pool);
+	info->free_block_count = pool->hdr->free_block_count;
+	info->coalesce_count = pool->hdr->coalesce_count;
+	info->slab_release_count = pool->hdr->slab_release_count;
+}
+
+/* 获取指针相对于内存池起始地址的偏移量 */
+M_offset
+mp_ptr_offset(M_pool *pool, void *p){
+	assert(p > pool->pool_ptr_s);
+	if(p < pool->pool_ptr_s){
+		pool->log(SHMMAP_LOG_ERROR, "[ptr_offset]Pointer(%p) is less than pool_ptr_s(%p).", p, pool->pool_ptr_s);
+		return NIL_OFFSET;
+	}
+	return (char*)p - (char*)pool->pool_ptr_s;
+}
+
+/* 根据偏移量获取指针 */
+void*
+mp_get_ptr(M_pool *pool, M_offset offset){
+	void *p = (char*)pool->pool_ptr_s + offset;
+    assert(p > pool->pool_ptr_s);
+    assert(p < pool->pool_ptr_e);
+	if(p<pool->pool_ptr_s || p>pool->pool_ptr_e){
+		pool->log(SHMMAP_LOG_ERROR, "[get_ptr]Offset(%" PRIu64 ") must be larger than 0 and less than pool_byte_size(%" PRIu64 ")",
+			(uint64_t)offset, pool->pool_byte_size);
+		return NULL;
+	}
+	return p;
+}
+
+
+//**********************默认内存池**********************//
+bool
+m_init(char *p, uint64_t pool_byte_len, shmmap_log log, bool is_inited){
+	return mp_init(&default_pool, p, pool_byte_len, log, is_inited);
+}
+
+void*
+m_alloc(uint32_t size){
+	return mp_alloc(&default_pool, size);
+}
+
 void
 m_free(void *data_ptr){
-	_m_free(ptr_offset(data_ptr));
+	mp_free(&default_pool, data_ptr);
 }
 
 /**
@@ -261,55 +792,34 @@ m_free(void *data_ptr){
  */
 void
 set_mnode_data_by_data(void *data_ptr, void *data_content_ptr, uint32_t len){
-	M_block_hdr *block_ptr = (M_block_hdr *)get_ptr(get_mnode_by_data_ptr(data_ptr));
+	M_block_hdr *block_ptr = (M_block_hdr *)data_ptr - 1;
 	block_ptr->data_len = len;
 	memcpy(data_ptr, data_content_ptr, len);
 }
 
 uint32_t
 get_mnode_data_len_by_data(void *data_ptr) {
-    M_block_hdr *block_ptr = (M_block_hdr *)get_ptr(get_mnode_by_data_ptr(data_ptr));
+    M_block_hdr *block_ptr = (M_block_hdr *)data_ptr - 1;
     return block_ptr->data_len;
 }
 
-
-uint32_t
+uint64_t
 m_free_size(){
-	return pool_byte_size - *current_p_offset;
+	return mp_free_size(&default_pool);
 }
 
-uint32_t
+uint64_t
 m_pool_size(){
-	return pool_byte_size;
+	return mp_pool_size(&default_pool);
 }
 
 void m_free_list_info(){
-	uint32_t i;
-	for(i=0; i<free_list_len; i++){
-		if(free_list[i].size != 0){
-			m_pool_log(SHMMAP_LOG_INFO, "[%d, %d]", (i+1)<<3, free_list[i].size);
-		}
-	}
+	mp_free_list_info(&default_pool);
 }
 
-/* 所有空闲块内存的大小 */
-static uint32_t
-m_free_blck_size(){
-	uint32_t i, total = 0;
-	for(i=0; i<free_list_len; i++){
-		total += ((i+1)<<3)*(free_list + i)->size;
-	}
-	return total;
-}
-
-
 void
 m_memory_info(M_mem_info *info){
-	info->pool_size = pool_byte_size;
-	info->free_area_size = m_free_size();
-	info->allocated_area_size = pool_byte_size - info->free_area_size;
-	info->allocated_area_free_size = m_free_blck_size();
-	info->real_used_size = info->allocated_area_size - info->allocated_area_free_size;
+	mp_memory_info(&default_pool, info);
 }
 
 /* 打印空闲块列表信息 */
@@ -317,35 +827,20 @@ void
 m_free_info(){
 	uint32_t i;
 	printf("Free List INFO:\n");
-	for(i=0; i<free_list_len; i++){
-		if(free_list[i].size != 0)
-			printf("\tindex: %d, \tsize: %d\n", free_list[i].idx, free_list[i].size);
+	for(i=0; i<LARGE_BIN_NUM; i++){
+		if(default_pool.hdr->large_bins[i].size != 0)
+			printf("\tindex: %d, \tsize: %d\n", default_pool.hdr->large_bins[i].idx, default_pool.hdr->large_bins[i].size);
 	}
 }
 
-/* 获取指针相对于内存池起始地址的偏移量 */
-uint32_t
+M_offset
 ptr_offset(void *p){
-	assert(p > pool_ptr_s);
-	if(p < pool_ptr_s){
-		m_pool_log(SHMMAP_LOG_ERROR, "[ptr_offset]Pointer(%p) is less than pool_ptr_s(%p).", p, pool_ptr_s);
-		return -1;
-	}
-	return (char*)p - (char*)pool_ptr_s;
+	return mp_ptr_offset(&default_pool, p);
 }
 
-/* 根据偏移量获取指针 */
 void*
-get_ptr(uint32_t offset){
-	void *p = (char*)pool_ptr_s + offset;
-    assert(p > pool_ptr_s);
-    assert(p < pool_ptr_e);
-	if(p<pool_ptr_s || p>pool_ptr_e){
-		m_pool_log(SHMMAP_LOG_ERROR, "[get_ptr]Offset(%d) must be larger than 0 and less than pool_byte_size(%d)",
-			offset, pool_byte_size);
-		return NULL;
-	}
-	return p;
+get_ptr(M_offset offset){
+	return mp_get_ptr(&default_pool, offset);
 }
 
 void
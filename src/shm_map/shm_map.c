@@ -7,330 +7,2474 @@
  * @date 2012-04-10
  */
 
+#include <inttypes.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/vfs.h>
 
 #include "shm_map/shm_map.h"
 
-static int MAX_CAPACITY = 1 << 30;	// 桶的最大个数
-static int ENTRY_HEADER_SIZE = sizeof(H_entry);
-static int INT_SIZE = sizeof(int);
-
-static H_bulk *map_bulk_list;
-static int map_bulk_list_len;
-static int *_map_size;
-static shmmap_log shm_map_log;
-
-/* 获取hash值 */
-static int hash(int h);
-/* 根据hash值查找在map_bulk_list中的下标 */
-static int index_for(int h);
-/* 字符串的hash_code */
-static int hash_code(const char *str);
-static void* get_shm(const char *file, int size, bool* is_inited);
-
-pthread_mutex_t *g_mptr = NULL; // proc lock
-void proc_lock(){
-    if(g_mptr != NULL) {
-        int iErrno = pthread_mutex_lock(g_mptr);
-        if (iErrno != 0) {
-            if (iErrno == EOWNERDEAD) {
-                pthread_mutex_consistent(g_mptr);
-                shm_map_log(SHMMAP_LOG_INFO, "[proc_lock]iErrno=%d", iErrno);
-            }else{
-                shm_map_log(SHMMAP_LOG_ERROR, "[proc_lock]iErrno=%d", iErrno);
-            }
-        }
-    }
-}
-void proc_unlock(){
-    if (g_mptr != NULL) {
-        pthread_mutex_unlock(g_mptr);
-    }
+_Static_assert((uint64_t)SHMMAP_MAX_SLOT_LEN * SLOT_AREA_GROWTH <= UINT32_MAX, "slot area exceeds 32 bit indexes");
+
+/*
+ * 一个打开的map在本进程中的状态
+ */
+struct shm_map_handle {
+	void *base;					// 映射的起始地址，即内存池锁
+	uint64_t mapped_size;
+	pthread_mutex_t *pool_lock;	// 内存池和槽区分配的锁
+	H_file_hdr *hdr;
+	H_segment *segment_list;
+	int segment_list_len;
+	int segment_bits;
+	H_slot *slot_area;
+	uint32_t slot_area_len;
+	M_pool pool;
+	shmmap_log log;
+	H_journal *journal;			// 段的undo日志，数据文件没有日志时为NULL
+	int fd;						// 打开过程中的数据文件，打开完成后关闭
+	bool is_file;				// 数据文件是普通文件，不在共享内存中
+	uint32_t sync_interval_ms;	// 定期msync的周期，0表示没有msync线程
+	bool sync_stop;
+	pthread_t sync_thread;
+	pthread_mutex_t sync_mutex;
+	pthread_cond_t sync_cond;
+};
+
+/* map_init等不带handle的接口使用的map */
+static shm_map_t *default_map;
+
+/* 乐观读重试的次数，超过后加锁读 */
+#define OPTIMISTIC_READ_RETRIES 8
+/* 每段最少的槽数 */
+#define MIN_SEGMENT_SLOTS 16
+/* 每次put/get迁移的旧表槽数 */
+#define MIGRATE_SLOTS 8
+/* 等待其他进程初始化数据文件的次数，每次10ms */
+#define INIT_WAIT_RETRIES 100
+/* 一次put最多淘汰的key数，通常在空间足够后提前停止 */
+#define EVICT_MAX 1024
+/* 淘汰时在前几个候选中找释放后能直接容纳新value的key */
+#define EVICT_FIT_SCAN 8
+/* hugetlbfs的f_type */
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+/* 读不到透明大页大小时使用的默认值 */
+#define DEFAULT_HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+static void* get_shm(shm_map_t *map, const char *file, uint64_t size, uint32_t flags, bool* is_inited);
+static void segment_recover_locked(shm_map_t *map, H_segment *seg);
+
+/* 单调时钟的纳秒数 */
+static uint64_t
+monotonic_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
+/*
+ * 加锁，锁被占用时记录等待的次数和时间。没有竞争时只有一次trylock，
+ * 计数在取得锁后累加，监控进程不加锁读取
+ */
 static int
-hash(int h){
-	h ^= (h >> 20) ^ (h >> 12);
-	return h ^ (h >> 7) ^ (h >> 4);
+mutex_lock_counted(pthread_mutex_t *mutex, uint64_t *contended, uint64_t *wait_ns){
+	uint64_t start;
+	int 	iErrno = pthread_mutex_trylock(mutex);
+
+	if (iErrno != EBUSY) {
+		return iErrno;
+	}
+	start = monotonic_ns();
+	iErrno = pthread_mutex_lock(mutex);
+	if (iErrno == 0 || iErrno == EOWNERDEAD) {
+		__atomic_store_n(contended, *contended + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(wait_ns, *wait_ns + (monotonic_ns() - start), __ATOMIC_RELAXED);
+	}
+	return iErrno;
+}
+
+/*
+ * 内存池锁的持有者崩溃时先回滚它未完成的分配或释放，再标记锁可用。
+ * 恢复中再次崩溃时，下一个取得锁的进程仍会收到EOWNERDEAD
+ */
+static void
+pool_lock(shm_map_t *map){
+	int iErrno = mutex_lock_counted(map->pool_lock, &map->hdr->pool_lock_contended, &map->hdr->pool_lock_wait_ns);
+	if (iErrno != 0) {
+		if (iErrno == EOWNERDEAD) {
+			map->log(SHMMAP_LOG_WARN, "[pool_lock]The owner of the pool lock died, recovering the pool");
+			mp_recover(&map->pool);
+			pthread_mutex_consistent(map->pool_lock);
+		}else{
+			map->log(SHMMAP_LOG_ERROR, "[pool_lock]Lock failed. iErrno=%d, msg: %s", iErrno, strerror(iErrno));
+		}
+	}
+}
+
+static void
+pool_unlock(shm_map_t *map){
+	pthread_mutex_unlock(map->pool_lock);
+}
+
+static void
+init_robust_mutex(pthread_mutex_t *mutex){
+	pthread_mutexattr_t mattr;
+	memset(mutex, 0, sizeof(pthread_mutex_t));
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_ERRORCHECK);
+	pthread_mutex_init(mutex, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+}
+
+/*
+ * 取得段锁后把seq置为奇数。持有者崩溃时恢复段的索引后再标记锁可用，
+ * 乐观读在seq停在奇数时多次重试后加锁，由第一个加锁的读者或写者完成恢复
+ */
+static void
+segment_locked(shm_map_t *map, H_segment *seg, int iErrno){
+	if (iErrno != 0 && iErrno != EOWNERDEAD) {
+		map->log(SHMMAP_LOG_ERROR, "[segment_lock]Lock segment %d failed. iErrno=%d, msg: %s",
+					(int)(seg - map->segment_list), iErrno, strerror(iErrno));
+	}
+	// 持锁者崩溃时seq可能停在奇数，此时不再加1
+	if ((__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) & 1U) == 0) {
+		__atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELAXED);
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (iErrno == EOWNERDEAD) {
+		map->log(SHMMAP_LOG_WARN, "[segment_lock]The owner of segment %d died, recovering the segment",
+					(int)(seg - map->segment_list));
+		segment_recover_locked(map, seg);
+		pthread_mutex_consistent(&seg->lock);
+	}
+}
+
+static void
+segment_lock(shm_map_t *map, H_segment *seg){
+	segment_locked(map, seg, mutex_lock_counted(&seg->lock, &seg->lock_contended, &seg->lock_wait_ns));
+}
+
+/* 段锁空闲时加锁，返回是否加锁成功 */
+static bool
+segment_trylock(shm_map_t *map, H_segment *seg){
+	int iErrno = pthread_mutex_trylock(&seg->lock);
+	if (iErrno != 0 && iErrno != EOWNERDEAD) {
+		return false;
+	}
+	segment_locked(map, seg, iErrno);
+	return true;
+}
+
+static void
+segment_unlock(H_segment *seg){
+	__atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&seg->lock);
+}
+
+/* wyhash的常数 */
+static const uint64_t WYHASH_SECRET[4] = {
+	0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+/* 64位乘法，*a、*b分别置为128位积的低64位和高64位 */
+static inline void
+wymum(uint64_t *a, uint64_t *b){
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), lo, c = t < rl;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t
+wymix(uint64_t a, uint64_t b){
+	wymum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t
+wyr8(const uint8_t *p){
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+wyr4(const uint8_t *p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * key的64位hash，wyhash final4(Wang Yi，public domain)。按8字节一次处理，
+ * 长key每轮处理48字节。按本机字节序读取，数据文件不跨字节序使用
+ */
+uint64_t
+shm_map_hash(const void *key, uint32_t k_len){
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t seed = wymix(WYHASH_SECRET[0], WYHASH_SECRET[1]), see1, see2, a, b;
+	size_t 	i = k_len;
+
+	if(k_len <= 16){
+		if(k_len >= 4){
+			a = (wyr4(p) << 32) | wyr4(p + ((k_len >> 3) << 2));
+			b = (wyr4(p + k_len - 4) << 32) | wyr4(p + k_len - 4 - ((k_len >> 3) << 2));
+		}else if(k_len > 0){
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[k_len >> 1] << 8) | p[k_len - 1];
+			b = 0;
+		}else{
+			a = b = 0;
+		}
+	}else{
+		if(i > 48){
+			see1 = see2 = seed;
+			do{
+				seed = wymix(wyr8(p) ^ WYHASH_SECRET[1], wyr8(p + 8) ^ seed);
+				see1 = wymix(wyr8(p + 16) ^ WYHASH_SECRET[2], wyr8(p + 24) ^ see1);
+				see2 = wymix(wyr8(p + 32) ^ WYHASH_SECRET[3], wyr8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			}while(i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while(i > 16){
+			seed = wymix(wyr8(p) ^ WYHASH_SECRET[1], wyr8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = wyr8(p + i - 16);
+		b = wyr8(p + i - 8);
+	}
+	a ^= WYHASH_SECRET[1];
+	b ^= seed;
+	wymum(&a, &b);
+	return wymix(a ^ WYHASH_SECRET[0] ^ k_len, b ^ WYHASH_SECRET[1]);
+}
+
+/*
+ * hash的低32位存在槽中，选择段内的起始槽；高位选择段，两者互不相关
+ */
+static H_segment*
+segment_for(shm_map_t *map, uint64_t h){
+	if(map->segment_bits == 0)
+		return map->segment_list;
+	return map->segment_list + (h >> (64 - map->segment_bits));
+}
+
+static H_slot*
+segment_slots(shm_map_t *map, const H_segment *seg){
+	return map->slot_area + seg->slot_offset;
+}
+
+/* key的前缀，不足KEY_PREFIX_LEN时补0 */
+static void
+key_prefix(const char *k, uint32_t k_len, char prefix[KEY_PREFIX_LEN]){
+	memset(prefix, 0, KEY_PREFIX_LEN);
+	memcpy(prefix, k, k_len < KEY_PREFIX_LEN ? k_len : KEY_PREFIX_LEN);
+}
+
+/* 节点是否已过期。*now为0时先取当前时间，同一次操作只取一次 */
+static bool
+entry_expired(const H_entry *entry, uint32_t *now){
+	uint32_t expire = __atomic_load_n(&entry->expire, __ATOMIC_RELAXED);
+	if(expire == 0)
+		return false;
+	if(*now == 0)
+		*now = (uint32_t)time(NULL);
+	return expire <= *now;
+}
+
+/* ttl对应的过期时间 */
+static uint32_t
+expire_at(uint32_t ttl){
+	return ttl == 0 ? 0 : (uint32_t)time(NULL) + ttl;
+}
+
+/* 路径含目录时是普通文件，否则是POSIX共享内存的名字 */
+static bool
+path_is_file(const char *path){
+	return path[0] != 0 && strchr(path + 1, '/') != NULL;
 }
 
 static int
-hash_code(const char *str){
-	int h = 0;
-	const char *p = str;
-	while(*p != 0){
-		h = 31*h + (int)*p ++;
+data_file_open(const char *path, int flags, mode_t mode){
+	return path_is_file(path) ? open(path, flags, mode) : shm_open(path, flags, mode);
+}
+
+/* 本次系统启动的id，读不到时为0 */
+static uint64_t
+current_boot_id(){
+	char 	buf[64];
+	ssize_t n, i;
+	uint64_t h = 14695981039346656037ULL;
+	int 	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+
+	if(fd == -1)
+		return 0;
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+	if(n <= 0)
+		return 0;
+	for(i=0; i<n; i++){
+		h ^= (unsigned char)buf[i];
+		h *= 1099511628211ULL;
 	}
 	return h;
 }
 
-static int
-index_for(int h){
-	return h & (map_bulk_list_len - 1);
+/* 文件在hugetlbfs上时返回大页的字节数，否则返回0 */
+static size_t
+hugetlb_page_size(int fd){
+	struct statfs sfs;
+	if(fstatfs(fd, &sfs) == -1 || (unsigned long)sfs.f_type != HUGETLBFS_MAGIC)
+		return 0;
+	return (size_t)sfs.f_bsize;
+}
+
+/* 透明大页的字节数 */
+static size_t
+thp_page_size(){
+	unsigned long size = 0;
+	FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if(f != NULL){
+		if(fscanf(f, "%lu", &size) != 1)
+			size = 0;
+		fclose(f);
+	}
+	return size != 0 ? (size_t)size : DEFAULT_HUGEPAGE_SIZE;
+}
+
+/*
+ * 映射数据文件。align不为0时映射地址按align对齐：先保留多出align的地址空间，
+ * 在其中对齐的位置映射文件，再释放首尾多余的部分
+ */
+static void*
+map_data_file(int fd, size_t size, int flags, size_t align){
+	char 	*reserved, *p;
+	size_t 	head;
+
+	if(align == 0)
+		return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | flags, fd, 0);
+	reserved = (char *)mmap(NULL, size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(reserved == MAP_FAILED)
+		return MAP_FAILED;
+	head = (align - (uintptr_t)reserved % align) % align;
+	p = (char *)mmap(reserved + head, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | flags, fd, 0);
+	if(p == MAP_FAILED){
+		munmap(reserved, size + align);
+		return MAP_FAILED;
+	}
+	if(head > 0)
+		munmap(reserved, head);
+	munmap(p + size, align - head);
+	return p;
+}
+
+/*
+ * 按选项调整映射区：透明大页、预先缺页和锁定。失败时只记录日志，映射仍然可用
+ */
+static void
+advise_mapping(shm_map_t *map, const char *shm_file_name, bool use_thp, uint32_t flags){
+	if(use_thp && madvise(map->base, (size_t)map->mapped_size, MADV_HUGEPAGE) != 0){
+		map->log(SHMMAP_LOG_WARN, "[get_shm]madvise(MADV_HUGEPAGE) failed. msg: %s, path: %s",
+					strerror(errno), shm_file_name);
+	}
+#ifdef MADV_POPULATE_WRITE
+	// MAP_POPULATE对共享映射只做读缺页，第一次写还会缺页，内核支持时再按写预先缺页
+	if((flags & SHMMAP_OPT_POPULATE) != 0)
+		madvise(map->base, (size_t)map->mapped_size, MADV_POPULATE_WRITE);
+#endif
+	if((flags & SHMMAP_OPT_MLOCK) != 0 && mlock(map->base, (size_t)map->mapped_size) != 0){
+		map->log(SHMMAP_LOG_WARN, "[get_shm]mlock %" PRIu64 " bytes failed. msg: %s, path: %s",
+					map->mapped_size, strerror(errno), shm_file_name);
+	}
 }
 
 /*
  * 获取共享内存
  * file: 用于mmap的文件
- * size: 申请共享内存的大小
+ * size: 新建文件时的大小，已有的文件按文件的实际大小映射。在hugetlbfs上时按大页取整
+ * flags: SHMMAP_OPT_*
  */
 static void*
-get_shm(const char *shm_file_name, int size, bool* is_inited){
+get_shm(shm_map_t *map, const char *shm_file_name, uint64_t size, uint32_t flags, bool* is_inited){
 	int fd;
 	void *idx_ptr;
+	struct stat st;
+	size_t huge_size, align = 0;
     bool need_init = false;
-	fd = shm_open(shm_file_name, O_RDWR | O_CREAT | O_EXCL, 0777);
+    if (size > (uint64_t)SIZE_MAX) {
+        map->log(SHMMAP_LOG_ERROR, "[get_shm]The size %" PRIu64 " can't be mapped on this platform, path: %s",
+                    size, shm_file_name);
+        return NULL;
+    }
+	map->is_file = path_is_file(shm_file_name);
+	fd = data_file_open(shm_file_name, O_RDWR | O_CREAT | O_EXCL, 0777);
     if (fd != -1) {
+        // hugetlbfs上的文件大小必须是大页的整数倍
+        huge_size = hugetlb_page_size(fd);
+        if (huge_size != 0) {
+            size = (size + huge_size - 1) / huge_size * huge_size;
+        }
         /* Set the memory object's size */
-        if (ftruncate(fd, size) == -1) {
-            shm_map_log(SHMMAP_LOG_ERROR, "[get_shm]ftruncate file error. msg: %s, path: %s",
+        if (ftruncate(fd, (off_t)size) == -1) {
+            map->log(SHMMAP_LOG_ERROR, "[get_shm]ftruncate file error. msg: %s, path: %s",
                         strerror(errno), shm_file_name);
+            close(fd);
             return NULL;
         }
         need_init = true;
     } else if (errno != EEXIST) {
-        shm_map_log(SHMMAP_LOG_ERROR, "[get_shm]shm_open file error. msg: %s, path: %s",
+        map->log(SHMMAP_LOG_ERROR, "[get_shm]shm_open file error. msg: %s, path: %s",
                     strerror(errno), shm_file_name);
         return NULL;
     } else {
-        shm_map_log(SHMMAP_LOG_INFO, "[get_shm] shm_open: %s\n", strerror(errno));
-        fd = shm_open(shm_file_name, O_RDWR, 0777);
+        map->log(SHMMAP_LOG_INFO, "[get_shm] shm_open: %s\n", strerror(errno));
+        fd = data_file_open(shm_file_name, O_RDWR, 0777);
         if (fd == -1) {
-            shm_map_log(SHMMAP_LOG_ERROR, "[get_shm]Open data file error. msg: %s, path: %s",
+            map->log(SHMMAP_LOG_ERROR, "[get_shm]Open data file error. msg: %s, path: %s",
                         strerror(errno), shm_file_name);
             return NULL;
         }
+        if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(pthread_mutex_t) + sizeof(H_file_hdr)) {
+            map->log(SHMMAP_LOG_ERROR, "[get_shm]Data file is truncated, path: %s", shm_file_name);
+            close(fd);
+            return NULL;
+        }
+        size = (uint64_t)st.st_size;
     }
 
-	idx_ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    huge_size = hugetlb_page_size(fd);
+    if (huge_size == 0 && (flags & SHMMAP_OPT_HUGEPAGE) != 0) {
+        align = thp_page_size();
+    }
+	idx_ptr = map_data_file(fd, (size_t)size, (flags & SHMMAP_OPT_POPULATE) != 0 ? MAP_POPULATE : 0, align);
     if (idx_ptr == MAP_FAILED) {
-        shm_map_log(SHMMAP_LOG_ERROR, "[get_shm]mmap failed. msg: %s, path: %s",
+        map->log(SHMMAP_LOG_ERROR, "[get_shm]mmap failed. msg: %s, path: %s",
                     strerror(errno), shm_file_name);
+        close(fd);
         return NULL;
     }
-    g_mptr = idx_ptr;
+    // 打开完成前保留fd，用于重启后恢复时加文件锁
+    map->fd = fd;
+    map->base = idx_ptr;
+    map->mapped_size = size;
+    advise_mapping(map, shm_file_name, align != 0, flags);
+    map->pool_lock = idx_ptr;
     idx_ptr = (char*)idx_ptr + sizeof(pthread_mutex_t);
     if(need_init){
-        memset(g_mptr, 0, sizeof(pthread_mutex_t));
-        pthread_mutexattr_t mattr;
-        pthread_mutexattr_init(&mattr);
-        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
-        pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
-        pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_ERRORCHECK);
-        pthread_mutex_init(g_mptr, &mattr);
-        pthread_mutexattr_destroy(&mattr);
+        init_robust_mutex(map->pool_lock);
     }
     *is_inited = !need_init;
 	return idx_ptr;
 }
 
-static H_entry*
-next_entry(H_entry *entry){
-	if(entry != NULL && entry->next_offset != NIL)
-		return (H_entry *)get_ptr(entry->next_offset);
-	return NULL;
+/*
+ * 检查已有数据文件的头部。创建文件的进程最后写magic，还没写时稍等
+ */
+static bool
+check_file_hdr(shm_map_t *map, const char *dat_file_path, uint64_t mapped_size){
+	struct timespec wait = {0, 10 * 1000 * 1000};
+	int i;
+
+	for(i=0; i<INIT_WAIT_RETRIES && __atomic_load_n(&map->hdr->magic, __ATOMIC_ACQUIRE) == 0; i++)
+		nanosleep(&wait, NULL);
+	if(__atomic_load_n(&map->hdr->magic, __ATOMIC_ACQUIRE) != SHMMAP_MAGIC){
+		map->log(SHMMAP_LOG_ERROR, "[shm_map_open]%s is not a version %d data file, import it with map_import_v1",
+					dat_file_path, SHMMAP_VERSION);
+		return false;
+	}
+	if(map->hdr->version != SHMMAP_VERSION || map->hdr->offset_bits != SHMMAP_OFFSET_BITS){
+		map->log(SHMMAP_LOG_ERROR, "[shm_map_open]%s has version %u with %u bit offsets, expect version %d with %d bit offsets",
+					dat_file_path, map->hdr->version, map->hdr->offset_bits, SHMMAP_VERSION, SHMMAP_OFFSET_BITS);
+		return false;
+	}
+	if(map->hdr->segment_list_len == 0 || map->hdr->segment_list_len > MAX_LOCK_STRIPES
+		|| (map->hdr->journal_len != 0 && map->hdr->journal_len != MAX_LOCK_STRIPES)
+		|| sizeof(pthread_mutex_t) + sizeof(H_file_hdr) + sizeof(H_segment) * MAX_LOCK_STRIPES
+			+ sizeof(H_journal) * (uint64_t)map->hdr->journal_len
+			+ sizeof(H_slot) * (uint64_t)map->hdr->slot_area_len + map->hdr->mem_size > mapped_size){
+		map->log(SHMMAP_LOG_ERROR, "[shm_map_open]The header of %s doesn't match the file size %" PRIu64,
+					dat_file_path, mapped_size);
+		return false;
+	}
+	return true;
 }
 
-bool
-map_init(int capacity, int mem_size, const char *dat_file_path, shmmap_log log){
+/*
+ * 乐观读时索引可能正在被修改，只接受落在内存池内的偏移量
+ */
+static bool
+offset_valid(shm_map_t *map, M_offset offset, uint32_t len){
+	return offset >= sizeof(M_block_hdr) && offset < mp_pool_size(&map->pool) && len <= mp_pool_size(&map->pool) - offset;
+}
+
+/*
+ * 系统重启后第一次打开普通文件：锁中记录的持有者已经不存在，重新初始化所有锁，
+ * 回滚重启前未提交的写入。调用者持有文件锁，还没有其他进程使用这些锁
+ */
+static void
+map_recover_after_reboot(shm_map_t *map, uint64_t boot_id){
 	int 	i;
-	void 	*p, *mem;
-	bool 	is_inited;
-	int		*int_ptr;
+	H_segment *seg;
+
+	init_robust_mutex(map->pool_lock);
+	mp_recover(&map->pool);
+	for(i=0; i<MAX_LOCK_STRIPES; i++){
+		seg = map->segment_list + i;
+		init_robust_mutex(&seg->lock);
+		if((seg->seq & 1U) != 0)
+			seg->seq++;
+	}
+	for(i=0; i<map->segment_list_len; i++)
+		segment_recover_locked(map, map->segment_list + i);
+	map->hdr->boot_id = boot_id;
+	map->log(SHMMAP_LOG_INFO, "[shm_map_open]Locks are reinitialized after reboot");
+}
+
+static void*
+sync_loop(void *arg){
+	shm_map_t *map = (shm_map_t *)arg;
+	struct timespec deadline;
 
-	shm_map_log = log;
-	if(shm_map_log == NULL){
-		shm_map_log = default_shmmap_log;
+	pthread_mutex_lock(&map->sync_mutex);
+	while(!map->sync_stop){
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += map->sync_interval_ms / 1000;
+		deadline.tv_nsec += (long)(map->sync_interval_ms % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while(!map->sync_stop && pthread_cond_timedwait(&map->sync_cond, &map->sync_mutex, &deadline) != ETIMEDOUT);
+		if(map->sync_stop)
+			break;
+		// msync期间不持有sync_mutex，close可以及时通知退出
+		pthread_mutex_unlock(&map->sync_mutex);
+		shm_map_sync(map);
+		pthread_mutex_lock(&map->sync_mutex);
+	}
+	pthread_mutex_unlock(&map->sync_mutex);
+	return NULL;
+}
+
+/*
+ * 启动定期msync的线程。写入不等待磁盘，掉电最多丢失一个周期的写入
+ */
+static void
+map_start_sync(shm_map_t *map, const char *dat_file_path, uint32_t interval_ms){
+	pthread_condattr_t cattr;
+
+	if(!map->is_file){
+		map->log(SHMMAP_LOG_WARN, "[shm_map_open]%s is in shared memory, msync is skipped", dat_file_path);
+		return;
 	}
+	map->sync_interval_ms = interval_ms == 0 ? SHMMAP_SYNC_INTERVAL_MS : interval_ms;
+	map->sync_stop = false;
+	pthread_mutex_init(&map->sync_mutex, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&map->sync_cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+	if(pthread_create(&map->sync_thread, NULL, sync_loop, map) != 0){
+		map->log(SHMMAP_LOG_ERROR, "[shm_map_open]Can't start the msync thread");
+		pthread_cond_destroy(&map->sync_cond);
+		pthread_mutex_destroy(&map->sync_mutex);
+		map->sync_interval_ms = 0;
+	}
+}
+
+shm_map_t*
+shm_map_open(int capacity, uint64_t mem_size, const char *dat_file_path, shmmap_log log){
+	return shm_map_open_opts(capacity, mem_size, dat_file_path, log, NULL);
+}
 
+shm_map_t*
+shm_map_open_opts(int capacity, uint64_t mem_size, const char *dat_file_path, shmmap_log log,
+				  const shm_map_options *opts){
+	int 	i, slot_len, seg_slot_len;
+	void 	*p;
+	bool 	is_inited;
+	shm_map_t *map;
+	shmmap_durability durability = opts != NULL ? opts->durability : SHMMAP_DURABILITY_NONE;
+	uint32_t journal_len = durability == SHMMAP_DURABILITY_JOURNAL ? MAX_LOCK_STRIPES : 0;
+	uint64_t boot_id;
+
+	if(log == NULL){
+		log = default_shmmap_log;
+	}
 	if(capacity <= 0){
-		shm_map_log(SHMMAP_LOG_ERROR, "[map_init]The capacity of map must be greater than 0");
-		return false;
+		log(SHMMAP_LOG_ERROR, "[shm_map_open]The capacity of map must be greater than 0");
+		return NULL;
+	}
+	if(capacity > SHMMAP_MAX_CAPACITY){
+		log(SHMMAP_LOG_ERROR, "[shm_map_open]The capacity %d exceeds the maximum %d", capacity, SHMMAP_MAX_CAPACITY);
+		return NULL;
+	}
+	map = (shm_map_t *)calloc(1, sizeof(shm_map_t));
+	if(map == NULL){
+		log(SHMMAP_LOG_ERROR, "[shm_map_open]Can't allocate the map handle");
+		return NULL;
 	}
-	if(capacity > MAX_CAPACITY)
-		capacity = MAX_CAPACITY;
-	map_bulk_list_len = 1;
-	while(map_bulk_list_len < capacity)
-		map_bulk_list_len = map_bulk_list_len << 1;
+	map->log = log;
+	map->fd = -1;
+	// 负载因子不超过3/4
+	slot_len = MIN_SEGMENT_SLOTS;
+	while(slot_len < capacity + capacity / 3)
+		slot_len = slot_len << 1;
+	map->segment_list_len = slot_len / MIN_SEGMENT_SLOTS;
+	if(map->segment_list_len > MAX_LOCK_STRIPES)
+		map->segment_list_len = MAX_LOCK_STRIPES;
 
 	if(dat_file_path == NULL){
 		dat_file_path = DATA_FILE;
 	}
 	is_inited = false;
 
-	p = get_shm(dat_file_path, sizeof(pthread_mutex_t) + INT_SIZE * 5 + sizeof(H_bulk) * map_bulk_list_len + mem_size, &is_inited);
-    int_ptr = (int *)p;
+	// 槽区为扩容预留空间，未使用的部分不占用物理内存
+	map->slot_area_len = (uint32_t)slot_len * SLOT_AREA_GROWTH;
+	p = get_shm(map, dat_file_path, sizeof(pthread_mutex_t) + sizeof(H_file_hdr) + sizeof(H_segment) * MAX_LOCK_STRIPES
+			+ sizeof(H_journal) * (uint64_t)journal_len + sizeof(H_slot) * (uint64_t)map->slot_area_len + mem_size,
+			opts != NULL ? opts->flags : 0, &is_inited);
+	if(p == NULL){
+		free(map);
+		return NULL;
+	}
 	/**
-	 * 索引文件头部：
-	 * Bulk list len 	(4bytes)
-	 * padding			(4bytes)
-	 * Map size			(4bytes)
-	 * padding			(4bytes)
-	 * Bulk list		(BULK_SIZE * bulk_list_len bytes)
-	 * padding			(4bytes)
+	 * 数据文件布局：
+	 * Pool lock		(sizeof(pthread_mutex_t))
+	 * File header		(sizeof(H_file_hdr))
+	 * Segment list		(SEGMENT_SIZE * MAX_LOCK_STRIPES bytes)
+	 * Journals			(JOURNAL_SIZE * journal_len bytes，没有undo日志时为空)
+	 * Slot area		(SLOT_SIZE * slot_area_len bytes)
+	 * Memory pool		(mem_size bytes)
 	 */
+	map->hdr = (H_file_hdr *)p;
+	map->segment_list = (H_segment *)(map->hdr + 1);
 	if(is_inited){
 		// 已经有数据文件时，直接load
-		map_bulk_list_len = *int_ptr++;
-		padding(int_ptr++);
-		_map_size = int_ptr++;
-		padding(int_ptr++);
-		map_bulk_list = (H_bulk *)int_ptr;
+		if(!check_file_hdr(map, dat_file_path, map->mapped_size)){
+			shm_map_close(map);
+			return NULL;
+		}
+		map->slot_area_len = map->hdr->slot_area_len;
+		map->segment_list_len = (int)map->hdr->segment_list_len;
+		mem_size = map->hdr->mem_size;
+		journal_len = map->hdr->journal_len;
+		if(durability == SHMMAP_DURABILITY_JOURNAL && journal_len == 0)
+			map->log(SHMMAP_LOG_WARN, "[shm_map_open]%s was created without journal", dat_file_path);
 	}else{
-		*int_ptr++ = map_bulk_list_len;
-		padding(int_ptr++);
-		_map_size = int_ptr++;
-		*_map_size = 0;
-		padding(int_ptr++);
-		map_bulk_list = (H_bulk *)int_ptr;
-		// 初始化所有桶
-		for(i=0; i<map_bulk_list_len; i++){
-			(map_bulk_list+i)->header_offset = NIL;
-			(map_bulk_list+i)->tail_offset = NIL;
-			(map_bulk_list+i)->size = 0;
-		}
-	}
-	p = (char *)int_ptr + sizeof(H_bulk) * map_bulk_list_len;
-	padding(p);
-	mem = (char *)p + INT_SIZE;
-	if(!m_init((char*)mem, mem_size, log, is_inited)){
-		shm_map_log(SHMMAP_LOG_ERROR, "[map_init]Memory pool init error");
-		return false;
+		map->hdr->version = SHMMAP_VERSION;
+		map->hdr->offset_bits = SHMMAP_OFFSET_BITS;
+		map->hdr->segment_list_len = (uint32_t)map->segment_list_len;
+		map->hdr->slot_area_len = map->slot_area_len;
+		map->hdr->slot_area_used = (uint32_t)slot_len;
+		map->hdr->evict_policy = SHMMAP_EVICT_NONE;
+		map->hdr->mem_size = mem_size;
+		map->hdr->durability = (uint32_t)durability;
+		map->hdr->journal_len = journal_len;
+		map->hdr->boot_id = current_boot_id();
+		seg_slot_len = slot_len / map->segment_list_len;
+		for(i=0; i<MAX_LOCK_STRIPES; i++){
+			init_robust_mutex(&(map->segment_list+i)->lock);
+			(map->segment_list+i)->seq = 0;
+			(map->segment_list+i)->size = 0;
+			(map->segment_list+i)->slot_len = seg_slot_len;
+			(map->segment_list+i)->slot_offset = i * seg_slot_len;
+			(map->segment_list+i)->old_slot_len = 0;
+			(map->segment_list+i)->old_slot_offset = 0;
+			(map->segment_list+i)->migrate_pos = 0;
+			(map->segment_list+i)->clock_hand = 0;
+		}
 	}
-	return true;
+	// 新文件的undo日志内容为0，即没有进行中的写入
+	map->journal = journal_len != 0 ? (H_journal *)(map->segment_list + MAX_LOCK_STRIPES) : NULL;
+	map->slot_area = (H_slot *)((char *)(map->segment_list + MAX_LOCK_STRIPES) + sizeof(H_journal) * journal_len);
+	if(!is_inited){
+		// 所有槽置空
+		memset(map->slot_area, 0, sizeof(H_slot) * slot_len);
+	}
+	map->segment_bits = 0;
+	while((1 << map->segment_bits) < map->segment_list_len)
+		map->segment_bits++;
+	if(!mp_init(&map->pool, (char *)(map->slot_area + map->slot_area_len), mem_size, log, is_inited)){
+		map->log(SHMMAP_LOG_ERROR, "[shm_map_open]Memory pool init error");
+		shm_map_close(map);
+		return NULL;
+	}
+	if(!is_inited){
+		__atomic_store_n(&map->hdr->magic, SHMMAP_MAGIC, __ATOMIC_RELEASE);
+	}else if(map->is_file){
+		// 普通文件在重启后仍然存在，由第一个打开的进程恢复
+		boot_id = current_boot_id();
+		flock(map->fd, LOCK_EX);
+		if(boot_id != 0 && map->hdr->boot_id != boot_id)
+			map_recover_after_reboot(map, boot_id);
+		flock(map->fd, LOCK_UN);
+	}
+	close(map->fd);
+	map->fd = -1;
+	if(durability != SHMMAP_DURABILITY_NONE)
+		map_start_sync(map, dat_file_path, opts->sync_interval_ms);
+	return map;
 }
 
 void
-map_put(const char *k, const char *v, uint32_t v_len){
-    proc_lock();
-	H_entry *t, *entry;
-	char 	*key_ptr, *val_ptr, *old_val = NULL;
-	int 	k_len, entry_offset;
-	int 	h = hash(hash_code(k));
-	H_bulk 	*hdr = &map_bulk_list[index_for(h)];
-
-	// 先查找是否存在该key对应的entry节点
-	if(hdr->size != 0){
-		t = (H_entry *)get_ptr(hdr->header_offset);
-		while(t != NULL){
-			key_ptr = (char *)get_ptr(t->key_offset);
-			if(t->hash == h && strcmp(key_ptr, k) == 0)
-				break;
-			t = next_entry(t);
-		}
-		// 找到该key对应的节点，直接替换value
-		if(t != NULL){
-			old_val = (char *)get_ptr(t->value_offset);
-			val_ptr = (char*)m_alloc(v_len);
-			set_mnode_data_by_data(val_ptr, (void *)v, v_len);
-			t->value_offset = ptr_offset(val_ptr);
-			m_free(old_val);
-            proc_unlock();
-            return;
-		}
-	}
-	// 直接在tail处添加节点
-	entry = (H_entry *)m_alloc(ENTRY_HEADER_SIZE);
-	if(entry == NULL){
-		shm_map_log(SHMMAP_LOG_ERROR, "[map_put]Can't allocate memory for entry");
-        proc_unlock();
-        return;
-	}
-	entry_offset = ptr_offset(entry);
-	// init entry node
-	entry->hash = h;
-	k_len = strlen(k) + 1;
-	key_ptr = (char *)m_alloc(k_len);
-	val_ptr = (char *)m_alloc(v_len);
-    if(key_ptr == NULL || val_ptr == NULL){
-        shm_map_log(SHMMAP_LOG_ERROR, "[map_put]Can't allocate memory for key or val");
-        proc_unlock();
-        return;
-    }
-	set_mnode_data_by_data((void *)key_ptr, (void *)k, k_len);
-	set_mnode_data_by_data((void *)val_ptr, (void *)v, v_len);
-	entry->key_offset = ptr_offset(key_ptr);
-	entry->value_offset = ptr_offset(val_ptr);
-	if(hdr->size == 0){
-		hdr->header_offset = hdr->tail_offset = entry_offset;
-		entry->prev_offset = NIL;
-	}else{
-		t = (H_entry *)get_ptr(hdr->tail_offset);
-		entry->prev_offset = hdr->tail_offset;
-		t->next_offset = entry_offset;
-		hdr->tail_offset = entry_offset;
+shm_map_close(shm_map_t *map){
+	if(map == NULL)
+		return;
+	if(map->sync_interval_ms != 0){
+		pthread_mutex_lock(&map->sync_mutex);
+		map->sync_stop = true;
+		pthread_cond_signal(&map->sync_cond);
+		pthread_mutex_unlock(&map->sync_mutex);
+		pthread_join(map->sync_thread, NULL);
+		pthread_cond_destroy(&map->sync_cond);
+		pthread_mutex_destroy(&map->sync_mutex);
+		shm_map_sync(map);
 	}
-	entry->next_offset = NIL;
-	hdr->size++;
-	(*_map_size)++;
-    proc_unlock();
+	munmap(map->base, (size_t)map->mapped_size);
+	if(map->fd != -1)
+		close(map->fd);
+	free(map);
 }
 
-static
-H_entry* map_get_entry(const char *k){
-	int 	h = hash(hash_code(k));
-	H_bulk 	*hdr = &map_bulk_list[index_for(h)];
-	char 	*key_ptr;
-	H_entry *t;
+bool
+shm_map_sync(shm_map_t *map){
+	if(msync(map->base, (size_t)map->mapped_size, MS_SYNC) != 0){
+		map->log(SHMMAP_LOG_ERROR, "[shm_map_sync]msync failed. msg: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
 
-	if(hdr->size == 0)
-		return NULL;
-	t = (H_entry *)get_ptr(hdr->header_offset);
+bool
+map_init(int capacity, uint64_t mem_size, const char *dat_file_path, shmmap_log log){
+	return map_init_opts(capacity, mem_size, dat_file_path, log, NULL);
+}
 
-	while(t != NULL){
-		key_ptr = (char *)get_ptr(t->key_offset);
-		if(h == t->hash && strcmp(k, key_ptr) == 0)
-			return t;
-		t = next_entry(t);
+bool
+map_init_opts(int capacity, uint64_t mem_size, const char *dat_file_path, shmmap_log log,
+			  const shm_map_options *opts){
+	shm_map_t *map = shm_map_open_opts(capacity, mem_size, dat_file_path, log, opts);
+	if(map == NULL)
+		return false;
+	// 之前map_get返回的地址可能仍在使用，旧的map不关闭
+	default_map = map;
+	// m_free_size等内存池接口访问默认map的内存池
+	m_init((char *)map->pool.pool_ptr_s, map->pool.pool_byte_size, log, true);
+	return true;
+}
+
+shm_map_t*
+map_default(){
+	return default_map;
+}
+
+/*
+ * 在一张表中探测key，返回命中的槽，未命中时返回探测停止处的空槽(表满时为NULL)
+ */
+static H_slot*
+table_probe(shm_map_t *map, H_slot *slots, uint32_t slot_len, uint64_t h, const char *k, uint32_t k_len,
+			const char prefix[KEY_PREFIX_LEN], bool *found){
+	uint32_t mask = slot_len - 1;
+	uint32_t i, n;
+	H_entry *entry;
+
+	*found = false;
+	for(n=0, i=h & mask; n<slot_len; n++, i=(i+1) & mask){
+		H_slot *slot = slots + i;
+		if(slot->entry_offset == 0)
+			return slot;
+		if(slot->hash != (uint32_t)h || memcmp(slot->key_prefix, prefix, KEY_PREFIX_LEN) != 0)
+			continue;
+		entry = (H_entry *)mp_get_ptr(&map->pool, slot->entry_offset);
+		if(entry->hash == h && entry->key_len == k_len && memcmp(entry->key, k, k_len) == 0){
+			*found = true;
+			return slot;
+		}
 	}
 	return NULL;
 }
 
-int
-map_size(){
-	return *_map_size;
+/*
+ * 把旧表的槽放入新表。槽已在新表中(迁移中崩溃过)时不重复放入。
+ */
+static void
+table_insert_slot(H_slot *slots, uint32_t slot_len, const H_slot *from){
+	uint32_t mask = slot_len - 1;
+	uint32_t i, n;
+
+	for(n=0, i=from->hash & mask; n<slot_len; n++, i=(i+1) & mask){
+		H_slot *slot = slots + i;
+		if(slot->entry_offset == from->entry_offset)
+			return;
+		if(slot->entry_offset == 0){
+			slot->hash = from->hash;
+			slot->accessed = from->accessed;
+			memcpy(slot->key_prefix, from->key_prefix, KEY_PREFIX_LEN);
+			__atomic_store_n(&slot->entry_offset, from->entry_offset, __ATOMIC_RELEASE);
+			return;
+		}
+	}
 }
 
-char*
-map_get(const char *k, uint32_t* v_len){
-    proc_lock();
-	H_entry *t = map_get_entry(k);
-	if(t == NULL){
-        proc_unlock();
-        *v_len = 0;
-        return NULL;
-    }
-    proc_unlock();
-    void* val_ptr = get_ptr(t->value_offset);
-    *v_len = get_mnode_data_len_by_data(val_ptr);
-	return (char*)val_ptr;
+/*
+ * 在段中探测key，先查新表再查迁移中的旧表。
+ * 命中时返回所在的槽，否则返回新表中可插入的空槽(表满时为NULL)。调用者持有段锁。
+ */
+static H_slot*
+segment_probe_locked(shm_map_t *map, H_segment *seg, uint64_t h, const char *k, uint32_t k_len, bool *found){
+	char 	prefix[KEY_PREFIX_LEN];
+	H_slot 	*slot, *old_slot;
+
+	key_prefix(k, k_len, prefix);
+	slot = table_probe(map, segment_slots(map, seg), seg->slot_len, h, k, k_len, prefix, found);
+	if(!*found && seg->old_slot_len != 0){
+		old_slot = table_probe(map, map->slot_area + seg->old_slot_offset, seg->old_slot_len, h, k, k_len, prefix, found);
+		if(*found)
+			return old_slot;
+	}
+	return slot;
 }
 
-bool
-map_contains(const char *k){
-    proc_lock();
-	H_entry *t = map_get_entry(k);
-    proc_unlock();
-	return t != NULL;
+/*
+ * 迁移旧表中最多n个槽，全部迁移后释放旧表。调用者持有段锁。
+ */
+static void
+segment_migrate_locked(shm_map_t *map, H_segment *seg, uint32_t n){
+	H_slot *old_slots;
+
+	if(seg->old_slot_len == 0)
+		return;
+	old_slots = map->slot_area + seg->old_slot_offset;
+	while(n-- > 0 && seg->migrate_pos < seg->old_slot_len){
+		if(old_slots[seg->migrate_pos].entry_offset != 0)
+			table_insert_slot(segment_slots(map, seg), seg->slot_len, old_slots + seg->migrate_pos);
+		seg->migrate_pos++;
+	}
+	if(seg->migrate_pos == seg->old_slot_len){
+		seg->old_slot_len = 0;
+		seg->old_slot_offset = 0;
+		seg->migrate_pos = 0;
+	}
 }
 
-void
-map_iter(key_iter it){
-    proc_lock();
-	int i;
-	H_bulk *hdr;
-	H_entry *t;
-	char *k, *v;
-
-	for(i=0; i<map_bulk_list_len; i++){
-		hdr = map_bulk_list + i;
-		if(hdr->size != 0){
-			for(t=(H_entry *)get_ptr(hdr->header_offset); t!=NULL; t=next_entry(t)){
-				k = (char *)get_ptr(t->key_offset);
-				v = (char *)get_ptr(t->value_offset);
-				it(k, v);
-			}
+/*
+ * 为段分配两倍大小的新表并开始迁移。槽区用尽时返回false，段保持原大小。
+ * 字段的写入顺序保证任意时刻崩溃后段仍是可用的：先记录旧表，再切换新表。
+ */
+static bool
+segment_grow_locked(shm_map_t *map, H_segment *seg){
+	uint32_t new_len = seg->slot_len * 2;
+	uint32_t new_offset;
+
+	pool_lock(map);
+	if((uint64_t)map->hdr->slot_area_used + new_len > map->slot_area_len){
+		pool_unlock(map);
+		return false;
+	}
+	new_offset = map->hdr->slot_area_used;
+	map->hdr->slot_area_used += new_len;
+	pool_unlock(map);
+
+	memset(map->slot_area + new_offset, 0, sizeof(H_slot) * new_len);
+	seg->migrate_pos = 0;
+	seg->old_slot_offset = seg->slot_offset;
+	seg->old_slot_len = seg->slot_len;
+	seg->slot_offset = new_offset;
+	seg->slot_len = new_len;
+	map->log(SHMMAP_LOG_INFO, "[segment_grow]Segment %d grows to %u slots, size: %u",
+				(int)(seg - map->segment_list), new_len, seg->size);
+	return true;
+}
+
+/* 表是否在槽区内。乐观读和恢复时段的字段可能不可信 */
+static bool
+table_in_area(shm_map_t *map, uint32_t slot_offset, uint32_t slot_len){
+	return slot_len != 0 && (slot_len & (slot_len - 1)) == 0 && slot_offset <= map->slot_area_len
+		&& slot_len <= map->slot_area_len - slot_offset;
+}
+
+static int
+offset_cmp(const void *a, const void *b){
+	M_offset x = *(const M_offset *)a, y = *(const M_offset *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+ * 按槽指向的entry重建段的索引：去掉无效和重复的槽，结束迁移，重新计算size。
+ * 节点本身只在段锁外回收，所以槽指向的entry都还有效。调用者持有段锁
+ */
+static void
+segment_rebuild_locked(shm_map_t *map, H_segment *seg){
+	uint32_t n = 0, kept = 0, old_size = seg->size, i;
+	bool 	has_old = seg->old_slot_len != 0 && table_in_area(map, seg->old_slot_offset, seg->old_slot_len);
+	M_offset *offsets;
+	H_slot 	*tables[2], slot;
+	uint32_t lens[2];
+	H_entry *entry;
+	int 	t;
+
+	if(!table_in_area(map, seg->slot_offset, seg->slot_len)){
+		map->log(SHMMAP_LOG_ERROR, "[segment_rebuild]Segment %d has an invalid table", (int)(seg - map->segment_list));
+		return;
+	}
+	tables[0] = segment_slots(map, seg);
+	lens[0] = seg->slot_len;
+	tables[1] = has_old ? map->slot_area + seg->old_slot_offset : NULL;
+	lens[1] = has_old ? seg->old_slot_len : 0;
+	offsets = (M_offset *)malloc(sizeof(M_offset) * ((size_t)lens[0] + lens[1]));
+	if(offsets == NULL){
+		map->log(SHMMAP_LOG_ERROR, "[segment_rebuild]Can't allocate %u offsets", lens[0] + lens[1]);
+		return;
+	}
+	for(t=0; t<2; t++){
+		for(i=0; i<lens[t]; i++){
+			M_offset offset = tables[t][i].entry_offset;
+			if(offset == 0 || !offset_valid(map, offset, sizeof(H_entry)))
+				continue;
+			entry = (H_entry *)mp_get_ptr(&map->pool, offset);
+			if(offset_valid(map, offset, sizeof(H_entry) + entry->key_len + 1) && segment_for(map, entry->hash) == seg
+				&& offset_valid(map, entry->value_offset, sizeof(H_value)))
+				offsets[n++] = offset;
 		}
 	}
-    proc_unlock();
+	qsort(offsets, n, sizeof(M_offset), offset_cmp);
+	memset(tables[0], 0, sizeof(H_slot) * lens[0]);
+	seg->old_slot_len = 0;
+	seg->old_slot_offset = 0;
+	seg->migrate_pos = 0;
+	for(i=0; i<n && kept + 1 < lens[0]; i++){
+		if(i > 0 && offsets[i] == offsets[i - 1])
+			continue;
+		entry = (H_entry *)mp_get_ptr(&map->pool, offsets[i]);
+		slot.entry_offset = offsets[i];
+		slot.hash = (uint32_t)entry->hash;
+		slot.accessed = 1;
+		key_prefix(entry->key, entry->key_len, slot.key_prefix);
+		table_insert_slot(tables[0], lens[0], &slot);
+		kept++;
+	}
+	free(offsets);
+	seg->size = kept;
+	map->log(SHMMAP_LOG_WARN, "[segment_rebuild]Segment %d is rebuilt, size: %u -> %u",
+				(int)(seg - map->segment_list), old_size, kept);
+}
+
+/*
+ * undo日志中的一条记录，按8字节对齐
+ */
+typedef struct journal_rec {
+	uint64_t offset;	// 相对映射起始地址
+	uint32_t len;
+	uint32_t checksum;	// 事务号、offset、len和原内容的校验
+	char old[];
+} Journal_rec;
+
+/* state中已用字节数的标记：记录放不下，恢复时重建段的索引 */
+#define JOURNAL_REBUILD 0x80000000U
+#define FNV_OFFSET_BASIS 2166136261U
+
+/* FNV-1a */
+static uint32_t
+journal_checksum(uint32_t h, const void *p, uint32_t len){
+	const unsigned char *c = (const unsigned char *)p;
+	while(len-- > 0){
+		h ^= *c++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static uint32_t
+journal_rec_checksum(uint32_t txn, const Journal_rec *rec){
+	uint32_t h = journal_checksum(FNV_OFFSET_BASIS, &txn, sizeof(txn));
+	h = journal_checksum(h, &rec->offset, sizeof(rec->offset));
+	h = journal_checksum(h, &rec->len, sizeof(rec->len));
+	return journal_checksum(h, rec->old, rec->len);
+}
+
+static uint32_t
+journal_rec_len(uint32_t len){
+	return (uint32_t)(sizeof(Journal_rec) + len + 7) & ~7U;
+}
+
+static H_journal*
+segment_journal(shm_map_t *map, const H_segment *seg){
+	return map->journal == NULL ? NULL : map->journal + (seg - map->segment_list);
+}
+
+/* 编译器屏障保证state先于之后对段的修改写入 */
+static void
+journal_set_state(H_journal *journal, uint64_t state){
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	__atomic_store_n(&journal->state, state, __ATOMIC_RELEASE);
+	journal->checksum = journal_checksum(FNV_OFFSET_BASIS, &state, sizeof(state));
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * 修改p处的len个字节前记录原内容，先写记录再更新state。
+ * 放不下时标记恢复时重建段的索引。调用者持有段锁
+ */
+static void
+journal_save(shm_map_t *map, H_segment *seg, const void *p, uint32_t len){
+	H_journal *journal = segment_journal(map, seg);
+	Journal_rec *rec;
+	uint64_t state;
+	uint32_t used;
+
+	if(journal == NULL)
+		return;
+	state = journal->state;
+	used = (uint32_t)state;
+	if((used & JOURNAL_REBUILD) != 0)
+		return;
+	if(used + journal_rec_len(len) > JOURNAL_SIZE){
+		journal_set_state(journal, state | JOURNAL_REBUILD);
+		return;
+	}
+	rec = (Journal_rec *)(journal->data + used);
+	rec->offset = (uint64_t)((const char *)p - (const char *)map->base);
+	rec->len = len;
+	memcpy(rec->old, p, len);
+	rec->checksum = journal_rec_checksum((uint32_t)(state >> 32), rec);
+	journal_set_state(journal, state + journal_rec_len(len));
+}
+
+/* 提交段上的写入：事务号加1，之前的记录全部失效。调用者持有段锁 */
+static void
+journal_commit(shm_map_t *map, H_segment *seg){
+	H_journal *journal = segment_journal(map, seg);
+	if(journal != NULL && (uint32_t)journal->state != 0)
+		journal_set_state(journal, ((journal->state >> 32) + 1) << 32);
+}
+
+/*
+ * 回滚段上未提交的写入。state的校验不对时(崩溃在更新state和校验之间)，
+ * 按记录自身的校验找出本事务的记录。调用者持有段锁
+ */
+static void
+journal_recover_locked(shm_map_t *map, H_segment *seg){
+	H_journal *journal = segment_journal(map, seg);
+	Journal_rec *recs[JOURNAL_SIZE / sizeof(Journal_rec)];
+	Journal_rec *rec;
+	uint64_t state;
+	uint32_t txn, used, pos, n = 0;
+	bool 	rebuild;
+
+	if(journal == NULL)
+		return;
+	state = journal->state;
+	txn = (uint32_t)(state >> 32);
+	used = (uint32_t)state & ~JOURNAL_REBUILD;
+	rebuild = ((uint32_t)state & JOURNAL_REBUILD) != 0;
+	if(journal->checksum != journal_checksum(FNV_OFFSET_BASIS, &state, sizeof(state))){
+		used = JOURNAL_SIZE;
+		rebuild = false;
+	}
+	if(used > JOURNAL_SIZE)
+		used = JOURNAL_SIZE;
+	for(pos=0; pos + sizeof(Journal_rec) <= used; pos += journal_rec_len(rec->len)){
+		rec = (Journal_rec *)(journal->data + pos);
+		if(rec->len > used - pos - sizeof(Journal_rec) || rec->offset > map->mapped_size
+			|| rec->len > map->mapped_size - rec->offset || rec->checksum != journal_rec_checksum(txn, rec))
+			break;
+		recs[n++] = rec;
+	}
+	if(rebuild){
+		segment_rebuild_locked(map, seg);
+	}else if(n > 0){
+		while(n > 0){
+			rec = recs[--n];
+			memcpy((char *)map->base + rec->offset, rec->old, rec->len);
+		}
+		map->log(SHMMAP_LOG_WARN, "[journal_recover]Segment %d is rolled back", (int)(seg - map->segment_list));
+	}
+	journal_set_state(journal, ((uint64_t)txn + 1) << 32);
+}
+
+/*
+ * 校验段的索引：槽指向的entry有效且属于本段，槽中的hash和前缀与entry一致，
+ * 从起始位置探测到所在的槽之间没有空槽和重复的entry，有效槽数等于size。
+ * 调用者持有段锁，段不在迁移中
+ */
+static bool
+segment_check_locked(shm_map_t *map, H_segment *seg){
+	H_slot 	*slots, *slot;
+	H_entry *entry;
+	uint32_t mask, i, j, n = 0;
+	char 	prefix[KEY_PREFIX_LEN];
+
+	if(!table_in_area(map, seg->slot_offset, seg->slot_len))
+		return false;
+	slots = segment_slots(map, seg);
+	mask = seg->slot_len - 1;
+	for(i=0; i<seg->slot_len; i++){
+		slot = slots + i;
+		if(slot->entry_offset == 0)
+			continue;
+		if(!offset_valid(map, slot->entry_offset, sizeof(H_entry)))
+			return false;
+		entry = (H_entry *)mp_get_ptr(&map->pool, slot->entry_offset);
+		if(!offset_valid(map, slot->entry_offset, sizeof(H_entry) + entry->key_len + 1) || (uint32_t)entry->hash != slot->hash
+			|| segment_for(map, entry->hash) != seg || !offset_valid(map, entry->value_offset, sizeof(H_value)))
+			return false;
+		key_prefix(entry->key, entry->key_len, prefix);
+		if(memcmp(prefix, slot->key_prefix, KEY_PREFIX_LEN) != 0)
+			return false;
+		for(j=slot->hash & mask; j!=i; j=(j+1) & mask){
+			if(slots[j].entry_offset == 0 || slots[j].entry_offset == slot->entry_offset)
+				return false;
+		}
+		n++;
+	}
+	return n == seg->size;
+}
+
+/*
+ * 段锁的持有者崩溃后恢复段：回滚未提交的写入，完成迁移，
+ * 校验不通过时(没有undo日志或日志放不下)按槽指向的entry重建。调用者持有段锁
+ */
+static void
+segment_recover_locked(shm_map_t *map, H_segment *seg){
+	journal_recover_locked(map, seg);
+	if(seg->old_slot_len != 0 && table_in_area(map, seg->old_slot_offset, seg->old_slot_len)
+		&& seg->migrate_pos <= seg->old_slot_len)
+		segment_migrate_locked(map, seg, seg->old_slot_len);
+	if(seg->old_slot_len != 0 || !segment_check_locked(map, seg))
+		segment_rebuild_locked(map, seg);
+}
+
+/*
+ * 申请value块，引用计数为1(由entry持有)。调用者持有内存池锁
+ */
+static H_value*
+value_alloc_locked(shm_map_t *map, uint32_t v_len){
+	// 没有空间时由调用者淘汰后重试或记录日志
+	H_value *value = (H_value *)mp_try_alloc(&map->pool, sizeof(H_value) + v_len);
+	if(value == NULL)
+		return NULL;
+	value->refcnt = 1;
+	value->len = v_len;
+	return value;
+}
+
+/*
+ * 释放value的一个引用，最后一个引用释放时回收内存
+ */
+static void
+value_release(shm_map_t *map, M_offset value_offset){
+	H_value *value = (H_value *)mp_get_ptr(&map->pool, value_offset);
+	if(__atomic_sub_fetch(&value->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+		pool_lock(map);
+		mp_free(&map->pool, value);
+		pool_unlock(map);
+	}
+}
+
+static H_entry*
+entry_alloc_locked(shm_map_t *map, uint32_t k_len){
+	return (H_entry *)mp_try_alloc(&map->pool, sizeof(H_entry) + k_len + 1);
+}
+
+/*
+ * 已有key的value长度不变且没有被pin住时，可以直接覆盖，不用申请新的value。
+ * pin在段锁内增加引用，调用者持有段锁时引用计数不会增加
+ */
+static H_value*
+value_overwritable(shm_map_t *map, const H_slot *slot, uint32_t v_len){
+	H_entry *entry = (H_entry *)mp_get_ptr(&map->pool, slot->entry_offset);
+	H_value *value = (H_value *)mp_get_ptr(&map->pool, entry->value_offset);
+	// 覆盖写了一半无法回滚，有undo日志时总是换新的value
+	if(map->journal == NULL && value->len == v_len && __atomic_load_n(&value->refcnt, __ATOMIC_ACQUIRE) == 1)
+		return value;
+	return NULL;
+}
+
+/*
+ * 为新key保证段中有空槽，负载超过3/4时扩容，迁移期间不再扩容。
+ * 保留一个空槽，保证探测总能结束。调用者持有段锁
+ */
+static bool
+segment_reserve_locked(shm_map_t *map, H_segment *seg){
+	if(seg->old_slot_len == 0 && (seg->size + 1) * 4 > seg->slot_len * 3 && segment_grow_locked(map, seg))
+		segment_migrate_locked(map, seg, MIGRATE_SLOTS);
+	return seg->size + 1 < seg->slot_len;
+}
+
+/*
+ * 删除表中pos处的槽，之后探测链上起始位置不在(空位, 当前位置]之间的槽前移填补空位，
+ * 删除后不留墓碑，探测仍在第一个空槽处结束
+ */
+static void
+table_delete_slot(shm_map_t *map, H_segment *seg, H_slot *slots, uint32_t slot_len, uint32_t pos){
+	uint32_t mask = slot_len - 1;
+	uint32_t i = pos, j = pos, home;
+
+	for(;;){
+		j = (j + 1) & mask;
+		if(slots[j].entry_offset == 0)
+			break;
+		home = slots[j].hash & mask;
+		if(((j - home) & mask) >= ((j - i) & mask)){
+			journal_save(map, seg, slots + i, sizeof(H_slot));
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	journal_save(map, seg, slots + i, sizeof(H_slot));
+	__atomic_store_n(&slots[i].entry_offset, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * 删除段新表中的槽并回收节点，value在没有pin时回收。
+ * 调用者持有段锁，段不在迁移中
+ */
+static void
+segment_remove_locked(shm_map_t *map, H_segment *seg, H_slot *slot){
+	H_entry *entry = (H_entry *)mp_get_ptr(&map->pool, slot->entry_offset);
+	H_value *value = (H_value *)mp_get_ptr(&map->pool, entry->value_offset);
+
+	journal_save(map, seg, &seg->size, sizeof(seg->size));
+	table_delete_slot(map, seg, segment_slots(map, seg), seg->slot_len, (uint32_t)(slot - segment_slots(map, seg)));
+	seg->size--;
+	// 提交后再回收，回滚时槽指向的节点仍然有效
+	journal_commit(map, seg);
+	pool_lock(map);
+	mp_free(&map->pool, entry);
+	if(__atomic_sub_fetch(&value->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		mp_free(&map->pool, value);
+	pool_unlock(map);
+}
+
+/* key的value没有被pin住，且释放后能直接容纳len字节的value */
+static bool
+entry_value_fits(shm_map_t *map, const H_entry *entry, uint32_t len){
+	H_value *value = (H_value *)mp_get_ptr(&map->pool, entry->value_offset);
+	return __atomic_load_n(&value->refcnt, __ATOMIC_ACQUIRE) == 1
+		&& mp_block_fits(value, sizeof(H_value) + len);
+}
+
+/*
+ * 按CLOCK算法淘汰段中的一个key：过期的key直接淘汰，访问位为1的清零后跳过，
+ * 最多转两圈。fit_len不为0时，在前EVICT_FIT_SCAN个候选中优先淘汰value释放后
+ * 能容纳fit_len字节的key，都不能容纳时淘汰第一个候选。
+ * 返回是否淘汰了key。调用者持有段锁，不持有内存池锁
+ */
+static bool
+segment_evict_locked(shm_map_t *map, H_segment *seg, uint32_t fit_len){
+	H_slot 	*slots;
+	H_entry *entry;
+	uint32_t mask, n, i, victim = 0, candidates = 0, now = 0;
+
+	// 删除会移动槽，先完成迁移
+	segment_migrate_locked(map, seg, seg->old_slot_len);
+	slots = segment_slots(map, seg);
+	mask = seg->slot_len - 1;
+	for(n=0; n<2*seg->slot_len && seg->size>0 && candidates<EVICT_FIT_SCAN; n++){
+		i = seg->clock_hand++ & mask;
+		if(slots[i].entry_offset == 0)
+			continue;
+		entry = (H_entry *)mp_get_ptr(&map->pool, slots[i].entry_offset);
+		if(!entry_expired(entry, &now) && __atomic_load_n(&slots[i].accessed, __ATOMIC_RELAXED)){
+			__atomic_store_n(&slots[i].accessed, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		if(fit_len == 0 || entry_value_fits(map, entry, fit_len)){
+			victim = i;
+			candidates = 1;
+			break;
+		}
+		if(candidates++ == 0)
+			victim = i;
+	}
+	if(candidates == 0)
+		return false;
+	segment_remove_locked(map, seg, slots + victim);
+	// 后面的槽可能前移到了victim，下次从victim开始检查
+	seg->clock_hand = victim;
+	__atomic_store_n(&seg->evictions, seg->evictions + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/*
+ * 从第n个段淘汰一个key，n依次增加时从本段和其他段轮流淘汰，避免只淘汰本段。
+ * 调用者持有seg的锁，其他段只尝试加锁，不会死锁
+ */
+static bool
+map_evict_for_pool(shm_map_t *map, H_segment *seg, uint32_t n, uint32_t fit_len){
+	H_segment *victim = map->segment_list + ((seg - map->segment_list) + n) % map->segment_list_len;
+	bool 	evicted;
+
+	if(victim == seg)
+		return segment_evict_locked(map, seg, fit_len);
+	if(!segment_trylock(map, victim))
+		return false;
+	evicted = segment_evict_locked(map, victim, fit_len);
+	segment_unlock(victim);
+	return evicted;
+}
+
+/*
+ * 内存池满时淘汰key，直到v_len字节的value和新key的entry(new_key时)都能申请到。
+ * 至少淘汰一个key，*evicted累计本次put淘汰的key数，达到EVICT_MAX或所有段都
+ * 没有可淘汰的key时返回false。调用者持有seg的锁，不持有内存池锁
+ */
+static bool
+map_evict_until_fit(shm_map_t *map, H_segment *seg, uint32_t k_len, uint32_t v_len, bool new_key, int *evicted){
+	uint32_t n;
+	int 	misses = 0;
+	bool 	fits = false;
+
+	for(n=0; !fits; n++){
+		if(*evicted >= EVICT_MAX || misses >= map->segment_list_len)
+			return false;
+		if(!map_evict_for_pool(map, seg, n, v_len)){
+			misses++;
+			continue;
+		}
+		misses = 0;
+		(*evicted)++;
+		pool_lock(map);
+		fits = mp_can_alloc(&map->pool, sizeof(H_value) + v_len)
+			&& (!new_key || mp_can_alloc(&map->pool, sizeof(H_entry) + k_len + 1));
+		pool_unlock(map);
+	}
+	return true;
+}
+
+/*
+ * 在段中写入key，value和新key的entry由调用者预先申请。
+ * 新key用掉entry时把*entry置为NULL；被替换的value没有其他引用时通过*garbage返回，
+ * 由调用者回收。写入失败时value仍属于调用者。调用者持有段锁，不持有内存池锁
+ */
+static bool
+segment_put_locked(shm_map_t *map, H_segment *seg, uint64_t h, const char *k, uint32_t k_len,
+				   H_value *value, uint32_t expire, H_entry **entry, M_offset *garbage){
+	H_entry *e;
+	H_slot 	*slot;
+	H_value *old_value;
+	M_offset old_value_offset;
+	bool 	found;
+
+	*garbage = NIL_OFFSET;
+	slot = segment_probe_locked(map, seg, h, k, k_len, &found);
+	// 找到该key对应的节点，直接替换value
+	if(found){
+		e = (H_entry *)mp_get_ptr(&map->pool, slot->entry_offset);
+		old_value_offset = e->value_offset;
+		old_value = (H_value *)mp_get_ptr(&map->pool, old_value_offset);
+		// expire和value_offset相邻，一条记录
+		journal_save(map, seg, &e->expire, (uint32_t)((char *)(&e->value_offset + 1) - (char *)&e->expire));
+		journal_save(map, seg, &old_value->refcnt, sizeof(old_value->refcnt));
+		__atomic_store_n(&e->expire, expire, __ATOMIC_RELAXED);
+		__atomic_store_n(&e->value_offset, mp_ptr_offset(&map->pool, value), __ATOMIC_RELEASE);
+		__atomic_store_n(&slot->accessed, 1, __ATOMIC_RELAXED);
+		// 旧value可能仍被读者pin住，由最后一个引用回收
+		if(__atomic_sub_fetch(&old_value->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+			*garbage = old_value_offset;
+		journal_commit(map, seg);
+		return true;
+	}
+	if(*entry == NULL)
+		return false;
+	if(!segment_reserve_locked(map, seg) || (slot = segment_probe_locked(map, seg, h, k, k_len, &found)) == NULL){
+		map->log(SHMMAP_LOG_ERROR, "[map_put]The segment of key hash %#" PRIx64 " is full, size: %u", h, seg->size);
+		return false;
+	}
+	// init entry node
+	e = *entry;
+	e->hash = h;
+	e->key_len = k_len;
+	e->expire = expire;
+	memcpy(e->key, k, k_len);
+	e->key[k_len] = 0;
+	e->value_offset = mp_ptr_offset(&map->pool, value);
+	// 新的entry在提交前不可达，只需要记录槽和size
+	journal_save(map, seg, slot, sizeof(H_slot));
+	journal_save(map, seg, &seg->size, sizeof(seg->size));
+	// 先写完槽的内容，最后写entry_offset使槽生效
+	slot->hash = (uint32_t)h;
+	slot->accessed = 1;
+	key_prefix(k, k_len, slot->key_prefix);
+	__atomic_store_n(&slot->entry_offset, mp_ptr_offset(&map->pool, e), __ATOMIC_RELEASE);
+	seg->size++;
+	journal_commit(map, seg);
+	*entry = NULL;
+	return true;
+}
+
+/*
+ * 写入key，返回是否成功。段满时按淘汰策略淘汰同一段中的key后重试，
+ * 内存池满时淘汰到value和entry能申请到为止，最多淘汰EVICT_MAX个key
+ */
+static bool
+map_put_expire(shm_map_t *map, const char *k, uint32_t k_len, const char *v, uint32_t v_len, uint32_t expire){
+	H_entry *entry = NULL;
+	H_value *value = NULL;
+	H_slot 	*slot;
+	M_offset garbage = NIL_OFFSET;
+	uint64_t h = shm_map_hash(k, k_len);
+	H_segment *seg = segment_for(map, h);
+	bool 	found, ok = false;
+	bool 	evict = __atomic_load_n(&map->hdr->evict_policy, __ATOMIC_RELAXED) == SHMMAP_EVICT_CLOCK;
+	int 	evicted = 0;
+
+	// 锁顺序：先段锁，后内存池锁
+	segment_lock(map, seg);
+	segment_migrate_locked(map, seg, MIGRATE_SLOTS);
+	for(;;){
+		slot = segment_probe_locked(map, seg, h, k, k_len, &found);
+		if(found && (value = value_overwritable(map, slot, v_len)) != NULL){
+			memcpy(value->data, v, v_len);
+			__atomic_store_n(&((H_entry *)mp_get_ptr(&map->pool, slot->entry_offset))->expire, expire, __ATOMIC_RELAXED);
+			__atomic_store_n(&slot->accessed, 1, __ATOMIC_RELAXED);
+			value = NULL;
+			ok = true;
+			break;
+		}
+		if(!found && !segment_reserve_locked(map, seg)){
+			if(evict && evicted < EVICT_MAX && segment_evict_locked(map, seg, 0)){
+				evicted++;
+				continue;
+			}
+			map->log(SHMMAP_LOG_ERROR, "[map_put]The segment of key hash %#" PRIx64 " is full, size: %u", h, seg->size);
+			break;
+		}
+		pool_lock(map);
+		value = value_alloc_locked(map, v_len);
+		if(!found)
+			entry = entry_alloc_locked(map, k_len);
+		if(value == NULL || (!found && entry == NULL)){
+			if(value != NULL) mp_free(&map->pool, value);
+			if(entry != NULL) mp_free(&map->pool, entry);
+			value = NULL;
+			entry = NULL;
+			pool_unlock(map);
+			if(evict && map_evict_until_fit(map, seg, k_len, v_len, !found, &evicted))
+				continue;
+			map->log(SHMMAP_LOG_ERROR, "[map_put]Can't allocate memory for a %u bytes value of key hash %#" PRIx64
+					 ", %d keys evicted", v_len, h, evicted);
+			break;
+		}
+		pool_unlock(map);
+		memcpy(value->data, v, v_len);
+		if(segment_put_locked(map, seg, h, k, k_len, value, expire, &entry, &garbage)){
+			value = NULL;
+			ok = true;
+		}
+		break;
+	}
+	segment_unlock(seg);
+	if(value != NULL || entry != NULL || garbage != NIL_OFFSET){
+		pool_lock(map);
+		if(value != NULL) mp_free(&map->pool, value);
+		if(entry != NULL) mp_free(&map->pool, entry);
+		if(garbage != NIL_OFFSET) mp_free(&map->pool, mp_get_ptr(&map->pool, garbage));
+		pool_unlock(map);
+	}
+	if(!ok)
+		__atomic_add_fetch(&map->hdr->put_failures, 1, __ATOMIC_RELAXED);
+	return ok;
+}
+
+bool
+shm_map_put(shm_map_t *map, const void *key, uint32_t k_len, const char *v, uint32_t v_len){
+	return map_put_expire(map, (const char *)key, k_len, v, v_len, 0);
+}
+
+bool
+shm_map_put_ttl(shm_map_t *map, const void *key, uint32_t k_len, const char *v, uint32_t v_len, uint32_t ttl){
+	return map_put_expire(map, (const char *)key, k_len, v, v_len, expire_at(ttl));
+}
+
+bool
+shm_map_remove(shm_map_t *map, const void *key, uint32_t k_len){
+	const char *k = (const char *)key;
+	uint64_t h = shm_map_hash(k, k_len);
+	H_segment *seg = segment_for(map, h);
+	H_slot 	*slot;
+	uint32_t now = 0;
+	bool 	found;
+
+	segment_lock(map, seg);
+	// 删除会移动槽，先完成迁移
+	segment_migrate_locked(map, seg, seg->old_slot_len);
+	slot = segment_probe_locked(map, seg, h, k, k_len, &found);
+	if(found){
+		// 过期的key同样回收，但对调用者来说已经不存在
+		found = !entry_expired((H_entry *)mp_get_ptr(&map->pool, slot->entry_offset), &now);
+		segment_remove_locked(map, seg, slot);
+	}
+	segment_unlock(seg);
+	return found;
+}
+
+int
+shm_map_remove_expired(shm_map_t *map){
+	int 	s, removed = 0;
+	uint32_t i, now = 0;
+	H_segment *seg;
+	H_slot 	*slots;
+
+	for(s=0; s<map->segment_list_len; s++){
+		seg = map->segment_list + s;
+		segment_lock(map, seg);
+		segment_migrate_locked(map, seg, seg->old_slot_len);
+		slots = segment_slots(map, seg);
+		for(i=0; i<seg->slot_len; ){
+			if(slots[i].entry_offset != 0 && entry_expired((H_entry *)mp_get_ptr(&map->pool, slots[i].entry_offset), &now)){
+				// 后面的槽可能前移到i，重新检查i
+				segment_remove_locked(map, seg, slots + i);
+				removed++;
+				continue;
+			}
+			i++;
+		}
+		segment_unlock(seg);
+	}
+	return removed;
+}
+
+void
+shm_map_set_evict_policy(shm_map_t *map, shmmap_evict_policy policy){
+	__atomic_store_n(&map->hdr->evict_policy, (uint32_t)policy, __ATOMIC_RELAXED);
+}
+
+/*
+ * 不加锁在一张表中查找key，返回value的偏移量，过期的key视为不存在。
+ * 开启淘汰时设置槽的访问位
+ */
+static M_offset
+table_find_optimistic(shm_map_t *map, uint32_t slot_offset, uint32_t slot_len, uint64_t h, const char *k, uint32_t k_len,
+					  const char prefix[KEY_PREFIX_LEN]){
+	uint32_t mask = slot_len - 1;
+	uint32_t i, n, now = 0;
+	H_slot 	slot;
+	const H_entry *entry;
+
+	// 读到的段字段可能是半写的，先确认表在槽区内
+	if(!table_in_area(map, slot_offset, slot_len))
+		return NIL_OFFSET;
+	for(n=0, i=h & mask; n<slot_len; n++, i=(i+1) & mask){
+		memcpy(&slot, map->slot_area + slot_offset + i, sizeof(slot));
+		if(slot.entry_offset == 0)
+			return NIL_OFFSET;
+		if(slot.hash != (uint32_t)h || memcmp(slot.key_prefix, prefix, KEY_PREFIX_LEN) != 0)
+			continue;
+		if(!offset_valid(map, slot.entry_offset, sizeof(H_entry) + k_len))
+			return NIL_OFFSET;
+		entry = (const H_entry *)mp_get_ptr(&map->pool, slot.entry_offset);
+		if(entry->hash != h || entry->key_len != k_len || memcmp(entry->key, k, k_len) != 0)
+			continue;
+		if(entry_expired(entry, &now))
+			return NIL_OFFSET;
+		if(slot.accessed == 0 && __atomic_load_n(&map->hdr->evict_policy, __ATOMIC_RELAXED) != SHMMAP_EVICT_NONE)
+			__atomic_store_n(&map->slot_area[slot_offset + i].accessed, 1, __ATOMIC_RELAXED);
+		return __atomic_load_n(&entry->value_offset, __ATOMIC_ACQUIRE);
+	}
+	return NIL_OFFSET;
+}
+
+/*
+ * 不加锁查找key，返回value的偏移量。索引可能同时被修改，
+ * 所有偏移量都先校验，结果由调用者通过seq确认。
+ */
+static M_offset
+segment_find_optimistic(shm_map_t *map, H_segment *seg, uint64_t h, const char *k, uint32_t k_len){
+	char 	prefix[KEY_PREFIX_LEN];
+	uint32_t old_slot_len;
+	M_offset value_offset;
+
+	key_prefix(k, k_len, prefix);
+	value_offset = table_find_optimistic(map, __atomic_load_n(&seg->slot_offset, __ATOMIC_RELAXED),
+										 __atomic_load_n(&seg->slot_len, __ATOMIC_RELAXED), h, k, k_len, prefix);
+	old_slot_len = __atomic_load_n(&seg->old_slot_len, __ATOMIC_RELAXED);
+	if(value_offset == NIL_OFFSET && old_slot_len != 0){
+		value_offset = table_find_optimistic(map, __atomic_load_n(&seg->old_slot_offset, __ATOMIC_RELAXED),
+											 old_slot_len, h, k, k_len, prefix);
+	}
+	return value_offset;
+}
+
+/*
+ * 加锁查找到的槽对应value的偏移量，没有找到或已过期时返回NIL
+ */
+static M_offset
+slot_value_locked(shm_map_t *map, const H_slot *slot, bool found, uint32_t *now){
+	H_entry *entry;
+
+	if(!found)
+		return NIL_OFFSET;
+	entry = (H_entry *)mp_get_ptr(&map->pool, slot->entry_offset);
+	return entry_expired(entry, now) ? NIL_OFFSET : entry->value_offset;
+}
+
+/*
+ * 查找key对应value的偏移量，先按seq乐观读，多次冲突后加段锁
+ */
+static M_offset
+map_find_value(shm_map_t *map, const char *k, uint32_t k_len){
+	uint64_t h = shm_map_hash(k, k_len);
+	H_segment *seg = segment_for(map, h);
+	uint32_t seq, now = 0;
+	int 	i;
+	M_offset value_offset;
+	H_slot 	*slot;
+	bool 	found;
+
+	for(i=0; i<OPTIMISTIC_READ_RETRIES; i++){
+		seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		if((seq & 1U) != 0)
+			continue;
+		value_offset = segment_find_optimistic(map, seg, h, k, k_len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == seq){
+			// 段在迁移中且没有写者时，顺便迁移一批槽
+			if(__atomic_load_n(&seg->old_slot_len, __ATOMIC_RELAXED) != 0 && segment_trylock(map, seg)){
+				segment_migrate_locked(map, seg, MIGRATE_SLOTS);
+				segment_unlock(seg);
+			}
+			return value_offset;
+		}
+	}
+	segment_lock(map, seg);
+	segment_migrate_locked(map, seg, MIGRATE_SLOTS);
+	slot = segment_probe_locked(map, seg, h, k, k_len, &found);
+	value_offset = slot_value_locked(map, slot, found, &now);
+	segment_unlock(seg);
+	return value_offset;
+}
+
+/*
+ * 各段size之和。不单独维护总数，回滚段上的写入后总数仍然正确
+ */
+int
+shm_map_size(shm_map_t *map){
+	int 	i, size = 0;
+	for(i=0; i<map->segment_list_len; i++)
+		size += (int)__atomic_load_n(&map->segment_list[i].size, __ATOMIC_RELAXED);
+	return size;
+}
+
+char*
+shm_map_get(shm_map_t *map, const void *k, uint32_t k_len, uint32_t *v_len){
+	H_value *value;
+	M_offset value_offset = map_find_value(map, (const char *)k, k_len);
+	if(value_offset == NIL_OFFSET){
+		*v_len = 0;
+		return NULL;
+	}
+	value = (H_value *)mp_get_ptr(&map->pool, value_offset);
+	*v_len = value->len;
+	return value->data;
+}
+
+bool
+shm_map_contains(shm_map_t *map, const void *k, uint32_t k_len){
+	return map_find_value(map, (const char *)k, k_len) != NIL_OFFSET;
+}
+
+/* 批量操作每次分组处理的项数，分组用的数组在栈上 */
+#define BATCH_CHUNK 256
+/* 已直接覆盖的项 */
+#define NIL_IDX 0xFFFFFFFFu
+
+/*
+ * 批量操作中的一项，按段分组后处理
+ */
+typedef struct batch_item {
+	uint64_t h;
+	uint32_t idx;			// 在kvs中的下标
+	bool 	found;
+	bool 	failed;			// put时内存池或段满，开启淘汰时单独重试
+	H_value *value;
+	H_entry *entry;
+	M_offset value_offset;	// get时为查到的value，put时为要回收的旧value
+} Batch_item;
+
+/*
+ * 计算每项的hash，按段稳定排序。第g个段的项为items[group[g], group[g+1])
+ */
+static void
+batch_group(shm_map_t *map, const shm_map_kv *kvs, uint32_t n, Batch_item items[BATCH_CHUNK],
+			uint32_t group[MAX_LOCK_STRIPES + 1]){
+	uint64_t hashes[BATCH_CHUNK];
+	uint32_t pos[MAX_LOCK_STRIPES], i, g;
+	uint8_t seg_idx[BATCH_CHUNK];
+
+	memset(group, 0, sizeof(uint32_t) * (MAX_LOCK_STRIPES + 1));
+	for(i=0; i<n; i++){
+		hashes[i] = shm_map_hash(kvs[i].key, kvs[i].k_len);
+		seg_idx[i] = (uint8_t)(segment_for(map, hashes[i]) - map->segment_list);
+		group[seg_idx[i] + 1]++;
+	}
+	for(g=0; g<MAX_LOCK_STRIPES; g++){
+		group[g + 1] += group[g];
+		pos[g] = group[g];
+	}
+	for(i=0; i<n; i++){
+		Batch_item *item = items + pos[seg_idx[i]]++;
+		item->h = hashes[i];
+		item->idx = i;
+		item->found = false;
+		item->failed = false;
+		item->value = NULL;
+		item->entry = NULL;
+		item->value_offset = NIL_OFFSET;
+	}
+}
+
+/*
+ * 预取各项在段新表中的起始槽，再预取起始槽指向的entry，
+ * 多个缓存缺失同时进行
+ */
+static void
+batch_prefetch(shm_map_t *map, H_segment *seg, const Batch_item *items, uint32_t n){
+	uint32_t slot_offset = __atomic_load_n(&seg->slot_offset, __ATOMIC_RELAXED);
+	uint32_t slot_len = __atomic_load_n(&seg->slot_len, __ATOMIC_RELAXED);
+	uint32_t mask = slot_len - 1;
+	uint32_t i;
+	M_offset entry_offset;
+	const H_slot *slot;
+
+	if(slot_len == 0 || slot_offset > map->slot_area_len || slot_len > map->slot_area_len - slot_offset)
+		return;
+	for(i=0; i<n; i++)
+		__builtin_prefetch(map->slot_area + slot_offset + (items[i].h & mask));
+	for(i=0; i<n; i++){
+		slot = map->slot_area + slot_offset + (items[i].h & mask);
+		entry_offset = __atomic_load_n(&slot->entry_offset, __ATOMIC_RELAXED);
+		if(entry_offset != 0 && offset_valid(map, entry_offset, sizeof(H_entry)))
+			__builtin_prefetch(mp_get_ptr(&map->pool, entry_offset));
+	}
+}
+
+/*
+ * 写入同一个段的一组key：加一次段锁，长度不变的value直接覆盖，
+ * 其余的value和新entry在一次内存池锁内申请，旧value和没用掉的内存在一次内存池锁内回收。
+ * 返回写入成功的个数。
+ * 前面有同一个key的项推迟写入时，后面的项也推迟，保证同一个key按顺序写入。
+ * 开启淘汰时，失败的项在解锁后逐个淘汰重试
+ */
+static int
+segment_put_batch(shm_map_t *map, H_segment *seg, const shm_map_kv *kvs, Batch_item *items, uint32_t n){
+	uint32_t i, j, deferred = n;	// 第一个推迟写入的项
+	uint32_t failed = 0;
+	int 	ok = 0;
+	bool 	need_free = false, alloc_failed = false, retry = false;
+	H_slot 	*slot;
+	H_value *value;
+
+	segment_lock(map, seg);
+	segment_migrate_locked(map, seg, MIGRATE_SLOTS);
+	batch_prefetch(map, seg, items, n);
+	for(i=0; i<n; i++){
+		const shm_map_kv *kv = kvs + items[i].idx;
+		slot = segment_probe_locked(map, seg, items[i].h, (const char *)kv->key, kv->k_len, &items[i].found);
+		if(items[i].found && (value = value_overwritable(map, slot, kv->v_len)) != NULL){
+			for(j=deferred; j<i && !(items[j].idx != NIL_IDX && items[j].h == items[i].h); j++);
+			if(j == i){
+				memcpy(value->data, kv->value, kv->v_len);
+				__atomic_store_n(&((H_entry *)mp_get_ptr(&map->pool, slot->entry_offset))->expire, 0, __ATOMIC_RELAXED);
+				__atomic_store_n(&slot->accessed, 1, __ATOMIC_RELAXED);
+				items[i].idx = NIL_IDX;
+				ok++;
+				continue;
+			}
+		}
+		if(deferred == n)
+			deferred = i;
+	}
+	if(deferred < n){
+		pool_lock(map);
+		for(i=deferred; i<n; i++){
+			if(items[i].idx == NIL_IDX)
+				continue;
+			items[i].value = value_alloc_locked(map, kvs[items[i].idx].v_len);
+			if(!items[i].found)
+				items[i].entry = entry_alloc_locked(map, kvs[items[i].idx].k_len);
+		}
+		pool_unlock(map);
+	}
+	for(i=deferred; i<n; i++){
+		const shm_map_kv *kv;
+		if(items[i].idx == NIL_IDX)
+			continue;
+		kv = kvs + items[i].idx;
+		// 同一批中重复的新key，第一次写入后其余的变为替换，entry会剩下
+		if(items[i].value == NULL || (!items[i].found && items[i].entry == NULL)){
+			alloc_failed = true;
+			need_free = true;
+			items[i].failed = retry = true;
+			failed++;
+			continue;
+		}
+		memcpy(items[i].value->data, kv->value, kv->v_len);
+		if(segment_put_locked(map, seg, items[i].h, (const char *)kv->key, kv->k_len, items[i].value, 0,
+							  &items[i].entry, &items[i].value_offset)){
+			items[i].value = NULL;
+			ok++;
+		}else{
+			items[i].failed = retry = true;
+			failed++;
+		}
+		need_free = need_free || items[i].value != NULL || items[i].entry != NULL || items[i].value_offset != NIL_OFFSET;
+	}
+	segment_unlock(seg);
+	retry = retry && __atomic_load_n(&map->hdr->evict_policy, __ATOMIC_RELAXED) != SHMMAP_EVICT_NONE;
+	if(alloc_failed && !retry)
+		map->log(SHMMAP_LOG_ERROR, "[map_put_batch]Can't allocate memory for entry or val");
+	// 重试时由map_put_expire计数
+	if(failed > 0 && !retry)
+		__atomic_add_fetch(&map->hdr->put_failures, failed, __ATOMIC_RELAXED);
+
+	if(need_free){
+		pool_lock(map);
+		for(i=deferred; i<n; i++){
+			if(items[i].idx == NIL_IDX)
+				continue;
+			if(items[i].value != NULL) mp_free(&map->pool, items[i].value);
+			if(items[i].entry != NULL) mp_free(&map->pool, items[i].entry);
+			if(items[i].value_offset != NIL_OFFSET) mp_free(&map->pool, mp_get_ptr(&map->pool, items[i].value_offset));
+		}
+		pool_unlock(map);
+	}
+	for(i=deferred; retry && i<n; i++){
+		const shm_map_kv *kv;
+		if(items[i].idx == NIL_IDX || !items[i].failed)
+			continue;
+		kv = kvs + items[i].idx;
+		// 后面同一个key的项已经写入时不再重试，避免旧值覆盖新值
+		for(j=i+1; j<n && !(items[j].idx != NIL_IDX && !items[j].failed && items[j].h == items[i].h
+				&& kvs[items[j].idx].k_len == kv->k_len && memcmp(kvs[items[j].idx].key, kv->key, kv->k_len) == 0); j++);
+		if(j == n && map_put_expire(map, (const char *)kv->key, kv->k_len, kv->value, kv->v_len, 0))
+			ok++;
+	}
+	return ok;
+}
+
+int
+shm_map_put_batch(shm_map_t *map, const shm_map_kv *kvs, uint32_t n){
+	Batch_item items[BATCH_CHUNK];
+	uint32_t group[MAX_LOCK_STRIPES + 1], g, chunk;
+	int 	ok = 0;
+
+	for(; n > 0; kvs += chunk, n -= chunk){
+		chunk = n < BATCH_CHUNK ? n : BATCH_CHUNK;
+		batch_group(map, kvs, chunk, items, group);
+		for(g=0; g<MAX_LOCK_STRIPES; g++){
+			if(group[g + 1] > group[g])
+				ok += segment_put_batch(map, map->segment_list + g, kvs, items + group[g], group[g + 1] - group[g]);
+		}
+	}
+	return ok;
+}
+
+/*
+ * 查找同一个段的一组key。整组在一次seq校验内乐观读，多次冲突后加一次段锁
+ */
+static void
+segment_get_batch(shm_map_t *map, H_segment *seg, const shm_map_kv *kvs, Batch_item *items, uint32_t n){
+	uint32_t seq, i, now = 0;
+	int 	retry;
+	H_slot 	*slot;
+	bool 	found;
+
+	batch_prefetch(map, seg, items, n);
+	for(retry=0; retry<OPTIMISTIC_READ_RETRIES; retry++){
+		seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		if((seq & 1U) != 0)
+			continue;
+		for(i=0; i<n; i++)
+			items[i].value_offset = segment_find_optimistic(map, seg, items[i].h, (const char *)kvs[items[i].idx].key,
+															kvs[items[i].idx].k_len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == seq){
+			if(__atomic_load_n(&seg->old_slot_len, __ATOMIC_RELAXED) != 0 && segment_trylock(map, seg)){
+				segment_migrate_locked(map, seg, MIGRATE_SLOTS);
+				segment_unlock(seg);
+			}
+			return;
+		}
+	}
+	segment_lock(map, seg);
+	segment_migrate_locked(map, seg, MIGRATE_SLOTS);
+	for(i=0; i<n; i++){
+		slot = segment_probe_locked(map, seg, items[i].h, (const char *)kvs[items[i].idx].key, kvs[items[i].idx].k_len, &found);
+		items[i].value_offset = slot_value_locked(map, slot, found, &now);
+	}
+	segment_unlock(seg);
+}
+
+int
+shm_map_get_batch(shm_map_t *map, shm_map_kv *kvs, uint32_t n){
+	Batch_item items[BATCH_CHUNK];
+	uint32_t group[MAX_LOCK_STRIPES + 1], g, i, chunk;
+	H_value *value;
+	int 	found = 0;
+
+	for(; n > 0; kvs += chunk, n -= chunk){
+		chunk = n < BATCH_CHUNK ? n : BATCH_CHUNK;
+		batch_group(map, kvs, chunk, items, group);
+		for(g=0; g<MAX_LOCK_STRIPES; g++){
+			if(group[g + 1] > group[g])
+				segment_get_batch(map, map->segment_list + g, kvs, items + group[g], group[g + 1] - group[g]);
+		}
+		for(i=0; i<chunk; i++){
+			shm_map_kv *kv = kvs + items[i].idx;
+			if(items[i].value_offset == NIL_OFFSET){
+				kv->value = NULL;
+				kv->v_len = 0;
+				continue;
+			}
+			value = (H_value *)mp_get_ptr(&map->pool, items[i].value_offset);
+			kv->value = value->data;
+			kv->v_len = value->len;
+			found++;
+		}
+	}
+	return found;
+}
+
+/*
+ * 加段锁给value增加引用，保证增加引用时value没有被回收
+ */
+M_offset
+shm_map_pin(shm_map_t *map, const void *key, uint32_t k_len, const char **v, uint32_t *v_len){
+	const char *k = (const char *)key;
+	uint64_t h = shm_map_hash(k, k_len);
+	H_segment *seg = segment_for(map, h);
+	H_slot 	*slot;
+	H_value *value;
+	M_offset value_offset;
+	uint32_t now = 0;
+	bool 	found;
+
+	segment_lock(map, seg);
+	slot = segment_probe_locked(map, seg, h, k, k_len, &found);
+	value_offset = slot_value_locked(map, slot, found, &now);
+	if(value_offset == NIL_OFFSET){
+		segment_unlock(seg);
+		*v = NULL;
+		*v_len = 0;
+		return NIL_OFFSET;
+	}
+	value = (H_value *)mp_get_ptr(&map->pool, value_offset);
+	__atomic_add_fetch(&value->refcnt, 1, __ATOMIC_RELAXED);
+	segment_unlock(seg);
+	*v = value->data;
+	*v_len = value->len;
+	return value_offset;
+}
+
+void
+shm_map_unpin(shm_map_t *map, M_offset ref){
+	if(ref != NIL_OFFSET)
+		value_release(map, ref);
+}
+
+/*
+ * 槽是否已在段的新表中，用于遍历迁移中的段时去重
+ */
+static bool
+table_contains_entry(H_slot *slots, uint32_t slot_len, const H_slot *from){
+	uint32_t mask = slot_len - 1;
+	uint32_t i, n;
+
+	for(n=0, i=from->hash & mask; n<slot_len && slots[i].entry_offset != 0; n++, i=(i+1) & mask){
+		if(slots[i].entry_offset == from->entry_offset)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * 快照中的一项，之后依次是key、0、value、0，按8字节对齐
+ */
+typedef struct snapshot_item {
+	uint32_t k_len;
+	uint32_t v_len;
+} Snapshot_item;
+
+struct shm_map_snapshot {
+	shm_map_t *map;
+	int 	next_segment;	// 下一个要复制的段
+	char 	*buf;			// 当前段的复制
+	size_t 	len;
+	size_t 	cap;
+	size_t 	pos;			// 下一项在buf中的位置
+	bool 	failed;			// 内存不足，遍历提前结束
+};
+
+static size_t
+snapshot_item_len(uint32_t k_len, uint32_t v_len){
+	return (sizeof(Snapshot_item) + (size_t)k_len + v_len + 2 + 7) & ~(size_t)7;
+}
+
+/*
+ * 把entry复制到快照，过期的entry跳过。乐观复制时entry可能已被回收，
+ * 偏移量和长度都先校验，无效时返回false由调用者重试
+ */
+static bool
+snapshot_append(shm_map_snapshot *snap, M_offset entry_offset, uint32_t *now){
+	shm_map_t 	*map = snap->map;
+	const H_entry *entry;
+	const H_value *value;
+	Snapshot_item *item;
+	M_offset 	value_offset;
+	uint32_t 	k_len, v_len;
+	size_t 		item_len, cap;
+	char 		*buf;
+
+	if(!offset_valid(map, entry_offset, sizeof(H_entry)))
+		return false;
+	entry = (const H_entry *)mp_get_ptr(&map->pool, entry_offset);
+	k_len = __atomic_load_n(&entry->key_len, __ATOMIC_RELAXED);
+	value_offset = __atomic_load_n(&entry->value_offset, __ATOMIC_ACQUIRE);
+	if(!offset_valid(map, entry_offset, sizeof(H_entry) + k_len) || !offset_valid(map, value_offset, sizeof(H_value)))
+		return false;
+	value = (const H_value *)mp_get_ptr(&map->pool, value_offset);
+	v_len = __atomic_load_n(&value->len, __ATOMIC_RELAXED);
+	if(!offset_valid(map, value_offset, sizeof(H_value) + v_len))
+		return false;
+	if(entry_expired(entry, now))
+		return true;
+	item_len = snapshot_item_len(k_len, v_len);
+	if(snap->len + item_len > snap->cap){
+		for(cap = snap->cap == 0 ? 4096 : snap->cap; cap < snap->len + item_len; cap *= 2)
+			;
+		buf = (char *)realloc(snap->buf, cap);
+		if(buf == NULL){
+			map->log(SHMMAP_LOG_ERROR, "[shm_map_snapshot]Can't allocate %zu bytes for the snapshot", cap);
+			snap->failed = true;
+			return false;
+		}
+		snap->buf = buf;
+		snap->cap = cap;
+	}
+	item = (Snapshot_item *)(snap->buf + snap->len);
+	item->k_len = k_len;
+	item->v_len = v_len;
+	buf = (char *)(item + 1);
+	memcpy(buf, entry->key, k_len);
+	buf[k_len] = '\0';
+	memcpy(buf + k_len + 1, value->data, v_len);
+	buf[k_len + 1 + v_len] = '\0';
+	snap->len += item_len;
+	return true;
+}
+
+/*
+ * 复制段中的所有key和value。seq为奇数时已持有段锁，
+ * 否则是乐观复制，完成后seq不变才有效
+ */
+static bool
+snapshot_copy_segment(shm_map_snapshot *snap, H_segment *seg, uint32_t seq){
+	shm_map_t 	*map = snap->map;
+	uint32_t 	slot_offset, slot_len, old_offset, old_len, migrate_pos, i, now = 0;
+	H_slot 		*slots, *old_slots;
+	M_offset 	entry_offset;
+
+	snap->len = 0;
+	slot_offset = __atomic_load_n(&seg->slot_offset, __ATOMIC_RELAXED);
+	slot_len = __atomic_load_n(&seg->slot_len, __ATOMIC_RELAXED);
+	old_offset = __atomic_load_n(&seg->old_slot_offset, __ATOMIC_RELAXED);
+	old_len = __atomic_load_n(&seg->old_slot_len, __ATOMIC_RELAXED);
+	migrate_pos = __atomic_load_n(&seg->migrate_pos, __ATOMIC_RELAXED);
+	if(!table_in_area(map, slot_offset, slot_len) || (old_len != 0 && !table_in_area(map, old_offset, old_len)))
+		return false;
+	slots = map->slot_area + slot_offset;
+	for(i=0; i<slot_len; i++){
+		entry_offset = __atomic_load_n(&slots[i].entry_offset, __ATOMIC_RELAXED);
+		if(entry_offset != 0 && !snapshot_append(snap, entry_offset, &now))
+			return false;
+	}
+	// 旧表中尚未迁移的节点
+	old_slots = map->slot_area + old_offset;
+	for(i=migrate_pos; old_len != 0 && i<old_len; i++){
+		entry_offset = __atomic_load_n(&old_slots[i].entry_offset, __ATOMIC_RELAXED);
+		if(entry_offset != 0 && !table_contains_entry(slots, slot_len, old_slots + i)
+			&& !snapshot_append(snap, entry_offset, &now))
+			return false;
+	}
+	if((seq & 1U) != 0)
+		return true;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/*
+ * 复制下一个非空的段，先按seq乐观复制，多次冲突后加段锁复制。
+ * 没有更多的段时返回false
+ */
+static bool
+snapshot_fill(shm_map_snapshot *snap){
+	shm_map_t 	*map = snap->map;
+	H_segment 	*seg;
+	uint32_t 	seq;
+	bool 		ok;
+	int 		i;
+
+	snap->len = 0;
+	snap->pos = 0;
+	while(snap->len == 0 && !snap->failed && snap->next_segment < map->segment_list_len){
+		seg = map->segment_list + snap->next_segment++;
+		for(i=0, ok=false; i<OPTIMISTIC_READ_RETRIES && !ok && !snap->failed; i++){
+			seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+			ok = (seq & 1U) == 0 && snapshot_copy_segment(snap, seg, seq);
+		}
+		if(!ok && !snap->failed){
+			segment_lock(map, seg);
+			ok = snapshot_copy_segment(snap, seg, seg->seq);
+			segment_unlock(seg);
+		}
+		if(!ok)
+			snap->len = 0;
+	}
+	return snap->len > 0;
+}
+
+shm_map_snapshot*
+shm_map_snapshot_open(shm_map_t *map){
+	shm_map_snapshot *snap = (shm_map_snapshot *)calloc(1, sizeof(shm_map_snapshot));
+	if(snap == NULL){
+		map->log(SHMMAP_LOG_ERROR, "[shm_map_snapshot_open]Can't allocate the snapshot");
+		return NULL;
+	}
+	snap->map = map;
+	return snap;
+}
+
+bool
+shm_map_snapshot_next(shm_map_snapshot *snap, const void **k, uint32_t *k_len, const char **v, uint32_t *v_len){
+	Snapshot_item *item;
+
+	if(snap->pos >= snap->len && !snapshot_fill(snap))
+		return false;
+	item = (Snapshot_item *)(snap->buf + snap->pos);
+	snap->pos += snapshot_item_len(item->k_len, item->v_len);
+	*k = item + 1;
+	*k_len = item->k_len;
+	*v = (const char *)(item + 1) + item->k_len + 1;
+	*v_len = item->v_len;
+	return true;
+}
+
+bool
+shm_map_snapshot_failed(const shm_map_snapshot *snap){
+	return snap->failed;
+}
+
+void
+shm_map_snapshot_close(shm_map_snapshot *snap){
+	if(snap == NULL)
+		return;
+	free(snap->buf);
+	free(snap);
+}
+
+void
+shm_map_get_stats(shm_map_t *map, shm_map_stats *stats){
+	H_segment 	*seg;
+	H_slot 		*slots;
+	uint32_t 	slot_offset, slot_len, mask, i, probe;
+	uint64_t 	probes = 0, n = 0;
+	M_offset 	entry_offset;
+	int 		s;
+
+	memset(stats, 0, sizeof(*stats));
+	for(s=0; s<map->segment_list_len; s++){
+		seg = map->segment_list + s;
+		stats->entries += __atomic_load_n(&seg->size, __ATOMIC_RELAXED);
+		stats->segment_lock_contended += __atomic_load_n(&seg->lock_contended, __ATOMIC_RELAXED);
+		stats->segment_lock_wait_ns += __atomic_load_n(&seg->lock_wait_ns, __ATOMIC_RELAXED);
+		stats->evictions += __atomic_load_n(&seg->evictions, __ATOMIC_RELAXED);
+		slot_offset = __atomic_load_n(&seg->slot_offset, __ATOMIC_RELAXED);
+		slot_len = __atomic_load_n(&seg->slot_len, __ATOMIC_RELAXED);
+		if(!table_in_area(map, slot_offset, slot_len))
+			continue;
+		stats->slots += slot_len;
+		slots = map->slot_area + slot_offset;
+		mask = slot_len - 1;
+		// 探测长度是key所在的槽到起始槽的距离加1
+		for(i=0; i<slot_len; i++){
+			entry_offset = __atomic_load_n(&slots[i].entry_offset, __ATOMIC_RELAXED);
+			if(entry_offset == 0)
+				continue;
+			probe = ((i - (__atomic_load_n(&slots[i].hash, __ATOMIC_RELAXED) & mask)) & mask) + 1;
+			probes += probe;
+			n++;
+			if(probe > stats->max_probe)
+				stats->max_probe = probe;
+		}
+	}
+	stats->load_factor = stats->slots == 0 ? 0.0 : (double)stats->entries / (double)stats->slots;
+	stats->avg_probe = n == 0 ? 0.0 : (double)probes / (double)n;
+	stats->slot_area_used = __atomic_load_n(&map->hdr->slot_area_used, __ATOMIC_RELAXED);
+	stats->slot_area_len = map->slot_area_len;
+	stats->pool_lock_contended = __atomic_load_n(&map->hdr->pool_lock_contended, __ATOMIC_RELAXED);
+	stats->pool_lock_wait_ns = __atomic_load_n(&map->hdr->pool_lock_wait_ns, __ATOMIC_RELAXED);
+	stats->put_failures = __atomic_load_n(&map->hdr->put_failures, __ATOMIC_RELAXED);
+	mp_memory_info(&map->pool, &stats->memory);
+}
+
+void
+shm_map_iter(shm_map_t *map, shm_map_iter_fn fn, void *arg){
+	shm_map_snapshot *snap = shm_map_snapshot_open(map);
+	const void 	*k;
+	const char 	*v;
+	uint32_t 	k_len, v_len;
+
+	if(snap == NULL)
+		return;
+	// 回调时不持有任何锁，回调中可以读写map
+	while(shm_map_snapshot_next(snap, &k, &k_len, &v, &v_len))
+		fn(k, k_len, v, v_len, arg);
+	shm_map_snapshot_close(snap);
+}
+
+
+/*
+ * 版本1数据文件的结构。偏移量都是相对内存池起始地址的32位数，
+ * key和value都分配在带M_block_hdr(版本1为4个uint32)的内存块中
+ */
+typedef struct legacy_entry {
+	int prev_offset;
+	int next_offset;
+	int hash;
+	int key_offset;
+	int value_offset;
+} L_entry;
+
+typedef struct legacy_bulk {
+	int header_offset;
+	int tail_offset;
+	int size;
+} L_bulk;
+
+typedef struct legacy_block_hdr {
+	uint32_t idx;
+	uint32_t prev_offset;
+	uint32_t next_offset;
+	uint32_t data_len;
+} L_block_hdr;
+
+/*
+ * 读取版本1内存池中的一个数据块，返回数据地址，偏移量越界时返回NULL
+ */
+static const char*
+legacy_block_data(const char *pool, uint64_t pool_len, int data_offset, uint32_t *len){
+	const L_block_hdr *block;
+	if(data_offset < (int)sizeof(L_block_hdr) || (uint64_t)data_offset > pool_len)
+		return NULL;
+	block = (const L_block_hdr *)(pool + data_offset - sizeof(L_block_hdr));
+	if(block->data_len > pool_len - (uint64_t)data_offset)
+		return NULL;
+	*len = block->data_len;
+	return pool + data_offset;
+}
+
+bool
+shm_map_import_v1(shm_map_t *map, const char *legacy_file_path){
+	int 	fd, i, n, bulk_len, imported = 0, skipped = 0;
+	struct stat st;
+	char 	*base;
+	const char *pool, *key, *value;
+	const int *int_ptr;
+	const L_bulk *bulks;
+	const L_entry *entry;
+	uint64_t pool_len, hdr_len;
+	uint32_t key_len, value_len;
+	int 	offset;
+
+	fd = data_file_open(legacy_file_path, O_RDONLY, 0);
+	if(fd == -1){
+		map->log(SHMMAP_LOG_ERROR, "[map_import_v1]Open data file error. msg: %s, path: %s",
+					strerror(errno), legacy_file_path);
+		return false;
+	}
+	if(fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(pthread_mutex_t) + 4 * sizeof(int)){
+		map->log(SHMMAP_LOG_ERROR, "[map_import_v1]Data file is truncated, path: %s", legacy_file_path);
+		close(fd);
+		return false;
+	}
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED){
+		map->log(SHMMAP_LOG_ERROR, "[map_import_v1]mmap failed. msg: %s, path: %s",
+					strerror(errno), legacy_file_path);
+		return false;
+	}
+	/**
+	 * 版本1的布局：
+	 * Process lock		(sizeof(pthread_mutex_t))
+	 * Bulk list len, padding, Map size, padding	(4 * 4bytes)
+	 * Bulk list		(BULK_SIZE * bulk_list_len bytes)
+	 * padding			(4bytes)
+	 * Memory pool
+	 */
+	int_ptr = (const int *)(base + sizeof(pthread_mutex_t));
+	bulk_len = int_ptr[0];
+	hdr_len = sizeof(pthread_mutex_t) + 4 * sizeof(int) + sizeof(L_bulk) * (uint64_t)bulk_len + sizeof(int);
+	if((uint32_t)bulk_len == SHMMAP_MAGIC || bulk_len <= 0 || (bulk_len & (bulk_len - 1)) != 0
+		|| hdr_len > (uint64_t)st.st_size){
+		map->log(SHMMAP_LOG_ERROR, "[map_import_v1]%s is not a version 1 data file", legacy_file_path);
+		munmap(base, (size_t)st.st_size);
+		return false;
+	}
+	bulks = (const L_bulk *)(int_ptr + 4);
+	pool = base + hdr_len;
+	pool_len = (uint64_t)st.st_size - hdr_len;
+
+	for(i=0; i<bulk_len; i++){
+		// 按桶内的节点数遍历，损坏的链不会导致死循环
+		offset = bulks[i].size > 0 ? bulks[i].header_offset : NIL;
+		for(n=0; n<bulks[i].size && offset != NIL; n++){
+			if(offset < (int)sizeof(L_block_hdr) || (uint64_t)offset + sizeof(L_entry) > pool_len){
+				skipped += bulks[i].size - n;
+				break;
+			}
+			entry = (const L_entry *)(pool + offset);
+			key = legacy_block_data(pool, pool_len, entry->key_offset, &key_len);
+			value = legacy_block_data(pool, pool_len, entry->value_offset, &value_len);
+			if(key == NULL || value == NULL){
+				skipped++;
+			}else{
+				// 版本1的key含结尾的0
+				shm_map_put(map, key, (uint32_t)strnlen(key, key_len), value, value_len);
+				imported++;
+			}
+			offset = entry->next_offset;
+		}
+	}
+	munmap(base, (size_t)st.st_size);
+	map->log(SHMMAP_LOG_INFO, "[map_import_v1]Imported %d keys from %s, skipped %d damaged entries",
+				imported, legacy_file_path, skipped);
+	return true;
+}
+
+
+//**********************默认map的接口**********************//
+bool
+map_put_bin(const void *k, uint32_t k_len, const char *v, uint32_t v_len){
+	return shm_map_put(default_map, k, k_len, v, v_len);
+}
+
+bool
+map_put(const char *k, const char *v, uint32_t v_len){
+	return shm_map_put(default_map, k, strlen(k), v, v_len);
+}
+
+bool
+map_put_ttl(const char *k, const char *v, uint32_t v_len, uint32_t ttl){
+	return shm_map_put_ttl(default_map, k, strlen(k), v, v_len, ttl);
+}
+
+bool
+map_remove_bin(const void *k, uint32_t k_len){
+	return shm_map_remove(default_map, k, k_len);
+}
+
+bool
+map_remove(const char *k){
+	return shm_map_remove(default_map, k, strlen(k));
+}
+
+char*
+map_get_bin(const void *k, uint32_t k_len, uint32_t *v_len){
+	return shm_map_get(default_map, k, k_len, v_len);
+}
+
+char*
+map_get(const char *k, uint32_t* v_len){
+	return shm_map_get(default_map, k, strlen(k), v_len);
+}
+
+bool
+map_contains_bin(const void *k, uint32_t k_len){
+	return shm_map_contains(default_map, k, k_len);
+}
+
+bool
+map_contains(const char *k){
+	return shm_map_contains(default_map, k, strlen(k));
+}
+
+int
+map_size(){
+	return shm_map_size(default_map);
+}
+
+M_offset
+map_pin_bin(const void *k, uint32_t k_len, const char **v, uint32_t *v_len){
+	return shm_map_pin(default_map, k, k_len, v, v_len);
+}
+
+void
+map_unpin(M_offset ref){
+	shm_map_unpin(default_map, ref);
+}
+
+/* 把handle接口的遍历回调转给旧接口的回调 */
+typedef struct iter_adapter {
+	key_iter it;
+	key_iter_bin it_bin;
+} Iter_adapter;
+
+static void
+iter_adapt(const void *k, uint32_t k_len, const char *v, uint32_t v_len, void *arg){
+	Iter_adapter *adapter = (Iter_adapter *)arg;
+	if(adapter->it != NULL)
+		adapter->it((const char *)k, v);
+	else
+		adapter->it_bin(k, k_len, v, v_len);
+}
+
+void
+map_iter(key_iter it){
+	Iter_adapter adapter = {it, NULL};
+	shm_map_iter(default_map, iter_adapt, &adapter);
+}
+
+void
+map_iter_bin(key_iter_bin it){
+	Iter_adapter adapter = {NULL, it};
+	shm_map_iter(default_map, iter_adapt, &adapter);
+}
+
+int
+map_put_batch(const shm_map_kv *kvs, uint32_t n){
+	return shm_map_put_batch(default_map, kvs, n);
+}
+
+void
+map_get_stats(shm_map_stats *stats){
+	shm_map_get_stats(default_map, stats);
+}
+
+int
+map_get_batch(shm_map_kv *kvs, uint32_t n){
+	return shm_map_get_batch(default_map, kvs, n);
+}
+
+bool
+map_import_v1(const char *legacy_file_path){
+	return shm_map_import_v1(default_map, legacy_file_path);
 }
@@ -7,8 +7,12 @@
 #include "client/client_tcp_iface.h"
 #include "client/tsp_client.h"
 #include "tb_log.h"
+#include "common/clock_source.h"
 #include "common/common.h"
+#include "common/frame_trace.h"
 #include "packages/packet.h"
+#include "packages/packet_helper.h"
+#include "openssl_wrapper/credential_cache.h"
 
 constexpr auto str_login_res = "/from/tsp/login_res";
 constexpr auto str_logout_res = "/from/tsp/logout_res";
@@ -16,12 +20,24 @@ constexpr auto str_heart_beat_sleep_res = "/from/tsp/heartbeat_sleep_res";
 constexpr auto str_login_pass_check_platform_res = "/to/tsp/login_pass_check_platform_res";
 constexpr auto str_logout_pass_check_platform_res = "/to/tsp/logout_pass_check_platform_res";
 
-TspProxy::TspProxy():heartbeat_sleep_timer_{[this](const boost::any& ) noexcept { heartbeat_sleep();}}{
+static std::unique_ptr<tsp_client::TspClient> make_default_tsp_client() {
     tsp_client::tls_tcp_config tcp_cfg;
     tcp_cfg.port = 8888;
     tcp_cfg.server_ip = "10.58.1.17";
     tcp_cfg.support_tls = false;
-    tsp_client_ = std::make_unique<tsp_client::TspClient>(tcp_cfg);
+    return std::make_unique<tsp_client::TspClient>(tcp_cfg);
+}
+
+TspProxy::TspProxy():TspProxy(make_default_tsp_client()){
+}
+
+TspProxy::TspProxy(const std::string& str_config_path)
+        :TspProxy(std::make_unique<tsp_client::TspClient>(str_config_path)){
+}
+
+TspProxy::TspProxy(std::unique_ptr<tsp_client::TspClient> tsp_client)
+        :heartbeat_sleep_timer_{[this](const boost::any& ) noexcept { heartbeat_sleep();}},
+         tsp_client_{std::move(tsp_client)}{
     register_local_event_topic(5, 200, str_login_res);     // 终端登录消息
     register_local_event_topic(5, 201, str_logout_res);    // 终端登出消息
     register_local_event_topic(5, 203, str_heart_beat_sleep_res);  // 终端休眠心跳消息
@@ -83,6 +99,8 @@ void TspProxy::register_event_callback(const reply_callback_t &call_back) {
             auto cyclic = std::chrono::seconds(u_heartBeatInterval_);
             common::Timer::Clock::duration timer_period{cyclic};
             TB_LOG_INFO("TspProxy::on_wake_up start timer to send heartbeat_sleep");
+            // 休眠心跳允许延后1/8周期, 与其它timer合并唤醒
+            heartbeat_sleep_timer_.set_slack(timer_period / 8);
             heartbeat_sleep_timer_.start_periodic_immediate(timer_period);
         }
     }
@@ -162,7 +180,7 @@ void TspProxy::start_to_connect(){
     int n_max_try{1}; // 最多重试1次
     while (!connected && n_max_try > 0) {
         connected = tsp_client_->connect(); // retry to connect to platform
-        std::this_thread::sleep_for(std::chrono::seconds(2));
+        common::clock().sleep_for(std::chrono::seconds(2));
         --n_max_try;
     }
 }
@@ -297,8 +315,14 @@ void TspProxy::on_message_arrive(const std::vector<uint8_t>& msg) {
     std::vector<uint8_t> de_transfer_msg_data;
     de_transfer_message(msg, de_transfer_msg_data);
 
-    std::string str = convert_to_hex_string(de_transfer_msg_data);
-    TB_LOG_INFO("TspProxy::on_message_arrive msg size:%d content:%s", de_transfer_msg_data.size(), str.c_str());
+    if (common::FrameTrace::instance().is_enabled()) {
+        // 原始frame已经由socket层记录到frame trace中
+        TB_LOG_INFO_RATE_LIMITED(10U, "TspProxy::on_message_arrive msg size:%d", de_transfer_msg_data.size());
+    } else {
+        // hex串只在限流放行时生成
+        TB_LOG_INFO_RATE_LIMITED(10U, "TspProxy::on_message_arrive msg size:%d content:%s", de_transfer_msg_data.size(),
+                                 convert_to_hex_string(de_transfer_msg_data).c_str());
+    }
     MessageHeader header;
     header.parse(de_transfer_msg_data);
 
@@ -342,7 +366,7 @@ void TspProxy::on_message_arrive(const std::vector<uint8_t>& msg) {
     std::copy(message_body.begin(), message_body.end(), std::back_inserter(raw_msg));
 
     if(reply_callback_ != nullptr) {
-        TB_LOG_INFO("TspProxy::on_message_arrive got message topic:%s size:%d", str_topic.c_str(), raw_msg.size());
+        TB_LOG_INFO_RATE_LIMITED(10U, "TspProxy::on_message_arrive got message topic:%s size:%d", str_topic.c_str(), raw_msg.size());
         reply_callback_(str_topic, raw_msg);
     }else {
         TB_LOG_ERROR("TspProxy::on_message_arrive got empty reply_callback_");
@@ -396,58 +420,19 @@ tsp_client::connect_state_t TspProxy::get_connect_state(){
  }
 
 void TspProxy::transfer_message(const std::vector<uint8_t> &message, std::vector<uint8_t> &transferred_message) {
-    transferred_message.push_back(message[0]);
-    for(size_t i = 1; i < message.size(); ++i) {
-        uint8_t uchar = message[i];
-        if(uchar == 202U || uchar == 87U || uchar == 255U || uchar == 0x3D) {
-            transferred_message.push_back(0x3D);
-            uint8_t data = uchar^0x3D;
-            transferred_message.push_back(data);
-        }else {
-            transferred_message.push_back(uchar);
-        }
-    }
+    PackHelper::escape_message(message, transferred_message);
 }
 
 void TspProxy::de_transfer_message(const std::vector<uint8_t> &message, std::vector<uint8_t> &de_transferred_message) {
-    //需要对消息除了 LinkHeader 和 LinkTail 外的部分进行转义后再进行传输
-    de_transferred_message.push_back(message[0]);
-    for(size_t i = 1; i < message.size() - 1; ++i) {
-        uint8_t uchar = message[i];
-        if(uchar != 0x3D){
-            de_transferred_message.push_back(uchar);
-        }else {
-            ++i;
-            uint8_t data = message[i];
-            data = data ^ 0x3D;
-            de_transferred_message.push_back(data);
-        }
-    }
+    PackHelper::unescape_message(message, de_transferred_message);
 }
 
 void TspProxy::transfer_message_data(const std::vector<uint8_t> &data, std::vector<uint8_t> &transferred_data) {
-    for(auto uchar: data) {
-        if(uchar == 202U || uchar == 87U || uchar == 255U || uchar == 0x3D) {
-            transferred_data.push_back(0x3D);
-            uint8_t data = uchar^0x3D;
-            transferred_data.push_back(data);
-        }else {
-            transferred_data.push_back(uchar);
-        }
-    }
+    PackHelper::escape_data(data, transferred_data);
 }
 
 void TspProxy::de_transfer_message_data(const std::vector<uint8_t> &data, std::vector<uint8_t> &de_transferred_data) {
-    for(auto iter = data.begin(); iter != data.end(); ++iter) {
-        if(*iter != 0x3D){
-            de_transferred_data.push_back(*iter);
-        }else {
-            ++iter;
-            uint8_t data = *iter;
-            data = data ^ 0x3D;
-            de_transferred_data.push_back(data);
-        }
-    }
+    PackHelper::unescape_data(data, de_transferred_data);
 }
 
 void TspProxy::parse_header_and_msg_body(const std::vector<uint8_t> &msg,
@@ -487,12 +472,12 @@ bool TspProxy::get_event_topic(const std::vector<uint8_t>& msg_body, std::string
     const auto iter = local_event_topics_map_.find(event_id);
     if(iter != local_event_topics_map_.end()){
         str_topic = iter->second;
-        TB_LOG_INFO("TspProxy::get_event_topic sid:%d, mid:%d, topic:%s", u_sid, u_mid, str_topic.c_str());
+        TB_LOG_INFO_RATE_LIMITED(10U, "TspProxy::get_event_topic sid:%d, mid:%d, topic:%s", u_sid, u_mid, str_topic.c_str());
         return is_local;
     }
     is_local = false;
     //str_topic = CloudManager::get_instance().get_event_topic(u_sid, u_mid);
-    TB_LOG_INFO("TspProxy::get_event_topic sid:%d, mid:%d, topic:%s", u_sid, u_mid, str_topic.c_str());
+    TB_LOG_INFO_RATE_LIMITED(10U, "TspProxy::get_event_topic sid:%d, mid:%d, topic:%s", u_sid, u_mid, str_topic.c_str());
      return is_local;
 }
 
@@ -526,12 +511,15 @@ void TspProxy::start_to_login() {
     body.content.push_back(tlv);
 
     tlv.type = 4008; // 登录签名 sha256(md5(终端证书公钥文件)+ deviceTime)
-    std::string str_md5{};// CloudManager::get_instance().md5_public_key_file();
-    transform(str_md5.begin(),str_md5.end(), str_md5.begin(), toupper);
-    std::string str_sign{}; //CloudManager::get_instance().sha256_sign(str_md5, u_device_tm);
-    transform(str_sign.begin(),str_sign.end(), str_sign.begin(), toupper);
+    // 公钥文件的md5和签名中与时间无关的部分在文件更新前只计算一次
+    // 公钥文件取自tsp client当前的配置, 未配置时与原来一样发送空的签名
+    const std::string str_public_key_path = tsp_client_->get_config().str_public_key_path;
     tlv.value.clear();
-    convert_hex_string_to_vector(str_sign, tlv.value);
+    if (!str_public_key_path.empty() &&
+        !CredentialCache::instance().login_signature(str_public_key_path, u_device_tm, tlv.value)) {
+        TB_LOG_ERROR("TspProxy::start_to_login sign with public key file %s failed\n", str_public_key_path.c_str());
+        tlv.value.clear();
+    }
     tlv.short_length = tlv.value.size();
     body.content.push_back(tlv);
 